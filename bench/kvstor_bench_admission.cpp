@@ -0,0 +1,85 @@
+﻿// kvstor_bench_admission : hit ratio of LRU and TinyLFU admission on a Zipf working set polluted by one-hit wonders
+//
+// usage: kvstor_bench_admission [keys=100000] [operations=2000000] [one_hit_percent=30] [skew=0.9]
+
+#include "kvstor.h"
+#include "kvstor_workload.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct tinylfu_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        using admission_t = kvstor::tinylfu_admission_t;
+    };
+
+
+    // get-or-load: a miss loads the key and pushes it
+    template <class stor_t>
+    double hit_ratio(size_t capacity, size_t keys, size_t operations, unsigned one_hit_percent, double skew)
+    {
+        stor_t stor{ capacity };
+        const kvstor_bench::zipf_t zipf{ keys, skew };
+        kvstor_bench::random_t random{ 42 };
+
+        uint64_t one_hit_key = keys;
+        size_t hits = 0;
+        size_t lookups = 0;
+
+        for (size_t i = 0; i < operations; ++i)
+        {
+            if (random.below(100) < one_hit_percent)
+            {
+                // crawler traffic, never requested again
+                stor.push(one_hit_key, one_hit_key);
+                ++one_hit_key;
+                continue;
+            }
+
+            const uint64_t key = zipf(random);
+            ++lookups;
+
+            if (stor.find(key))
+                ++hits;
+            else
+                stor.push(key, key);
+        }
+
+        return lookups ? 100.0 * hits / lookups : 0;
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const size_t keys = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 100000;
+    const size_t operations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2000000;
+    const unsigned one_hit_percent = argc > 3 ? static_cast<unsigned>(std::strtoul(argv[3], nullptr, 10)) : 30;
+    const double skew = argc > 4 ? std::strtod(argv[4], nullptr) : 0.9;
+
+    std::cout << "keys: " << keys << ", operations: " << operations
+        << ", one-hit wonders: " << one_hit_percent << " %, skew: " << skew << std::endl;
+
+    using lru_t = kvstor::storage_t<uint64_t, uint64_t, kvstor::fast_hash_traits_t<uint64_t, uint64_t>>;
+    using tinylfu_t = kvstor::storage_t<uint64_t, uint64_t, tinylfu_traits_t<uint64_t, uint64_t>>;
+
+    for (size_t percent : { 1, 5, 10, 25 })
+    {
+        const size_t capacity = std::max<size_t>(keys * percent / 100, 1);
+
+        std::cout << "capacity " << capacity
+            << "\tLRU: " << hit_ratio<lru_t>(capacity, keys, operations, one_hit_percent, skew) << " %"
+            << "\tTinyLFU: " << hit_ratio<tinylfu_t>(capacity, keys, operations, one_hit_percent, skew) << " %"
+            << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+﻿// kvstor_bench_combining : write throughput of the mutex and the flat combining write paths under contention
+//
+// usage: kvstor_bench_combining [milliseconds=1000] [keys=100000] [mix=10/80/5/5] [threads=8,16,32,64]
+
+#include "kvstor.h"
+#include "kvstor_workload.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct combining_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool flat_combining = true;
+    };
+
+
+    uint64_t make_value(uint64_t key, size_t)
+    {
+        return key;
+    }
+
+
+    template <class stor_t>
+    double run(const kvstor_bench::workload_config_t & config, size_t threads, std::chrono::milliseconds duration)
+    {
+        stor_t stor{ config.keys / 2 };
+        for (uint64_t key = 0; key < config.keys / 2; ++key)
+            stor.push(key, key);
+
+        std::atomic<bool> start{ false };
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> operations{ 0 };
+
+        auto worker = [&](uint64_t stream)
+        {
+            kvstor_bench::workload_t workload{ config, stream };
+
+            while (!start)
+                std::this_thread::yield();
+
+            uint64_t count = 0;
+            while (!stop)
+            {
+                for (size_t i = 0; i < 64; ++i)
+                    kvstor_bench::apply(stor, workload.next(), make_value);
+
+                count += 64;
+            }
+
+            operations += count;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(worker, i);
+
+        start = true;
+        std::this_thread::sleep_for(duration);
+        stop = true;
+
+        for (std::thread & thread : workers)
+            thread.join();
+
+        return operations / std::chrono::duration<double>(duration).count();
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const std::chrono::milliseconds duration{ argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000 };
+
+    kvstor_bench::workload_config_t config;
+    config.keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000;
+    config.mix = kvstor_bench::parse_mix(argc > 3 ? argv[3] : "10/80/5/5");
+
+    std::vector<size_t> thread_counts;
+    std::istringstream list{ argc > 4 ? argv[4] : "8,16,32,64" };
+    for (std::string item; std::getline(list, item, ',');)
+        thread_counts.push_back(std::strtoul(item.c_str(), nullptr, 10));
+
+    std::cout << "keys: " << config.keys << ", capacity: " << config.keys / 2
+        << ", mix (read/write/cas/erase): " << config.mix.read << "/" << config.mix.write << "/" << config.mix.cas << "/" << config.mix.erase
+        << ", duration: " << duration.count() << " ms, hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+
+    using mutex_stor_t = kvstor::storage_t<uint64_t, uint64_t, kvstor::fast_hash_traits_t<uint64_t, uint64_t>>;
+    using combining_stor_t = kvstor::storage_t<uint64_t, uint64_t, combining_traits_t<uint64_t, uint64_t>>;
+
+    for (size_t threads : thread_counts)
+    {
+        std::cout << "threads " << threads
+            << "\tmutex: " << run<mutex_stor_t>(config, threads, duration) / 1e6 << " Mops/s"
+            << "\tflat combining: " << run<combining_stor_t>(config, threads, duration) / 1e6 << " Mops/s"
+            << std::endl;
+    }
+
+    return 0;
+}
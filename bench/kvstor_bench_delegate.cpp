@@ -0,0 +1,134 @@
+﻿// kvstor_bench_delegate : write throughput of the shared lock and the delegated single-writer storage under contention
+//
+// usage: kvstor_bench_delegate [milliseconds=1000] [keys=100000] [mix=20/75/0/5] [threads=8,16,32,64]
+
+#include "kvstor.h"
+#include "kvstor_delegate.h"
+#include "kvstor_workload.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+    using stor_t = kvstor::storage_t<uint64_t, uint64_t, lock_free_traits_t<uint64_t, uint64_t>>;
+    using delegated_stor_t = kvstor::delegated_storage_t<stor_t>;
+
+
+    // compare_exchange needs a synchronous result, the delegated storage runs it as a write
+    template <class target_t>
+    void apply(target_t & stor, const kvstor_bench::operation_t & operation)
+    {
+        switch (operation.op)
+        {
+        case kvstor_bench::op_t::read:
+            stor.find(operation.key);
+            break;
+
+        case kvstor_bench::op_t::write:
+        case kvstor_bench::op_t::cas:
+            stor.push(operation.key, operation.key);
+            break;
+
+        case kvstor_bench::op_t::erase:
+            stor.erase(operation.key);
+            break;
+        }
+    }
+
+
+    template <class target_t>
+    double run(const kvstor_bench::workload_config_t & config, size_t threads, std::chrono::milliseconds duration)
+    {
+        target_t stor{ config.keys / 2 };
+        for (uint64_t key = 0; key < config.keys / 2; ++key)
+            stor.push(key, key);
+
+        std::atomic<bool> start{ false };
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> operations{ 0 };
+
+        auto worker = [&](uint64_t stream)
+        {
+            kvstor_bench::workload_t workload{ config, stream };
+
+            while (!start)
+                std::this_thread::yield();
+
+            uint64_t count = 0;
+            while (!stop)
+            {
+                for (size_t i = 0; i < 64; ++i)
+                    apply(stor, workload.next());
+
+                count += 64;
+            }
+
+            operations += count;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(worker, i);
+
+        const auto started = std::chrono::steady_clock::now();
+        start = true;
+        std::this_thread::sleep_for(duration);
+        stop = true;
+
+        for (std::thread & thread : workers)
+            thread.join();
+
+        // the queued writes are part of the work
+        if constexpr (!std::is_same_v<target_t, stor_t>)
+            stor.flush();
+
+        return operations / std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const std::chrono::milliseconds duration{ argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000 };
+
+    kvstor_bench::workload_config_t config;
+    config.keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000;
+    config.mix = kvstor_bench::parse_mix(argc > 3 ? argv[3] : "20/75/0/5");
+
+    std::vector<size_t> thread_counts;
+    std::istringstream list{ argc > 4 ? argv[4] : "8,16,32,64" };
+    for (std::string item; std::getline(list, item, ',');)
+        thread_counts.push_back(std::strtoul(item.c_str(), nullptr, 10));
+
+    std::cout << "keys: " << config.keys << ", capacity: " << config.keys / 2
+        << ", mix (read/write/cas/erase): " << config.mix.read << "/" << config.mix.write << "/" << config.mix.cas << "/" << config.mix.erase
+        << ", duration: " << duration.count() << " ms, hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+
+    for (size_t threads : thread_counts)
+    {
+        std::cout << "threads " << threads
+            << "\tshared lock: " << run<stor_t>(config, threads, duration) / 1e6 << " Mops/s"
+            << "\tdelegated: " << run<delegated_stor_t>(config, threads, duration) / 1e6 << " Mops/s"
+            << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+﻿// kvstor_bench_false_sharing : cost of cache lines shared between writers and readers of counters
+//
+// usage: kvstor_bench_false_sharing [milliseconds=1000] [writers=2] [pollers=0,1,2,4]
+//
+// First the push() throughput of one storage while threads poll size(): the counters of storage_t
+// are on their own cache line, so polling costs the writers only the lines of m_size and m_weight.
+// Then per-thread counters incremented in a packed array and in cache line aligned slots, like the shards
+// of sharded_storage_t: the packed slots share lines and every increment invalidates the other threads.
+
+#include "kvstor.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+    using stor_t = kvstor::storage_t<uint64_t, uint64_t, lock_free_traits_t<uint64_t, uint64_t>>;
+
+
+    struct packed_counter_t
+    {
+        std::atomic<uint64_t>   value{ 0 };
+    };
+
+
+    struct alignas(kvstor::cache_line_size) aligned_counter_t
+    {
+        std::atomic<uint64_t>   value{ 0 };
+    };
+
+
+    // runs body(index, stop) in the threads for the duration, returns the sum of the results per second
+    template <class body_t>
+    double measure(size_t threads, std::chrono::milliseconds duration, body_t body)
+    {
+        std::atomic<bool> start{ false };
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> operations{ 0 };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+        {
+            workers.emplace_back([&, i]
+            {
+                while (!start)
+                    std::this_thread::yield();
+
+                operations += body(i, stop);
+            });
+        }
+
+        const auto started = std::chrono::steady_clock::now();
+        start = true;
+        std::this_thread::sleep_for(duration);
+        stop = true;
+
+        for (std::thread & thread : workers)
+            thread.join();
+
+        return operations / std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+
+    // pushes per second and size() calls per second
+    std::pair<double, double> run_storage(size_t writers, size_t pollers, std::chrono::milliseconds duration)
+    {
+        constexpr uint64_t keys = 100000;
+        stor_t stor{ keys };
+
+        std::atomic<uint64_t> polled{ 0 };
+        const auto started = std::chrono::steady_clock::now();
+
+        const double pushes = measure(writers + pollers, duration, [&](size_t index, const std::atomic<bool> & stop)
+        {
+            uint64_t count = 0;
+
+            if (index >= writers)
+            {
+                size_t sum = 0;
+                while (!stop)
+                {
+                    sum += stor.size();
+                    ++count;
+                }
+
+                // the sum keeps the loads
+                polled += count + (sum == SIZE_MAX ? 1 : 0);
+                return uint64_t{ 0 };
+            }
+
+            for (uint64_t key = index; !stop; key += writers)
+            {
+                stor.push(key % keys, key);
+                ++count;
+            }
+
+            return count;
+        });
+
+        return { pushes, polled / std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count() };
+    }
+
+
+    template <class counter_t>
+    double run_counters(size_t threads, std::chrono::milliseconds duration)
+    {
+        std::vector<counter_t> counters(threads);
+
+        return measure(threads, duration, [&counters](size_t index, const std::atomic<bool> & stop)
+        {
+            uint64_t count = 0;
+            while (!stop)
+            {
+                counters[index].value.fetch_add(1, std::memory_order_relaxed);
+                ++count;
+            }
+
+            return count;
+        });
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const std::chrono::milliseconds duration{ argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000 };
+    const size_t writers = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 2;
+
+    std::vector<size_t> poller_counts;
+    std::istringstream list{ argc > 3 ? argv[3] : "0,1,2,4" };
+    for (std::string item; std::getline(list, item, ',');)
+        poller_counts.push_back(std::strtoul(item.c_str(), nullptr, 10));
+
+    std::cout << "writers: " << writers << ", duration: " << duration.count() << " ms, hardware threads: "
+        << std::thread::hardware_concurrency() << ", sizeof(storage_t): " << sizeof(stor_t) << std::endl;
+
+    for (size_t pollers : poller_counts)
+    {
+        const auto [pushes, polls] = run_storage(writers, pollers, duration);
+        std::cout << "size() pollers " << pollers
+            << "\tpush: " << pushes / 1e6 << " Mops/s"
+            << "\tsize(): " << polls / 1e6 << " Mops/s" << std::endl;
+    }
+
+    const size_t threads = writers + poller_counts.back();
+    std::cout << "counters " << threads
+        << "\tpacked: " << run_counters<packed_counter_t>(threads, duration) / 1e6 << " Mops/s"
+        << "\taligned: " << run_counters<aligned_counter_t>(threads, duration) / 1e6 << " Mops/s"
+        << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+﻿// kvstor_bench_find : find() throughput of the mutex and the lock-free read paths
+//
+// usage: kvstor_bench_find [threads=64] [milliseconds=1000] [keys=100000]
+
+#include "kvstor.h"
+#include "kvstor_workload.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    struct result_t
+    {
+        double reads_per_sec;
+        double writes_per_sec;
+    };
+
+
+    template <class stor_t>
+    result_t run(size_t threads, std::chrono::milliseconds duration, size_t keys)
+    {
+        stor_t stor{ keys };
+        for (size_t key = 0; key < keys; ++key)
+            stor.push(key, key);
+
+        std::atomic<bool> start{ false };
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> reads{ 0 };
+        std::atomic<uint64_t> writes{ 0 };
+
+        auto reader = [&](uint64_t seed)
+        {
+            kvstor_bench::random_t random{ seed };
+
+            while (!start)
+                std::this_thread::yield();
+
+            uint64_t count = 0;
+            uint64_t hits = 0;
+
+            while (!stop)
+            {
+                for (size_t i = 0; i < 256; ++i)
+                {
+                    hits += stor.find(random.below(keys)).has_value() ? 1 : 0;
+                }
+
+                count += 256;
+            }
+
+            reads += count;
+            if (hits == 0)
+                std::cerr << "no hits" << std::endl;
+        };
+
+        // a single writer keeps replacing entries while readers run
+        auto writer = [&]()
+        {
+            while (!start)
+                std::this_thread::yield();
+
+            uint64_t count = 0;
+            for (size_t key = 0; !stop; key = (key + 1) % keys)
+            {
+                stor.push(key, key + count);
+                ++count;
+            }
+
+            writes += count;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(reader, 0x9E3779B97F4A7C15ull * (i + 1));
+
+        workers.emplace_back(writer);
+
+        start = true;
+        std::this_thread::sleep_for(duration);
+        stop = true;
+
+        for (std::thread & worker : workers)
+            worker.join();
+
+        const double seconds = std::chrono::duration<double>(duration).count();
+        return result_t{ reads / seconds, writes / seconds };
+    }
+
+
+    void print(const char * name, const result_t & result)
+    {
+        std::cout << name
+            << "\tfind: " << result.reads_per_sec / 1e6 << " Mops/s"
+            << "\tpush: " << result.writes_per_sec / 1e6 << " Mops/s"
+            << std::endl;
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const size_t threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+    const std::chrono::milliseconds duration{ argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000 };
+    const size_t keys = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100000;
+
+    std::cout << "readers: " << threads << ", writers: 1, keys: " << keys
+        << ", duration: " << duration.count() << " ms" << std::endl;
+
+    using mutex_stor_t = kvstor::storage_t<size_t, size_t>;
+    using lock_free_stor_t = kvstor::storage_t<size_t, size_t, lock_free_traits_t<size_t, size_t>>;
+
+    print("mutex    ", run<mutex_stor_t>(threads, duration, keys));
+    print("lock-free", run<lock_free_stor_t>(threads, duration, keys));
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+﻿// kvstor_bench_hash : distribution and throughput of std::hash and kvstor::fast_hash_t
+// and find() throughput of both index engines with each of them
+//
+// usage: kvstor_bench_hash [keys=1000000] [lookups=10000000]
+
+#include "kvstor.h"
+#include "kvstor_workload.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct fast_lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    template <class key_type, class value_type>
+    struct std_lock_free_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    // keys sharing low bits, the worst case for power-of-two tables with an identity hash
+    std::vector<uint64_t> strided_keys(size_t count)
+    {
+        std::vector<uint64_t> keys(count);
+        for (size_t i = 0; i < count; ++i)
+            keys[i] = i * 4096;
+
+        return keys;
+    }
+
+
+    std::vector<std::string> string_keys(size_t count, size_t length)
+    {
+        std::vector<std::string> keys(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            keys[i] = "user:" + std::to_string(i) + ":";
+            keys[i].resize(std::max(length, keys[i].size()), 'x');
+        }
+
+        return keys;
+    }
+
+
+    // load of 2^bits buckets selected by the low bits of the hash, as concurrent_index_t does
+    template <class hash_type, class key_type>
+    void distribution(const char * name, const std::vector<key_type> & keys)
+    {
+        const size_t buckets = size_t{ 1 } << static_cast<size_t>(std::ceil(std::log2(keys.size())));
+        std::vector<size_t> load(buckets);
+
+        const hash_type hash{};
+        for (const key_type & key : keys)
+            ++load[hash(key) & (buckets - 1)];
+
+        const double mean = static_cast<double>(keys.size()) / buckets;
+        double variance = 0;
+        for (size_t count : load)
+            variance += (count - mean) * (count - mean);
+
+        const size_t empty = static_cast<size_t>(std::count(load.begin(), load.end(), size_t{ 0 }));
+
+        std::cout << name << "\tbuckets: " << buckets
+            << "\tmax load: " << *std::max_element(load.begin(), load.end())
+            << "\tempty: " << 100.0 * empty / buckets << " %"
+            << "\tstddev/ideal: " << std::sqrt(variance / buckets) / std::sqrt(mean)
+            << std::endl;
+    }
+
+
+    template <class hash_type, class key_type>
+    void throughput(const char * name, const std::vector<key_type> & keys, size_t rounds)
+    {
+        const hash_type hash{};
+        size_t sum = 0;
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t round = 0; round < rounds; ++round)
+        {
+            for (const key_type & key : keys)
+                sum += hash(key);
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << "\t" << seconds * 1e9 / (rounds * keys.size()) << " ns/hash\t(sum " << sum % 10 << ")" << std::endl;
+    }
+
+
+    template <class stor_t, class key_type>
+    void engine(const char * name, const std::vector<key_type> & keys, size_t lookups)
+    {
+        stor_t stor{ keys.size() };
+        for (size_t i = 0; i < keys.size(); ++i)
+            stor.push(keys[i], i);
+
+        size_t hits = 0;
+        kvstor_bench::random_t random{ 42 };
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i)
+        {
+            hits += stor.contains(keys[random.below(keys.size())]) ? 1 : 0;
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << "\t" << lookups / seconds / 1e6 << " M lookups/s\t(hits " << hits << ")" << std::endl;
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    const size_t lookups = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000000;
+
+    const std::vector<uint64_t> ints = strided_keys(count);
+    const std::vector<std::string> short_strings = string_keys(count, 16);
+    const std::vector<std::string> long_strings = string_keys(count / 10, 256);
+
+    std::cout << "keys: " << count << ", lookups: " << lookups << std::endl;
+
+    std::cout << std::endl << "distribution over power-of-two buckets" << std::endl;
+    distribution<std::hash<uint64_t>>("std::hash    strided u64", ints);
+    distribution<kvstor::fast_hash_t>("fast_hash_t  strided u64", ints);
+    distribution<std::hash<std::string>>("std::hash    string(16) ", short_strings);
+    distribution<kvstor::fast_hash_t>("fast_hash_t  string(16) ", short_strings);
+
+    std::cout << std::endl << "hash throughput" << std::endl;
+    throughput<std::hash<uint64_t>>("std::hash    u64        ", ints, 10);
+    throughput<kvstor::fast_hash_t>("fast_hash_t  u64        ", ints, 10);
+    throughput<std::hash<std::string>>("std::hash    string(16) ", short_strings, 10);
+    throughput<kvstor::fast_hash_t>("fast_hash_t  string(16) ", short_strings, 10);
+    throughput<std::hash<std::string>>("std::hash    string(256)", long_strings, 10);
+    throughput<kvstor::fast_hash_t>("fast_hash_t  string(256)", long_strings, 10);
+
+    // the strided keys collide under the identity hash unless the index mixes it before masking
+    const std::vector<uint64_t> engine_ints = strided_keys(std::min<size_t>(count, 100000));
+
+    std::cout << std::endl << "contains() of strided u64 keys" << std::endl;
+    engine<kvstor::storage_t<uint64_t, size_t>>("mutex      std::hash  ", engine_ints, lookups);
+    engine<kvstor::storage_t<uint64_t, size_t, kvstor::fast_hash_traits_t<uint64_t, size_t>>>("mutex      fast_hash_t", engine_ints, lookups);
+    engine<kvstor::storage_t<uint64_t, size_t, std_lock_free_traits_t<uint64_t, size_t>>>("lock-free  std::hash  ", engine_ints, lookups);
+    engine<kvstor::storage_t<uint64_t, size_t, fast_lock_free_traits_t<uint64_t, size_t>>>("lock-free  fast_hash_t", engine_ints, lookups);
+
+    std::cout << std::endl << "contains() of string(16) keys" << std::endl;
+    engine<kvstor::storage_t<std::string, size_t>>("mutex      std::hash  ", short_strings, lookups);
+    engine<kvstor::storage_t<std::string, size_t, kvstor::fast_hash_traits_t<std::string, size_t>>>("mutex      fast_hash_t", short_strings, lookups);
+    engine<kvstor::storage_t<std::string, size_t, std_lock_free_traits_t<std::string, size_t>>>("lock-free  std::hash  ", short_strings, lookups);
+    engine<kvstor::storage_t<std::string, size_t, fast_lock_free_traits_t<std::string, size_t>>>("lock-free  fast_hash_t", short_strings, lookups);
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+﻿// kvstor_bench_latency : open-loop find()/push() latency percentiles at a fixed request rate
+//
+// usage: kvstor_bench_latency [rate=100000] [threads=4] [milliseconds=2000] [keys=100000] [mix=90/10/0/0] [skew=0.99]
+//
+// Every thread issues rate / threads requests per second on a fixed schedule, whether or not the previous request
+// has completed. "service" is the time from the actual start of a request, "response" is the time from its scheduled
+// start, so a stall delays every request scheduled behind it instead of hiding them (coordinated omission).
+
+#include "kvstor.h"
+#include "kvstor_histogram.h"
+#include "kvstor_workload.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    using clock_t = std::chrono::steady_clock;
+
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    template <class key_type, class value_type>
+    struct tinylfu_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        using admission_t = kvstor::tinylfu_admission_t;
+    };
+
+
+    template <class key_type, class value_type>
+    struct watermark_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr size_t low_watermark = 95;
+    };
+
+
+    struct result_t
+    {
+        kvstor_bench::histogram_t   service;
+        kvstor_bench::histogram_t   response;
+        uint64_t                    late = 0;
+    };
+
+
+    std::string make_value(uint64_t, size_t size)
+    {
+        return std::string(size, 'v');
+    }
+
+
+    uint64_t nanoseconds(clock_t::duration duration)
+    {
+        return static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), 0));
+    }
+
+
+    template <class stor_t>
+    result_t run(const kvstor_bench::workload_config_t & config, double rate, size_t threads, std::chrono::milliseconds duration)
+    {
+        stor_t stor{ config.keys / 2 };
+
+        kvstor_bench::workload_t warmup{ config, threads };
+        for (size_t i = 0; i < config.keys; ++i)
+            stor.push(warmup.next_key(kvstor_bench::op_t::write), make_value(0, warmup.next_value_size()));
+
+        const auto interval = std::chrono::duration_cast<clock_t::duration>(std::chrono::duration<double>(threads / rate));
+        const auto start = clock_t::now() + std::chrono::milliseconds(10);
+        const auto finish = start + duration;
+
+        std::vector<result_t> results(threads);
+
+        auto worker = [&](size_t thread)
+        {
+            kvstor_bench::workload_t workload{ config, thread };
+            result_t & result = results[thread];
+
+            // threads are phase-shifted so their requests interleave evenly
+            auto scheduled = start + interval * thread / threads;
+
+            for (; scheduled < finish; scheduled += interval)
+            {
+                auto now = clock_t::now();
+                if (scheduled - now > std::chrono::microseconds(200))
+                    std::this_thread::sleep_until(scheduled - std::chrono::microseconds(100));
+
+                while ((now = clock_t::now()) < scheduled)
+                    std::this_thread::yield();
+
+                if (now - scheduled > interval)
+                    ++result.late;
+
+                kvstor_bench::apply(stor, workload.next(), make_value);
+
+                const auto done = clock_t::now();
+                result.service.record(nanoseconds(done - now));
+                result.response.record(nanoseconds(done - scheduled));
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threads; ++i)
+            workers.emplace_back(worker, i);
+
+        worker(0);
+        for (std::thread & thread : workers)
+            thread.join();
+
+        result_t total;
+        for (const result_t & result : results)
+        {
+            total.service.add(result.service);
+            total.response.add(result.response);
+            total.late += result.late;
+        }
+
+        return total;
+    }
+
+
+    void print_histogram(const char * name, const kvstor_bench::histogram_t & histogram)
+    {
+        std::cout << "  " << name
+            << "\tp50: " << histogram.percentile(50)
+            << "\tp90: " << histogram.percentile(90)
+            << "\tp99: " << histogram.percentile(99)
+            << "\tp99.9: " << histogram.percentile(99.9)
+            << "\tp99.99: " << histogram.percentile(99.99)
+            << "\tmax: " << histogram.max()
+            << std::endl;
+    }
+
+
+    void print(const char * name, const result_t & result, std::chrono::milliseconds duration)
+    {
+        const double seconds = std::chrono::duration<double>(duration).count();
+
+        std::cout << name << "\trequests: " << result.response.count()
+            << "\tachieved: " << result.response.count() / seconds << " req/s"
+            << "\tstarted late: " << 100.0 * result.late / std::max<uint64_t>(result.response.count(), 1) << " %"
+            << "\t(latencies in ns)" << std::endl;
+
+        print_histogram("service ", result.service);
+        print_histogram("response", result.response);
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const double rate = argc > 1 ? std::strtod(argv[1], nullptr) : 100000;
+    const size_t threads = std::max<size_t>(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4, 1);
+    const std::chrono::milliseconds duration{ argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 2000 };
+
+    kvstor_bench::workload_config_t config;
+    config.keys = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 100000;
+    config.mix = kvstor_bench::parse_mix(argc > 5 ? argv[5] : "90/10/0/0");
+    config.skew = argc > 6 ? std::strtod(argv[6], nullptr) : 0.99;
+    config.min_value_size = 16;
+    config.max_value_size = 256;
+
+    std::cout << "target rate: " << rate << " req/s, threads: " << threads << ", keys: " << config.keys
+        << ", capacity: " << config.keys / 2 << ", mix (read/write/cas/erase): " << config.mix.read << "/" << config.mix.write
+        << "/" << config.mix.cas << "/" << config.mix.erase << ", skew: " << config.skew
+        << ", duration: " << duration.count() << " ms" << std::endl;
+
+    using mutex_stor_t = kvstor::storage_t<uint64_t, std::string, kvstor::fast_hash_traits_t<uint64_t, std::string>>;
+    using lock_free_stor_t = kvstor::storage_t<uint64_t, std::string, lock_free_traits_t<uint64_t, std::string>>;
+    using tinylfu_stor_t = kvstor::storage_t<uint64_t, std::string, tinylfu_traits_t<uint64_t, std::string>>;
+    using watermark_stor_t = kvstor::storage_t<uint64_t, std::string, watermark_traits_t<uint64_t, std::string>>;
+
+    print("mutex    ", run<mutex_stor_t>(config, rate, threads, duration), duration);
+    print("lock-free", run<lock_free_stor_t>(config, rate, threads, duration), duration);
+    print("tinylfu  ", run<tinylfu_stor_t>(config, rate, threads, duration), duration);
+    print("watermark", run<watermark_stor_t>(config, rate, threads, duration), duration);
+
+    return 0;
+}
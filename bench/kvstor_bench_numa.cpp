@@ -0,0 +1,114 @@
+﻿// kvstor_bench_numa : throughput of one storage and of NUMA-sharded storages when every thread owns its keys
+//
+// usage: kvstor_bench_numa [milliseconds=1000] [keys per thread=100000] [threads=0 (2 per node)] [reads per write=4]
+//
+// Threads are bound round-robin to the nodes and write and read their own key range,
+// with the local route the keys of a thread never leave its node.
+// On a single-node machine the numbers show the cost of the sharding alone.
+
+#include "kvstor.h"
+#include "kvstor_numa.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_numa_traits_t : kvstor::numa_traits_t<key_type, value_type>
+    {
+        using hash_t = kvstor::fast_hash_t;
+
+        static constexpr bool lock_free_find = true;
+        static constexpr bool presize_index = true;
+    };
+
+    using stor_t = kvstor::storage_t<uint64_t, uint64_t, lock_free_numa_traits_t<uint64_t, uint64_t>>;
+    using sharded_stor_t = kvstor::sharded_storage_t<stor_t>;
+
+
+    template <class make_t>
+    double run(size_t threads, size_t keys, size_t reads, std::chrono::milliseconds duration, make_t make)
+    {
+        auto stor = make(threads * keys);
+
+        std::atomic<bool> start{ false };
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> operations{ 0 };
+
+        auto worker = [&](size_t index)
+        {
+            const size_t node = index % kvstor::numa_t::nodes();
+            kvstor::numa_t::bind_thread(node);
+            const kvstor::numa_scope_t scope{ node };
+
+            const uint64_t first = index * keys;
+
+            while (!start)
+                std::this_thread::yield();
+
+            uint64_t count = 0;
+            uint64_t key = 0;
+            while (!stop)
+            {
+                stor->push(first + key, key);
+                for (size_t i = 0; i < reads; ++i)
+                    stor->find(first + (key * 7 + i) % keys);
+
+                key = key + 1 < keys ? key + 1 : 0;
+                count += 1 + reads;
+            }
+
+            operations += count;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(worker, i);
+
+        const auto started = std::chrono::steady_clock::now();
+        start = true;
+        std::this_thread::sleep_for(duration);
+        stop = true;
+
+        for (std::thread & thread : workers)
+            thread.join();
+
+        return operations / std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const std::chrono::milliseconds duration{ argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000 };
+    const size_t keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000;
+    const size_t nodes = kvstor::numa_t::nodes();
+    const size_t threads = argc > 3 && std::strtoul(argv[3], nullptr, 10) > 0 ? std::strtoul(argv[3], nullptr, 10) : 2 * nodes;
+    const size_t reads = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 4;
+
+    std::cout << "libnuma: " << (kvstor::numa_t::available() ? "yes" : "no") << ", nodes: " << nodes
+        << ", threads: " << threads << ", keys per thread: " << keys << ", reads per write: " << reads
+        << ", duration: " << duration.count() << " ms" << std::endl;
+
+    std::cout << "single storage  \t" << run(threads, keys, reads, duration,
+        [](size_t max_size) { return std::make_unique<stor_t>(max_size); }) / 1e6 << " Mops/s" << std::endl;
+
+    std::cout << "sharded (hash)  \t" << run(threads, keys, reads, duration,
+        [](size_t max_size) { return std::make_unique<sharded_stor_t>(max_size, kvstor::numa_route_t::hash); }) / 1e6 << " Mops/s" << std::endl;
+
+    // every node may hold all keys of its threads in one shard
+    std::cout << "sharded (local) \t" << run(threads, keys, reads, duration,
+        [nodes](size_t max_size) { return std::make_unique<sharded_stor_t>(max_size * nodes, kvstor::numa_route_t::local); }) / 1e6 << " Mops/s" << std::endl;
+
+    return 0;
+}
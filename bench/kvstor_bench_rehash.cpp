@@ -0,0 +1,86 @@
+﻿// kvstor_bench_rehash : push() latency while an empty storage fills up and its indexes grow
+//
+// usage: kvstor_bench_rehash [entries=2000000]
+//
+// The maximum is the stall of the largest rehash; presized indexes never rehash,
+// the lock-free index copies its buckets incrementally but std::unordered_map still rehashes at once.
+
+#include "kvstor.h"
+#include "kvstor_histogram.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+
+namespace
+{
+
+    using clock_t = std::chrono::steady_clock;
+
+
+    template <class key_type, class value_type>
+    struct presized_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool presize_index = true;
+    };
+
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    template <class key_type, class value_type>
+    struct lock_free_presized_traits_t : lock_free_traits_t<key_type, value_type>
+    {
+        static constexpr bool presize_index = true;
+    };
+
+
+    template <class stor_t>
+    void run(const char * name, size_t entries)
+    {
+        const auto started = clock_t::now();
+
+        stor_t stor{ entries };
+        const auto constructed = clock_t::now();
+
+        kvstor_bench::histogram_t latency;
+
+        for (uint64_t key = 0; key < entries; ++key)
+        {
+            const auto start = clock_t::now();
+            stor.push(key, key);
+            latency.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() - start).count()));
+        }
+
+        const auto finished = clock_t::now();
+
+        std::cout << name
+            << "\tconstructor: " << std::chrono::duration_cast<std::chrono::milliseconds>(constructed - started).count() << " ms"
+            << "\tfill: " << std::chrono::duration_cast<std::chrono::milliseconds>(finished - constructed).count() << " ms"
+            << "\tp50: " << latency.percentile(50)
+            << "\tp99.99: " << latency.percentile(99.99)
+            << "\tmax: " << latency.max() << " ns" << std::endl;
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const size_t entries = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+    std::cout << "entries: " << entries << std::endl;
+
+    run<kvstor::storage_t<uint64_t, uint64_t, kvstor::fast_hash_traits_t<uint64_t, uint64_t>>>("mutex             ", entries);
+    run<kvstor::storage_t<uint64_t, uint64_t, presized_traits_t<uint64_t, uint64_t>>>("mutex presized    ", entries);
+    run<kvstor::storage_t<uint64_t, uint64_t, lock_free_traits_t<uint64_t, uint64_t>>>("lock-free         ", entries);
+    run<kvstor::storage_t<uint64_t, uint64_t, lock_free_presized_traits_t<uint64_t, uint64_t>>>("lock-free presized", entries);
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+﻿// kvstor_bench_scan : full scans through map(), for_each() and parallel_for_each()
+//
+// usage: kvstor_bench_scan [entries=10000000] [threads=0]
+
+#include "kvstor.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+
+namespace
+{
+
+    template <class func_type>
+    void measure(const char * name, size_t entries, func_type && scan)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t sum = scan();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << name << "\t" << seconds * 1e3 << " ms\t"
+            << entries / seconds / 1e6 << " M entries/s\t(sum " << sum << ")" << std::endl;
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const size_t entries = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+    const size_t threads = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0;
+
+    using stor_t = kvstor::storage_t<uint64_t, uint64_t>;
+    stor_t stor{ entries };
+
+    for (uint64_t key = 0; key < entries; ++key)
+        stor.push(key, key);
+
+    const stor_t & const_stor = stor;
+    std::cout << "entries: " << entries << std::endl;
+
+    measure("map()              ", entries, [&const_stor]()
+    {
+        uint64_t sum = 0;
+        const_stor.map([&sum](const uint64_t &, const uint64_t & value) { sum += value; });
+        return sum;
+    });
+
+    measure("for_each()         ", entries, [&const_stor]()
+    {
+        uint64_t sum = 0;
+        const_stor.for_each([&sum](const uint64_t &, const uint64_t & value) { sum += value; });
+        return sum;
+    });
+
+    measure("parallel_for_each()", entries, [&const_stor, threads]()
+    {
+        std::atomic<uint64_t> sum{ 0 };
+        const_stor.parallel_for_each([&sum](const uint64_t &, const uint64_t & value)
+        {
+            sum.fetch_add(value, std::memory_order_relaxed);
+        }, threads);
+        return sum.load();
+    });
+
+    return 0;
+}
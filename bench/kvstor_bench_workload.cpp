@@ -0,0 +1,165 @@
+﻿// kvstor_bench_workload : throughput and read hit ratio of both index engines under synthetic workloads
+//
+// usage: kvstor_bench_workload [threads=4] [milliseconds=1000] [keys=100000] [capacity_percent=25]
+//                              [mix=90/8/1/1] [value_size=16-256] [skew=0.99] [pattern=all] [value_sizes=uniform]
+
+#include "kvstor.h"
+#include "kvstor_workload.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    struct result_t
+    {
+        double ops_per_sec;
+        double hit_ratio;
+    };
+
+
+    std::string make_value(uint64_t, size_t size)
+    {
+        return std::string(size, 'v');
+    }
+
+
+    template <class stor_t>
+    result_t run(const kvstor_bench::workload_config_t & config, size_t threads, std::chrono::milliseconds duration, size_t capacity)
+    {
+        stor_t stor{ capacity };
+
+        // warm up with the first capacity keys of the pattern
+        kvstor_bench::workload_t warmup{ config, threads };
+        for (size_t i = 0; i < capacity; ++i)
+            stor.push(warmup.next_key(kvstor_bench::op_t::write), make_value(0, warmup.next_value_size()));
+
+        std::atomic<bool> start{ false };
+        std::atomic<bool> stop{ false };
+        std::atomic<uint64_t> operations{ 0 };
+        std::atomic<uint64_t> reads{ 0 };
+        std::atomic<uint64_t> hits{ 0 };
+
+        auto worker = [&](uint64_t stream)
+        {
+            kvstor_bench::workload_t workload{ config, stream };
+
+            while (!start)
+                std::this_thread::yield();
+
+            uint64_t count = 0;
+            uint64_t read_count = 0;
+            uint64_t hit_count = 0;
+
+            while (!stop)
+            {
+                for (size_t i = 0; i < 256; ++i)
+                {
+                    const kvstor_bench::operation_t operation = workload.next();
+                    const bool hit = kvstor_bench::apply(stor, operation, make_value);
+
+                    if (operation.op == kvstor_bench::op_t::read)
+                    {
+                        ++read_count;
+                        hit_count += hit ? 1 : 0;
+                    }
+                }
+
+                count += 256;
+            }
+
+            operations += count;
+            reads += read_count;
+            hits += hit_count;
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back(worker, i);
+
+        start = true;
+        std::this_thread::sleep_for(duration);
+        stop = true;
+
+        for (std::thread & thread : workers)
+            thread.join();
+
+        const double seconds = std::chrono::duration<double>(duration).count();
+        return result_t{ operations / seconds, reads ? 100.0 * hits / reads : 0.0 };
+    }
+
+
+    void print(const char * name, const result_t & result)
+    {
+        std::cout << "\t" << name << ": " << result.ops_per_sec / 1e6 << " Mops/s, hits " << result.hit_ratio << " %";
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    const size_t threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4;
+    const std::chrono::milliseconds duration{ argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000 };
+
+    kvstor_bench::workload_config_t config;
+    config.keys = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 100000;
+
+    const size_t capacity_percent = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 25;
+    config.mix = kvstor_bench::parse_mix(argc > 5 ? argv[5] : "90/8/1/1");
+
+    const std::string value_size = argc > 6 ? argv[6] : "16-256";
+    config.min_value_size = std::strtoul(value_size.c_str(), nullptr, 10);
+    config.max_value_size = value_size.find('-') == std::string::npos
+        ? config.min_value_size
+        : std::strtoul(value_size.c_str() + value_size.find('-') + 1, nullptr, 10);
+
+    config.skew = argc > 7 ? std::strtod(argv[7], nullptr) : 0.99;
+    config.value_sizes = kvstor_bench::parse_size_distribution(argc > 9 ? argv[9] : "uniform");
+    config.streams = std::max<size_t>(threads, 1);
+
+    std::vector<kvstor_bench::pattern_t> patterns{ kvstor_bench::pattern_t::uniform, kvstor_bench::pattern_t::zipf,
+        kvstor_bench::pattern_t::hotspot, kvstor_bench::pattern_t::scan, kvstor_bench::pattern_t::latest };
+
+    if (argc > 8 && std::string(argv[8]) != "all")
+        patterns = { kvstor_bench::parse_pattern(argv[8]) };
+
+    const size_t capacity = std::max<size_t>(config.keys * capacity_percent / 100, 1);
+
+    std::cout << "threads: " << threads << ", keys: " << config.keys << ", capacity: " << capacity
+        << ", mix (read/write/cas/erase): " << config.mix.read << "/" << config.mix.write << "/" << config.mix.cas << "/" << config.mix.erase
+        << ", value size: " << config.min_value_size << "-" << config.max_value_size
+        << " " << kvstor_bench::size_distribution_name(config.value_sizes) << ", skew: " << config.skew
+        << ", duration: " << duration.count() << " ms" << std::endl;
+
+    using mutex_stor_t = kvstor::storage_t<uint64_t, std::string, kvstor::fast_hash_traits_t<uint64_t, std::string>>;
+    using lock_free_stor_t = kvstor::storage_t<uint64_t, std::string, lock_free_traits_t<uint64_t, std::string>>;
+
+    for (kvstor_bench::pattern_t pattern : patterns)
+    {
+        config.pattern = pattern;
+
+        std::cout << kvstor_bench::pattern_name(pattern);
+        print("mutex", run<mutex_stor_t>(config, threads, duration, capacity));
+        print("lock-free", run<lock_free_stor_t>(config, threads, duration, capacity));
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
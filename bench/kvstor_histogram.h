@@ -0,0 +1,227 @@
+﻿// kvstor_histogram.h : HDR latency histogram for kvstor benchmarks
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+
+namespace kvstor_bench
+{
+
+    // log-linear histogram of values in [1, highest] keeping significant_digits decimal digits of each value
+    // (the HdrHistogram layout): the values are split into power-of-two buckets,
+    // each bucket into the same number of linear sub-buckets
+    class histogram_t
+    {
+    public:
+        explicit histogram_t(uint64_t highest = 60ull * 1000 * 1000 * 1000, unsigned significant_digits = 3);
+
+        // values above highest are counted as highest
+        void record(uint64_t value, uint64_t count = 1) noexcept;
+
+        // records the value and the samples a closed-loop caller missed while it was blocked:
+        // value - interval, value - 2 * interval, ... down to interval (coordinated omission correction)
+        void record_corrected(uint64_t value, uint64_t expected_interval) noexcept;
+
+        void add(const histogram_t & other);
+        void reset() noexcept;
+
+        uint64_t count() const noexcept { return m_total; }
+        uint64_t min() const noexcept { return m_total ? m_min : 0; }
+        uint64_t max() const noexcept { return m_max; }
+        double mean() const noexcept;
+
+        // the highest value equivalent to the one at the given percentile, percent in [0, 100]
+        uint64_t percentile(double percent) const noexcept;
+
+    private:
+        size_t index_of(uint64_t value) const noexcept;
+        uint64_t highest_equivalent(size_t index) const noexcept;
+
+        static unsigned bit_length(uint64_t value) noexcept;
+
+    private:
+        uint64_t                m_highest;
+        unsigned                m_significant_digits;
+        unsigned                m_sub_bucket_half_magnitude;
+        uint64_t                m_sub_bucket_half_count;
+        uint64_t                m_sub_bucket_mask;
+        std::vector<uint64_t>   m_counts;
+        uint64_t                m_total;
+        uint64_t                m_min;
+        uint64_t                m_max;
+    };
+
+
+    inline histogram_t::histogram_t(uint64_t highest, unsigned significant_digits)
+    :   m_highest(highest)
+    ,   m_significant_digits(significant_digits)
+    ,   m_sub_bucket_half_magnitude(0)
+    ,   m_sub_bucket_half_count(0)
+    ,   m_sub_bucket_mask(0)
+    ,   m_counts()
+    ,   m_total(0)
+    ,   m_min(UINT64_MAX)
+    ,   m_max(0)
+    {
+        if (significant_digits < 1 || significant_digits > 5)
+            throw std::invalid_argument("kvstor_bench: histogram_t keeps 1 to 5 significant digits");
+
+        if (highest < 2)
+            throw std::invalid_argument("kvstor_bench: histogram_t highest value must be at least 2");
+
+        // enough linear sub-buckets to tell apart values differing in the last significant digit
+        const double largest_single_unit = 2.0 * std::pow(10.0, significant_digits);
+        const unsigned sub_bucket_magnitude = static_cast<unsigned>(std::ceil(std::log2(largest_single_unit)));
+
+        m_sub_bucket_half_magnitude = sub_bucket_magnitude - 1;
+        m_sub_bucket_half_count = uint64_t{ 1 } << m_sub_bucket_half_magnitude;
+        m_sub_bucket_mask = (uint64_t{ 1 } << sub_bucket_magnitude) - 1;
+
+        uint64_t smallest_untrackable = uint64_t{ 1 } << sub_bucket_magnitude;
+        size_t buckets = 1;
+
+        while (smallest_untrackable <= highest)
+        {
+            ++buckets;
+            if (smallest_untrackable > UINT64_MAX / 2)
+                break;
+
+            smallest_untrackable <<= 1;
+        }
+
+        m_counts.resize((buckets + 1) * m_sub_bucket_half_count);
+    }
+
+
+    inline void histogram_t::record(uint64_t value, uint64_t count) noexcept
+    {
+        value = std::min(value, m_highest);
+
+        m_counts[index_of(value)] += count;
+        m_total += count;
+        m_min = std::min(m_min, value);
+        m_max = std::max(m_max, value);
+    }
+
+
+    inline void histogram_t::record_corrected(uint64_t value, uint64_t expected_interval) noexcept
+    {
+        record(value);
+
+        if (expected_interval == 0)
+            return;
+
+        for (uint64_t missing = value > expected_interval ? value - expected_interval : 0; missing >= expected_interval; missing -= expected_interval)
+            record(missing);
+    }
+
+
+    inline void histogram_t::add(const histogram_t & other)
+    {
+        if (other.m_highest != m_highest || other.m_significant_digits != m_significant_digits)
+            throw std::invalid_argument("kvstor_bench: histogram_t layouts differ");
+
+        for (size_t i = 0; i < m_counts.size(); ++i)
+            m_counts[i] += other.m_counts[i];
+
+        m_total += other.m_total;
+        m_min = std::min(m_min, other.m_min);
+        m_max = std::max(m_max, other.m_max);
+    }
+
+
+    inline void histogram_t::reset() noexcept
+    {
+        std::fill(m_counts.begin(), m_counts.end(), 0);
+        m_total = 0;
+        m_min = UINT64_MAX;
+        m_max = 0;
+    }
+
+
+    inline double histogram_t::mean() const noexcept
+    {
+        if (m_total == 0)
+            return 0;
+
+        double sum = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i)
+        {
+            if (m_counts[i] != 0)
+                sum += static_cast<double>(m_counts[i]) * static_cast<double>(std::min(highest_equivalent(i), m_max));
+        }
+
+        return sum / static_cast<double>(m_total);
+    }
+
+
+    inline uint64_t histogram_t::percentile(double percent) const noexcept
+    {
+        if (m_total == 0)
+            return 0;
+
+        percent = std::min(std::max(percent, 0.0), 100.0);
+
+        const double wanted = std::ceil(percent / 100.0 * static_cast<double>(m_total));
+        const uint64_t rank = std::max<uint64_t>(static_cast<uint64_t>(wanted), 1);
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); ++i)
+        {
+            seen += m_counts[i];
+            if (seen >= rank)
+                return std::min(highest_equivalent(i), m_max);
+        }
+
+        return m_max;
+    }
+
+
+    inline size_t histogram_t::index_of(uint64_t value) const noexcept
+    {
+        // values below the first power-of-two bucket share bucket 0 with full resolution
+        const unsigned magnitude = bit_length(value | m_sub_bucket_mask);
+        const unsigned bucket = magnitude - (m_sub_bucket_half_magnitude + 1);
+        const uint64_t sub_bucket = value >> bucket;
+
+        return static_cast<size_t>((uint64_t{ bucket + 1 } << m_sub_bucket_half_magnitude) + (sub_bucket - m_sub_bucket_half_count));
+    }
+
+
+    inline uint64_t histogram_t::highest_equivalent(size_t index) const noexcept
+    {
+        const uint64_t position = static_cast<uint64_t>(index);
+        uint64_t sub_bucket = (position & (m_sub_bucket_half_count - 1)) + m_sub_bucket_half_count;
+        uint64_t bucket = position >> m_sub_bucket_half_magnitude;
+
+        if (bucket == 0)
+            sub_bucket -= m_sub_bucket_half_count;
+        else
+            --bucket;
+
+        return ((sub_bucket + 1) << bucket) - 1;
+    }
+
+
+    inline unsigned histogram_t::bit_length(uint64_t value) noexcept
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return value ? 64 - static_cast<unsigned>(__builtin_clzll(value)) : 0;
+#else
+        unsigned bits = 0;
+        while (value)
+        {
+            value >>= 1;
+            ++bits;
+        }
+
+        return bits;
+#endif
+    }
+
+}   // namespace kvstor_bench
@@ -0,0 +1,210 @@
+﻿// kvstor_trace : replays a key access trace against storage_t and reports hit ratio, throughput and latencies
+//
+// usage: kvstor_trace <trace> [--capacity N[,N...]] [--threads N] [--policy fifo|tinylfu]
+//                             [--weight entries|bytes] [--engine mutex|lock-free] [--convert <binary trace>]
+//
+// The trace formats are described in kvstor_trace.h.
+//
+// find() does not change the eviction order, so the fifo policy evicts the oldest write
+// (a set or a get miss moves the key to the front) and tinylfu adds the admission filter to it.
+// With --weight bytes the capacity is a budget of value bytes and every entry weighs its size from the trace.
+
+#include "kvstor.h"
+#include "kvstor_trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+
+    struct options_t
+    {
+        std::string             trace;
+        std::vector<size_t>     capacities{ 10000 };
+        size_t                  threads = 1;
+        std::string             policy = "fifo";
+        std::string             weight = "entries";
+        std::string             engine = "mutex";
+        std::string             convert;
+    };
+
+
+    template <class key_type, class value_type>
+    struct fifo_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+    };
+
+
+    template <class key_type, class value_type>
+    struct fifo_lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    template <class key_type, class value_type>
+    struct tinylfu_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        using admission_t = kvstor::tinylfu_admission_t;
+    };
+
+
+    template <class key_type, class value_type>
+    struct tinylfu_lock_free_traits_t : tinylfu_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    template <class base_type>
+    struct size_weight_traits_t : base_type
+    {
+        using codec_t = kvstor_bench::trace_size_codec_t<uint32_t>;
+    };
+
+
+    void report(size_t capacity, size_t operations, const kvstor_bench::trace_result_t & result)
+    {
+        std::cout << "capacity " << capacity
+            << "\thit ratio: " << std::fixed << std::setprecision(2) << (result.gets ? 100.0 * result.hits / result.gets : 0.0) << " %"
+            << "\tthroughput: " << operations / result.seconds / 1e6 << " Mops/s"
+            << "\tlatency ns p50: " << result.percentile(0.5)
+            << " p90: " << result.percentile(0.9)
+            << " p99: " << result.percentile(0.99)
+            << " p99.9: " << result.percentile(0.999)
+            << " max: " << result.percentile(1.0)
+            << std::defaultfloat << std::endl;
+    }
+
+
+    template <template <class, class> class traits_type>
+    void replay_all(const options_t & options, const std::vector<kvstor_bench::trace_record_t> & records)
+    {
+        using traits_t = traits_type<uint64_t, uint32_t>;
+        using stor_t = kvstor::storage_t<uint64_t, uint32_t, traits_t>;
+        using sized_stor_t = kvstor::storage_t<uint64_t, uint32_t, size_weight_traits_t<traits_t>>;
+
+        for (size_t capacity : options.capacities)
+        {
+            if (options.weight == "bytes")
+                report(capacity, records.size(), kvstor_bench::replay_trace<sized_stor_t>(records, capacity, options.threads));
+            else
+                report(capacity, records.size(), kvstor_bench::replay_trace<stor_t>(records, capacity, options.threads));
+        }
+    }
+
+
+    std::vector<size_t> parse_list(const std::string & list)
+    {
+        std::vector<size_t> values;
+        std::istringstream items{ list };
+
+        for (std::string item; std::getline(items, item, ',');)
+            values.push_back(std::strtoull(item.c_str(), nullptr, 10));
+
+        return values;
+    }
+
+
+    options_t parse_options(int argc, char * argv[])
+    {
+        options_t options;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+            const bool has_value = i + 1 < argc;
+
+            if (arg == "--capacity" && has_value)
+                options.capacities = parse_list(argv[++i]);
+            else if (arg == "--threads" && has_value)
+                options.threads = std::max<size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+            else if (arg == "--policy" && has_value)
+                options.policy = argv[++i];
+            else if (arg == "--weight" && has_value)
+                options.weight = argv[++i];
+            else if (arg == "--engine" && has_value)
+                options.engine = argv[++i];
+            else if (arg == "--convert" && has_value)
+                options.convert = argv[++i];
+            else if (options.trace.empty() && arg.rfind("--", 0) != 0)
+                options.trace = arg;
+            else
+                throw std::runtime_error("unexpected argument " + arg);
+        }
+
+        if (options.trace.empty())
+            throw std::runtime_error("no trace given");
+
+        if (options.policy != "fifo" && options.policy != "tinylfu")
+            throw std::runtime_error("unknown policy " + options.policy);
+
+        if (options.weight != "entries" && options.weight != "bytes")
+            throw std::runtime_error("unknown weight " + options.weight);
+
+        if (options.engine != "mutex" && options.engine != "lock-free")
+            throw std::runtime_error("unknown engine " + options.engine);
+
+        return options;
+    }
+
+}   // namespace
+
+
+int main(int argc, char * argv[])
+{
+    try
+    {
+        const options_t options = parse_options(argc, argv);
+        const std::vector<kvstor_bench::trace_record_t> records = kvstor_bench::read_trace(options.trace);
+
+        if (!options.convert.empty())
+        {
+            kvstor_bench::write_binary_trace(options.convert, records);
+            std::cout << "converted " << records.size() << " operations to " << options.convert << std::endl;
+            return 0;
+        }
+
+        size_t gets = 0;
+        for (const kvstor_bench::trace_record_t & record : records)
+            gets += record.op == kvstor_bench::trace_op_t::get ? 1 : 0;
+
+        std::cout << "trace: " << options.trace << ", operations: " << records.size() << ", gets: " << gets
+            << ", threads: " << options.threads << ", policy: " << options.policy << ", weight: " << options.weight << ", engine: " << options.engine << std::endl;
+
+        const bool lock_free = options.engine == "lock-free";
+
+        if (options.policy == "tinylfu")
+        {
+            if (lock_free)
+                replay_all<tinylfu_lock_free_traits_t>(options, records);
+            else
+                replay_all<tinylfu_traits_t>(options, records);
+        }
+        else
+        {
+            if (lock_free)
+                replay_all<fifo_lock_free_traits_t>(options, records);
+            else
+                replay_all<fifo_traits_t>(options, records);
+        }
+    }
+    catch (const std::exception & error)
+    {
+        std::cerr << "kvstor_trace: " << error.what() << std::endl;
+        std::cerr << "usage: kvstor_trace <trace> [--capacity N[,N...]] [--threads N] [--policy fifo|tinylfu]"
+            " [--weight entries|bytes] [--engine mutex|lock-free] [--convert <binary trace>]" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
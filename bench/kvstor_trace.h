@@ -0,0 +1,314 @@
+﻿// kvstor_trace.h : key access traces replayed by kvstor_trace
+//
+// text trace: one operation per line, '#' starts a comment
+//     <op> <key> [size] [timestamp]
+//     op is get, set or del; numeric keys are used as they are, other keys are hashed;
+//     size (bytes of the value) and timestamp (any monotonic unit) are optional
+//
+// binary trace: the "KVTRACE1" magic followed by packed little-endian records
+//     [u8 op: 0 get, 1 set, 2 del][u64 key][u32 size][u64 timestamp]
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace kvstor_bench
+{
+
+    enum class trace_op_t : uint8_t
+    {
+        get = 0,
+        set = 1,
+        del = 2,
+    };
+
+
+    // the timestamp is kept for the conversion to the binary format, the replay runs operations back to back
+    struct trace_record_t
+    {
+        trace_op_t  op;
+        uint32_t    size;
+        uint64_t    key;
+        uint64_t    timestamp;
+    };
+
+
+    struct trace_result_t
+    {
+        size_t                  gets = 0;
+        size_t                  hits = 0;
+        double                  seconds = 0;
+
+        // nanoseconds per operation, sorted
+        std::vector<uint32_t>   latencies;
+
+        // share in [0, 1]
+        uint32_t percentile(double share) const noexcept;
+    };
+
+
+    // the stored value is the size from the trace and an entry weighs it (at least 1),
+    // so max_size of the storage is a budget of bytes
+    template <class value_type>
+    struct trace_size_codec_t
+    {
+        using stored_t = value_type;
+
+        static stored_t encode(value_type && value) noexcept { return value; }
+        static value_type decode(const stored_t & stored) noexcept { return stored; }
+        static size_t weight(const stored_t & stored) noexcept { return std::max<size_t>(stored, 1); }
+    };
+
+
+    uint64_t parse_trace_key(const std::string & token);
+    trace_op_t parse_trace_op(const std::string & token, size_t line);
+
+    std::vector<trace_record_t> read_text_trace(std::istream & input);
+
+    // reads the records following the magic
+    std::vector<trace_record_t> read_binary_trace(std::istream & input);
+
+    // detects the format by the magic
+    std::vector<trace_record_t> read_trace(const std::string & path);
+    void write_binary_trace(const std::string & path, const std::vector<trace_record_t> & records);
+
+    // get is replayed as get-or-load: a miss pushes the key, so the hit ratio is the share of get hits;
+    // with several threads every thread replays every threads-th operation
+    template <class stor_t>
+    trace_result_t replay_trace(const std::vector<trace_record_t> & records, size_t capacity, size_t threads);
+
+
+    constexpr char trace_magic[] = "KVTRACE1";
+    constexpr size_t trace_magic_size = sizeof(trace_magic) - 1;
+    constexpr size_t trace_record_size = 1 + 8 + 4 + 8;
+
+
+    inline uint32_t trace_result_t::percentile(double share) const noexcept
+    {
+        if (latencies.empty())
+            return 0;
+
+        return latencies[static_cast<size_t>(share * static_cast<double>(latencies.size() - 1))];
+    }
+
+
+    inline uint64_t parse_trace_key(const std::string & token)
+    {
+        if (!token.empty() && std::all_of(token.begin(), token.end(), [](char c) { return c >= '0' && c <= '9'; }))
+            return std::strtoull(token.c_str(), nullptr, 10);
+
+        return kvstor::fast_hash_t::hash_bytes(token.data(), token.size());
+    }
+
+
+    inline trace_op_t parse_trace_op(const std::string & token, size_t line)
+    {
+        if (token == "get" || token == "GET")
+            return trace_op_t::get;
+
+        if (token == "set" || token == "SET")
+            return trace_op_t::set;
+
+        if (token == "del" || token == "DEL" || token == "delete" || token == "DELETE")
+            return trace_op_t::del;
+
+        throw std::runtime_error("unknown operation '" + token + "' at line " + std::to_string(line));
+    }
+
+
+    inline std::vector<trace_record_t> read_text_trace(std::istream & input)
+    {
+        std::vector<trace_record_t> records;
+        std::string line;
+
+        for (size_t number = 1; std::getline(input, line); ++number)
+        {
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream fields{ line };
+            std::string op;
+            std::string key;
+
+            if (!(fields >> op))
+                continue;
+
+            if (!(fields >> key))
+                throw std::runtime_error("missing key at line " + std::to_string(number));
+
+            // without a timestamp the operations are numbered
+            trace_record_t record{ parse_trace_op(op, number), 0, parse_trace_key(key), records.size() };
+
+            uint64_t size = 0;
+            if (fields >> size)
+            {
+                record.size = static_cast<uint32_t>(std::min<uint64_t>(size, UINT32_MAX));
+                fields >> record.timestamp;
+            }
+
+            records.push_back(record);
+        }
+
+        return records;
+    }
+
+
+    template <class item_type>
+    item_type read_le(const char * data)
+    {
+        item_type value = 0;
+        for (size_t i = 0; i < sizeof(item_type); ++i)
+            value |= static_cast<item_type>(static_cast<uint8_t>(data[i])) << (8 * i);
+
+        return value;
+    }
+
+
+    template <class item_type>
+    void write_le(std::ostream & output, item_type value)
+    {
+        for (size_t i = 0; i < sizeof(item_type); ++i)
+            output.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+
+
+    inline std::vector<trace_record_t> read_binary_trace(std::istream & input)
+    {
+        std::vector<trace_record_t> records;
+        char data[trace_record_size];
+
+        while (input.read(data, trace_record_size))
+        {
+            if (static_cast<uint8_t>(data[0]) > static_cast<uint8_t>(trace_op_t::del))
+                throw std::runtime_error("invalid operation in record " + std::to_string(records.size()));
+
+            records.push_back(trace_record_t
+            {
+                static_cast<trace_op_t>(data[0]),
+                read_le<uint32_t>(data + 9),
+                read_le<uint64_t>(data + 1),
+                read_le<uint64_t>(data + 13),
+            });
+        }
+
+        if (input.gcount() != 0)
+            throw std::runtime_error("truncated binary trace");
+
+        return records;
+    }
+
+
+    inline std::vector<trace_record_t> read_trace(const std::string & path)
+    {
+        std::ifstream input{ path, std::ios::binary };
+        if (!input)
+            throw std::runtime_error("cannot open " + path);
+
+        char magic[trace_magic_size] = {};
+        input.read(magic, trace_magic_size);
+
+        if (input.gcount() == static_cast<std::streamsize>(trace_magic_size) && std::memcmp(magic, trace_magic, trace_magic_size) == 0)
+            return read_binary_trace(input);
+
+        input.clear();
+        input.seekg(0);
+        return read_text_trace(input);
+    }
+
+
+    inline void write_binary_trace(const std::string & path, const std::vector<trace_record_t> & records)
+    {
+        std::ofstream output{ path, std::ios::binary | std::ios::trunc };
+        output.write(trace_magic, trace_magic_size);
+
+        for (const trace_record_t & record : records)
+        {
+            output.put(static_cast<char>(record.op));
+            write_le<uint64_t>(output, record.key);
+            write_le<uint32_t>(output, record.size);
+            write_le<uint64_t>(output, record.timestamp);
+        }
+
+        if (!output)
+            throw std::runtime_error("cannot write " + path);
+    }
+
+
+    template <class stor_t>
+    trace_result_t replay_trace(const std::vector<trace_record_t> & records, size_t capacity, size_t threads)
+    {
+        stor_t stor{ capacity };
+        std::vector<trace_result_t> results(threads);
+
+        auto worker = [&stor, &records, &results, threads](size_t thread)
+        {
+            trace_result_t & result = results[thread];
+            result.latencies.reserve(records.size() / threads + 1);
+
+            for (size_t i = thread; i < records.size(); i += threads)
+            {
+                const trace_record_t & record = records[i];
+                const auto start = std::chrono::steady_clock::now();
+
+                switch (record.op)
+                {
+                case trace_op_t::get:
+                    ++result.gets;
+                    if (stor.find(record.key))
+                        ++result.hits;
+                    else
+                        stor.push(record.key, record.size);
+                    break;
+
+                case trace_op_t::set:
+                    stor.push(record.key, record.size);
+                    break;
+
+                case trace_op_t::del:
+                    stor.erase(record.key);
+                    break;
+                }
+
+                const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+                result.latencies.push_back(static_cast<uint32_t>(std::min<int64_t>(elapsed.count(), UINT32_MAX)));
+            }
+        };
+
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> workers;
+        for (size_t thread = 1; thread < threads; ++thread)
+            workers.emplace_back(worker, thread);
+
+        worker(0);
+        for (std::thread & thread : workers)
+            thread.join();
+
+        trace_result_t total;
+        total.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (trace_result_t & result : results)
+        {
+            total.gets += result.gets;
+            total.hits += result.hits;
+            total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+        }
+
+        std::sort(total.latencies.begin(), total.latencies.end());
+        return total;
+    }
+
+}   // namespace kvstor_bench
@@ -0,0 +1,496 @@
+﻿// kvstor_workload.h : synthetic workloads for kvstor benchmarks and stress tests
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+
+
+namespace kvstor_bench
+{
+
+    // splitmix64, a fast generator for benchmark loops; models UniformRandomBitGenerator
+    class random_t
+    {
+    public:
+        using result_type = uint64_t;
+
+        explicit random_t(uint64_t seed = 42) noexcept;
+
+        static constexpr result_type min() noexcept { return 0; }
+        static constexpr result_type max() noexcept { return UINT64_MAX; }
+
+        result_type operator()() noexcept;
+
+        // uniform in [0, 1)
+        double unit() noexcept;
+
+        // uniform in [0, bound)
+        uint64_t below(uint64_t bound) noexcept;
+
+    private:
+        uint64_t m_state;
+    };
+
+
+    // Zipf distributed ranks in [0, count), rank 0 is the most frequent one;
+    // rejection-inversion sampling (Hormann, Derflinger), O(1) time and memory for any skew >= 0
+    class zipf_t
+    {
+    public:
+        zipf_t(uint64_t count, double skew);
+
+        uint64_t operator()(random_t & random) const noexcept;
+
+        uint64_t count() const noexcept { return m_count; }
+        double skew() const noexcept { return m_skew; }
+
+    private:
+        double h(double x) const noexcept;
+        double h_integral(double x) const noexcept;
+        double h_integral_inverse(double x) const noexcept;
+
+        static double log1p_div(double x) noexcept;
+        static double expm1_div(double x) noexcept;
+
+    private:
+        uint64_t    m_count;
+        double      m_skew;
+        double      m_h_integral_x1;
+        double      m_h_integral_n;
+        double      m_s;
+    };
+
+
+    enum class pattern_t
+    {
+        uniform,    // every key is equally likely
+        zipf,       // key i is requested in proportion to 1 / (i + 1)^skew
+        hotspot,    // hot_ops of the requests go to the first hot_keys of the keys
+        scan,       // keys one after another, wrapping around
+        latest,     // writes insert new keys, reads prefer the recently inserted ones (Zipf by age)
+    };
+
+
+    enum class size_distribution_t
+    {
+        uniform,    // every size in [min_value_size, max_value_size] is equally likely
+        lognormal,  // log-normal with the median at the geometric mean of the bounds, clamped to them
+    };
+
+
+    enum class op_t
+    {
+        read,
+        write,
+        cas,
+        erase,
+    };
+
+
+    // relative weights of the operations
+    struct mix_t
+    {
+        unsigned read = 95;
+        unsigned write = 5;
+        unsigned cas = 0;
+        unsigned erase = 0;
+    };
+
+
+    struct workload_config_t
+    {
+        pattern_t           pattern = pattern_t::zipf;
+        uint64_t            keys = 100000;
+        double              skew = 0.99;
+        double              hot_keys = 0.2;
+        double              hot_ops = 0.8;
+        mix_t               mix;
+        size_t              min_value_size = 0;     // value sizes are in [min_value_size, max_value_size]
+        size_t              max_value_size = 0;
+        size_distribution_t value_sizes = size_distribution_t::uniform;
+        double              size_sigma = 1.0;       // sigma of the log of the size for lognormal
+        uint64_t            streams = 1;            // latest: streams [0, streams) interleave their new keys
+        uint64_t            seed = 42;
+    };
+
+
+    struct operation_t
+    {
+        op_t        op;
+        uint64_t    key;
+        size_t      value_size;
+    };
+
+
+    // a stream of operations; use one object per thread, streams with different ids are independent
+    // and with config.streams set to the number of threads write disjoint new keys of latest
+    class workload_t
+    {
+    public:
+        explicit workload_t(const workload_config_t & config, uint64_t stream = 0);
+
+        operation_t next() noexcept;
+
+        op_t next_op() noexcept;
+        uint64_t next_key(op_t op = op_t::read) noexcept;
+        size_t next_value_size() noexcept;
+
+        const workload_config_t & config() const noexcept { return m_config; }
+        random_t & random() noexcept { return m_random; }
+
+    private:
+        workload_config_t   m_config;
+        random_t            m_random;
+        zipf_t              m_zipf;
+        uint64_t            m_mix_total;
+        uint64_t            m_hot_count;
+        uint64_t            m_cursor;
+        uint64_t            m_stream;
+        uint64_t            m_latest;
+    };
+
+
+    pattern_t parse_pattern(const std::string & name);
+    const char * pattern_name(pattern_t pattern) noexcept;
+
+    size_distribution_t parse_size_distribution(const std::string & name);
+    const char * size_distribution_name(size_distribution_t distribution) noexcept;
+
+    // "read/write/cas/erase", e.g. "90/8/1/1"
+    mix_t parse_mix(const std::string & text);
+
+    // runs the operation against storage_t, returns whether a read or a cas found the key;
+    // make_value(key, size) builds the value to store
+    template <class stor_t, class make_value_type>
+    bool apply(stor_t & stor, const operation_t & operation, make_value_type && make_value);
+
+
+    inline random_t::random_t(uint64_t seed) noexcept
+    :   m_state(seed)
+    {
+    }
+
+
+    inline random_t::result_type random_t::operator()() noexcept
+    {
+        uint64_t value = (m_state += 0x9E3779B97F4A7C15ull);
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+        return value ^ (value >> 31);
+    }
+
+
+    inline double random_t::unit() noexcept
+    {
+        return static_cast<double>((*this)() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+
+    inline uint64_t random_t::below(uint64_t bound) noexcept
+    {
+        const uint64_t value = static_cast<uint64_t>(unit() * static_cast<double>(bound));
+        return value < bound ? value : bound - 1;
+    }
+
+
+    inline zipf_t::zipf_t(uint64_t count, double skew)
+    :   m_count(count)
+    ,   m_skew(skew)
+    ,   m_h_integral_x1(0)
+    ,   m_h_integral_n(0)
+    ,   m_s(0)
+    {
+        if (count == 0)
+            throw std::invalid_argument("kvstor_bench: zipf_t needs at least one rank");
+
+        if (!(skew >= 0))
+            throw std::invalid_argument("kvstor_bench: zipf_t skew must not be negative");
+
+        m_h_integral_x1 = h_integral(1.5) - 1.0;
+        m_h_integral_n = h_integral(static_cast<double>(count) + 0.5);
+        m_s = 2.0 - h_integral_inverse(h_integral(2.5) - h(2.0));
+    }
+
+
+    inline uint64_t zipf_t::operator()(random_t & random) const noexcept
+    {
+        for (;;)
+        {
+            const double u = m_h_integral_n + random.unit() * (m_h_integral_x1 - m_h_integral_n);
+            const double x = h_integral_inverse(u);
+
+            double k = std::floor(x + 0.5);
+            if (k < 1)
+                k = 1;
+            else if (k > static_cast<double>(m_count))
+                k = static_cast<double>(m_count);
+
+            if (k - x <= m_s || u >= h_integral(k + 0.5) - h(k))
+                return static_cast<uint64_t>(k) - 1;
+        }
+    }
+
+
+    inline double zipf_t::h(double x) const noexcept
+    {
+        return std::exp(-m_skew * std::log(x));
+    }
+
+
+    inline double zipf_t::h_integral(double x) const noexcept
+    {
+        const double log_x = std::log(x);
+        return expm1_div((1.0 - m_skew) * log_x) * log_x;
+    }
+
+
+    inline double zipf_t::h_integral_inverse(double x) const noexcept
+    {
+        double t = x * (1.0 - m_skew);
+        if (t < -1.0)
+            t = -1.0;
+
+        return std::exp(log1p_div(t) * x);
+    }
+
+
+    // log(1 + x) / x, accurate near zero
+    inline double zipf_t::log1p_div(double x) noexcept
+    {
+        if (std::fabs(x) > 1e-8)
+            return std::log1p(x) / x;
+
+        return 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+    }
+
+
+    // (exp(x) - 1) / x, accurate near zero
+    inline double zipf_t::expm1_div(double x) noexcept
+    {
+        if (std::fabs(x) > 1e-8)
+            return std::expm1(x) / x;
+
+        return 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x));
+    }
+
+
+    inline workload_t::workload_t(const workload_config_t & config, uint64_t stream)
+    :   m_config(config)
+    ,   m_random(config.seed ^ (stream * 0xD1B54A32D192ED03ull))
+    ,   m_zipf(config.keys, config.skew)
+    ,   m_mix_total(uint64_t{ config.mix.read } + config.mix.write + config.mix.cas + config.mix.erase)
+    ,   m_hot_count(0)
+    ,   m_cursor(0)
+    ,   m_stream(config.streams > 0 ? stream % config.streams : 0)
+    ,   m_latest(config.keys + m_stream)
+    {
+        if (m_mix_total == 0)
+            throw std::invalid_argument("kvstor_bench: the operation mix is empty");
+
+        if (config.streams == 0)
+            throw std::invalid_argument("kvstor_bench: streams must not be zero");
+
+        if (!(config.size_sigma >= 0))
+            throw std::invalid_argument("kvstor_bench: size_sigma must not be negative");
+
+        if (config.min_value_size > config.max_value_size)
+            throw std::invalid_argument("kvstor_bench: min_value_size is greater than max_value_size");
+
+        const double hot_count = std::ceil(config.hot_keys * static_cast<double>(config.keys));
+        m_hot_count = std::min<uint64_t>(static_cast<uint64_t>(std::max(hot_count, 1.0)), config.keys);
+
+        // every scanning thread starts at its own position
+        m_cursor = m_random.below(config.keys);
+    }
+
+
+    inline operation_t workload_t::next() noexcept
+    {
+        const op_t op = next_op();
+        const uint64_t key = next_key(op);
+        const size_t value_size = op == op_t::write || op == op_t::cas ? next_value_size() : 0;
+
+        return operation_t{ op, key, value_size };
+    }
+
+
+    inline op_t workload_t::next_op() noexcept
+    {
+        uint64_t value = m_random.below(m_mix_total);
+
+        if (value < m_config.mix.read)
+            return op_t::read;
+        value -= m_config.mix.read;
+
+        if (value < m_config.mix.write)
+            return op_t::write;
+        value -= m_config.mix.write;
+
+        return value < m_config.mix.cas ? op_t::cas : op_t::erase;
+    }
+
+
+    inline uint64_t workload_t::next_key(op_t op) noexcept
+    {
+        const uint64_t keys = m_config.keys;
+
+        switch (m_config.pattern)
+        {
+        case pattern_t::uniform:
+            return m_random.below(keys);
+
+        case pattern_t::zipf:
+            return m_zipf(m_random);
+
+        case pattern_t::hotspot:
+            if (m_hot_count == keys || m_random.unit() < m_config.hot_ops)
+                return m_random.below(m_hot_count);
+            return m_hot_count + m_random.below(keys - m_hot_count);
+
+        case pattern_t::scan:
+            if (m_cursor == keys)
+                m_cursor = 0;
+            return m_cursor++;
+
+        case pattern_t::latest:
+            // the streams interleave their new keys, reads prefer the keys below the common write front
+            if (op == op_t::write)
+            {
+                const uint64_t key = m_latest;
+                m_latest += m_config.streams;
+                return key;
+            }
+            return m_latest - m_stream - 1 - m_zipf(m_random);
+        }
+
+        return 0;
+    }
+
+
+    inline size_t workload_t::next_value_size() noexcept
+    {
+        const size_t spread = m_config.max_value_size - m_config.min_value_size;
+
+        if (spread == 0)
+            return m_config.min_value_size;
+
+        if (m_config.value_sizes == size_distribution_t::uniform)
+            return m_config.min_value_size + static_cast<size_t>(m_random.below(uint64_t{ spread } + 1));
+
+        // Box-Muller, 1 - unit() is in (0, 1]
+        const double normal = std::sqrt(-2.0 * std::log(1.0 - m_random.unit())) * std::cos(6.283185307179586 * m_random.unit());
+        const double min_size = static_cast<double>(std::max<size_t>(m_config.min_value_size, 1));
+        const double max_size = static_cast<double>(m_config.max_value_size);
+        const double size = std::sqrt(min_size * max_size) * std::exp(m_config.size_sigma * normal);
+
+        return static_cast<size_t>(std::clamp(std::round(size), static_cast<double>(m_config.min_value_size), max_size));
+    }
+
+
+    inline pattern_t parse_pattern(const std::string & name)
+    {
+        for (pattern_t pattern : { pattern_t::uniform, pattern_t::zipf, pattern_t::hotspot, pattern_t::scan, pattern_t::latest })
+        {
+            if (name == pattern_name(pattern))
+                return pattern;
+        }
+
+        throw std::invalid_argument("kvstor_bench: unknown pattern " + name);
+    }
+
+
+    inline const char * pattern_name(pattern_t pattern) noexcept
+    {
+        switch (pattern)
+        {
+        case pattern_t::uniform:    return "uniform";
+        case pattern_t::zipf:       return "zipf";
+        case pattern_t::hotspot:    return "hotspot";
+        case pattern_t::scan:       return "scan";
+        case pattern_t::latest:     return "latest";
+        }
+
+        return "unknown";
+    }
+
+
+    inline size_distribution_t parse_size_distribution(const std::string & name)
+    {
+        for (size_distribution_t distribution : { size_distribution_t::uniform, size_distribution_t::lognormal })
+        {
+            if (name == size_distribution_name(distribution))
+                return distribution;
+        }
+
+        throw std::invalid_argument("kvstor_bench: unknown size distribution " + name);
+    }
+
+
+    inline const char * size_distribution_name(size_distribution_t distribution) noexcept
+    {
+        switch (distribution)
+        {
+        case size_distribution_t::uniform:      return "uniform";
+        case size_distribution_t::lognormal:    return "lognormal";
+        }
+
+        return "unknown";
+    }
+
+
+    inline mix_t parse_mix(const std::string & text)
+    {
+        unsigned weights[4] = {};
+        size_t count = 0;
+        size_t begin = 0;
+
+        while (count < 4)
+        {
+            const size_t end = text.find('/', begin);
+            weights[count++] = static_cast<unsigned>(std::strtoul(text.substr(begin, end - begin).c_str(), nullptr, 10));
+
+            if (end == std::string::npos)
+                break;
+
+            begin = end + 1;
+        }
+
+        return mix_t{ weights[0], weights[1], weights[2], weights[3] };
+    }
+
+
+    template <class stor_t, class make_value_type>
+    bool apply(stor_t & stor, const operation_t & operation, make_value_type && make_value)
+    {
+        switch (operation.op)
+        {
+        case op_t::read:
+            return stor.find(operation.key).has_value();
+
+        case op_t::write:
+            stor.push(operation.key, make_value(operation.key, operation.value_size));
+            return false;
+
+        case op_t::cas:
+        {
+            auto expected = stor.find(operation.key);
+            const bool found = expected.has_value();
+            stor.compare_exchange(operation.key, make_value(operation.key, operation.value_size), expected);
+            return found;
+        }
+
+        case op_t::erase:
+            stor.erase(operation.key);
+            return false;
+        }
+
+        return false;
+    }
+
+}   // namespace kvstor_bench
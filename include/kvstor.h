@@ -3,392 +3,3384 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <functional>
+#include <future>
+#include <initializer_list>
 #include <list>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 
 namespace kvstor
 {
 
+    // stores values as they are, every entry weighs 1 so max_size limits the number of entries
+    template <class value_type>
+    struct identity_codec_t
+    {
+        using stored_t = value_type;
+
+        static stored_t encode(value_type && value)
+        {
+            return std::move(value);
+        }
+
+        static value_type decode(const stored_t & stored)
+        {
+            return stored;
+        }
+
+        static size_t weight(const stored_t &) noexcept
+        {
+            return 1;
+        }
+    };
+
+
+    // Dependency-free LZ77 compression of std::string values in the spirit of LZ4.
+    // An entry weighs its compressed size, so max_size limits the total bytes of stored values.
+    // Stored format: a mode byte (0 - raw copy, 1 - compressed) followed by the payload,
+    // the compressed payload is the varint original size and a sequence of
+    // [token][literal length ext][literals][offset u16][match length ext] records.
+    struct lz_codec_t
+    {
+        using stored_t = std::string;
+
+        static std::string encode(std::string && value);
+        static std::string decode(const std::string & stored);
+
+        static size_t weight(const std::string & stored) noexcept
+        {
+            return stored.size();
+        }
+
+    private:
+        static constexpr size_t min_match = 4;
+        static constexpr size_t max_offset = 65535;
+        static constexpr size_t hash_bits = 12;
+
+        static uint32_t load32(const char * data) noexcept;
+        static void put_length(std::string & out, size_t length);
+        static size_t get_length(const char *& in, const char * end, size_t length);
+        static void put_sequence(std::string & out, const char * literals, size_t literal_length, size_t offset, size_t match_length);
+    };
+
+
+    // Fast non-cryptographic hash for integers, enums, pointers and byte strings.
+    // Integers are mixed with the splitmix64 finalizer, so all bits of the result depend on all bits of the key
+    // (std::hash is the identity for integers in libstdc++ and MSVC), byte strings are hashed wyhash-style
+    // with 64x64->128 bit multiply-folds over 8-byte words.
+    struct fast_hash_t
+    {
+        template <class key_type>
+        size_t operator()(const key_type & key) const noexcept;
+
+        static uint64_t hash_int(uint64_t value) noexcept;
+        static uint64_t hash_bytes(const void * data, size_t size, uint64_t seed = 0) noexcept;
+
+    private:
+        static constexpr uint64_t p0 = 0xa0761d6478bd642full;
+        static constexpr uint64_t p1 = 0xe7037ed1a0b428dbull;
+        static constexpr uint64_t p2 = 0x8ebc6af09c88c6e3ull;
+        static constexpr uint64_t p3 = 0x589965cc75374cc3ull;
+
+        static uint64_t mum(uint64_t left, uint64_t right) noexcept;
+        static uint64_t read64(const uint8_t * data) noexcept;
+        static uint64_t read32(const uint8_t * data) noexcept;
+    };
+
+
+    // admits every new entry: push() always inserts and evicts the least recently used entries
+    struct no_admission_t
+    {
+        explicit no_admission_t(size_t) noexcept {}
+
+        void record(size_t) noexcept {}
+
+        bool admit(size_t, size_t) noexcept
+        {
+            return true;
+        }
+    };
+
+
+    // TinyLFU admission: when the storage is full a new key replaces the LRU victim only if it was
+    // accessed more often. Access frequencies of key hashes are estimated by a count-min sketch
+    // behind a bloom filter doorkeeper which absorbs keys seen once; all counters are halved and
+    // the doorkeeper is cleared after every 10 * max_size recorded accesses.
+    class tinylfu_admission_t final
+    {
+    public:
+        explicit tinylfu_admission_t(size_t max_size);
+        tinylfu_admission_t(const tinylfu_admission_t &) = delete;
+        tinylfu_admission_t(tinylfu_admission_t &&) = delete;
+        ~tinylfu_admission_t() noexcept = default;
+
+        tinylfu_admission_t operator=(const tinylfu_admission_t &) = delete;
+        tinylfu_admission_t operator=(tinylfu_admission_t &&) = delete;
+
+        // may be called concurrently, lost updates only make estimates less precise
+        void record(size_t hash) noexcept;
+        bool admit(size_t candidate, size_t victim) noexcept;
+
+        uint32_t estimate(size_t hash) const noexcept;
+        void age() noexcept;
+
+        // with deferred aging record() only counts the accesses and age_if_due() ages the sketch,
+        // which moves the O(width) pass from a pushing thread to a maintenance thread
+        void defer_aging(bool deferred) noexcept;
+        bool age_if_due() noexcept;
+
+    private:
+        static constexpr size_t depth = 4;
+        static constexpr uint8_t max_count = 15;
+        static constexpr size_t min_width = 64;
+        static constexpr size_t max_width = size_t{ 1 } << 22;
+
+        std::atomic<uint8_t> & counter(size_t row, uint64_t mixed) const noexcept;
+        bool doorkeeper_insert(uint64_t mixed) noexcept;
+        bool doorkeeper_contains(uint64_t mixed) const noexcept;
+
+        size_t                                      m_mask;
+        std::unique_ptr<std::atomic<uint8_t>[]>     m_counters;
+        std::unique_ptr<std::atomic<uint64_t>[]>    m_doorkeeper;
+        size_t                                      m_doorkeeper_mask;
+        size_t                                      m_sample_size;
+        std::atomic<size_t>                         m_samples;
+        std::atomic<bool>                           m_deferred_aging;
+    };
+
+
     template <class key_type, class value_type>
     struct traits_t
     {
         using hash_t = std::hash<key_type>;
         using kequal_t = std::equal_to<key_type>;
+        using clock_t = std::chrono::steady_clock;
 
         template <class item_type>
         using alloc_t = std::allocator<item_type>;
+
+        // find() reads a copy of the data published to concurrent_index_t without m_lock;
+        // every value is stored twice
+        static constexpr bool lock_free_find = false;
+
+        // number of per-key version counters used by version(), 0 disables versioning
+        static constexpr size_t version_stripes = 0;
+
+        // converts values to their stored form, e.g. lz_codec_t for compressible strings
+        using codec_t = identity_codec_t<value_type>;
+
+        // decides whether a new key may evict entries, e.g. tinylfu_admission_t against one-hit wonders
+        using admission_t = no_admission_t;
+
+        // push(), compare_exchange() and erase() publish their operations and the thread that takes m_lock
+        // applies every published one (flat combining), which saves lock handoffs under heavy write contention
+        static constexpr bool flat_combining = false;
+
+        // once max_size is exceeded the LRU entries are evicted down to low_watermark percent of max_size in one pass,
+        // so the following pushes do not evict; 100 evicts just enough to fit
+        static constexpr size_t low_watermark = 100;
+
+        // the indexes allocate their buckets for max_size entries in the constructor, so they never rehash
+        // while the storage fills up; needs a codec_t where every entry weighs 1, e.g. identity_codec_t,
+        // since max_size is taken as the number of entries
+        static constexpr bool presize_index = false;
     };
 
-    template
-    <
-        class key_type,
-        class value_type,
-        class traits_type = traits_t<key_type, value_type>
-    >
-    class storage_t final
+
+    // traits_t with fast_hash_t, a base for custom traits of integer and string keys
+    template <class key_type, class value_type>
+    struct fast_hash_traits_t : traits_t<key_type, value_type>
     {
-    public:
-        using key_t = key_type;
-        using value_t = value_type;
-        using hash_t = typename traits_type::hash_t;
-        using kequal_t = typename traits_type::kequal_t;
+        using hash_t = fast_hash_t;
+    };
 
-        explicit storage_t(size_t max_size) noexcept;
-        storage_t(const std::vector<std::pair<key_t, value_t>> & dump_data, size_t max_size);
-        storage_t(const storage_t &) = delete;
-        storage_t(storage_t &&) = delete;
-        ~storage_t() noexcept;
 
-        storage_t operator=(const storage_t &) = delete;
-        storage_t operator=(storage_t &&) = delete;
+    inline constexpr size_t cache_line_size = 64;
+
+
+    template <class key_type>
+    inline size_t fast_hash_t::operator()(const key_type & key) const noexcept
+    {
+        if constexpr (std::is_integral_v<key_type> || std::is_enum_v<key_type>)
+        {
+            return static_cast<size_t>(hash_int(static_cast<uint64_t>(key)));
+        }
+        else if constexpr (std::is_pointer_v<key_type>)
+        {
+            return static_cast<size_t>(hash_int(reinterpret_cast<uintptr_t>(key)));
+        }
+        else
+        {
+            static_assert(std::is_convertible_v<const key_type &, std::string_view>, "fast_hash_t supports integers, enums, pointers and strings");
+
+            const std::string_view bytes = key;
+            return static_cast<size_t>(hash_bytes(bytes.data(), bytes.size()));
+        }
+    }
+
+
+    inline uint64_t fast_hash_t::hash_int(uint64_t value) noexcept
+    {
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+        return value ^ (value >> 31);
+    }
+
+
+    inline uint64_t fast_hash_t::hash_bytes(const void * data, size_t size, uint64_t seed) noexcept
+    {
+        const uint8_t * bytes = static_cast<const uint8_t *>(data);
+        seed ^= mum(seed ^ p0, p1);
+
+        uint64_t left = 0;
+        uint64_t right = 0;
+
+        if (size <= 16)
+        {
+            if (size >= 4)
+            {
+                const size_t middle = (size >> 3) << 2;
+                left = (read32(bytes) << 32) | read32(bytes + middle);
+                right = (read32(bytes + size - 4) << 32) | read32(bytes + size - 4 - middle);
+            }
+            else if (size > 0)
+            {
+                left = (uint64_t{ bytes[0] } << 16) | (uint64_t{ bytes[size >> 1] } << 8) | bytes[size - 1];
+            }
+        }
+        else
+        {
+            size_t rest = size;
+
+            // three independent lanes for long strings
+            if (rest > 48)
+            {
+                uint64_t lane1 = seed;
+                uint64_t lane2 = seed;
+
+                do
+                {
+                    seed = mum(read64(bytes) ^ p1, read64(bytes + 8) ^ seed);
+                    lane1 = mum(read64(bytes + 16) ^ p2, read64(bytes + 24) ^ lane1);
+                    lane2 = mum(read64(bytes + 32) ^ p3, read64(bytes + 40) ^ lane2);
+                    bytes += 48;
+                    rest -= 48;
+                }
+                while (rest > 48);
+
+                seed ^= lane1 ^ lane2;
+            }
+
+            for (; rest > 16; rest -= 16, bytes += 16)
+                seed = mum(read64(bytes) ^ p1, read64(bytes + 8) ^ seed);
+
+            // the last 16 bytes, overlapping the processed ones
+            left = read64(bytes + rest - 16);
+            right = read64(bytes + rest - 8);
+        }
+
+        return mum(p1 ^ size, mum(left ^ p1, right ^ seed));
+    }
+
+
+    // xor of the halves of the 128-bit product
+    inline uint64_t fast_hash_t::mum(uint64_t left, uint64_t right) noexcept
+    {
+#if defined(__SIZEOF_INT128__)
+        const __uint128_t product = static_cast<__uint128_t>(left) * right;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+        const uint64_t ll = (left & 0xFFFFFFFF) * (right & 0xFFFFFFFF);
+        const uint64_t lh = (left & 0xFFFFFFFF) * (right >> 32);
+        const uint64_t hl = (left >> 32) * (right & 0xFFFFFFFF);
+        const uint64_t hh = (left >> 32) * (right >> 32);
+
+        const uint64_t middle = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+        const uint64_t low = (middle << 32) | (ll & 0xFFFFFFFF);
+        const uint64_t high = hh + (lh >> 32) + (hl >> 32) + (middle >> 32);
+
+        return low ^ high;
+#endif
+    }
+
+
+    inline uint64_t fast_hash_t::read64(const uint8_t * data) noexcept
+    {
+        uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+
+    inline uint64_t fast_hash_t::read32(const uint8_t * data) noexcept
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+
+    inline tinylfu_admission_t::tinylfu_admission_t(size_t max_size)
+    :   m_mask(0)
+    ,   m_counters()
+    ,   m_doorkeeper()
+    ,   m_doorkeeper_mask(0)
+    ,   m_sample_size(0)
+    ,   m_samples(0)
+    ,   m_deferred_aging(false)
+    {
+        size_t width = min_width;
+        while (width < max_size && width < max_width)
+            width *= 2;
+
+        m_mask = width - 1;
+        m_counters.reset(new std::atomic<uint8_t>[depth * width]);
+        for (size_t i = 0; i < depth * width; ++i)
+            m_counters[i].store(0, std::memory_order_relaxed);
+
+        // 8 bits per counter column
+        m_doorkeeper_mask = width * 8 - 1;
+        m_doorkeeper.reset(new std::atomic<uint64_t>[width / 8]);
+        for (size_t i = 0; i < width / 8; ++i)
+            m_doorkeeper[i].store(0, std::memory_order_relaxed);
+
+        m_sample_size = 10 * std::max(max_size, min_width);
+    }
+
+
+    inline void tinylfu_admission_t::record(size_t hash) noexcept
+    {
+        const uint64_t mixed = fast_hash_t::hash_int(hash);
+
+        // the first access only passes the doorkeeper
+        if (doorkeeper_insert(mixed))
+        {
+            for (size_t row = 0; row < depth; ++row)
+            {
+                std::atomic<uint8_t> & count = counter(row, mixed);
+                const uint8_t value = count.load(std::memory_order_relaxed);
+
+                if (value < max_count)
+                    count.store(value + 1, std::memory_order_relaxed);
+            }
+        }
+
+        size_t samples = m_samples.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (samples >= m_sample_size && !m_deferred_aging.load(std::memory_order_relaxed)
+            && m_samples.compare_exchange_strong(samples, 0, std::memory_order_relaxed))
+        {
+            age();
+        }
+    }
+
+
+    inline bool tinylfu_admission_t::admit(size_t candidate, size_t victim) noexcept
+    {
+        return estimate(candidate) > estimate(victim);
+    }
+
+
+    inline uint32_t tinylfu_admission_t::estimate(size_t hash) const noexcept
+    {
+        const uint64_t mixed = fast_hash_t::hash_int(hash);
+
+        uint32_t count = max_count;
+        for (size_t row = 0; row < depth; ++row)
+            count = std::min<uint32_t>(count, counter(row, mixed).load(std::memory_order_relaxed));
+
+        return count + (doorkeeper_contains(mixed) ? 1 : 0);
+    }
+
+
+    inline void tinylfu_admission_t::age() noexcept
+    {
+        for (size_t i = 0; i < depth * (m_mask + 1); ++i)
+            m_counters[i].store(m_counters[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+
+        for (size_t i = 0; i <= m_doorkeeper_mask / 64; ++i)
+            m_doorkeeper[i].store(0, std::memory_order_relaxed);
+    }
+
+
+    inline void tinylfu_admission_t::defer_aging(bool deferred) noexcept
+    {
+        m_deferred_aging.store(deferred, std::memory_order_relaxed);
+    }
+
+
+    inline bool tinylfu_admission_t::age_if_due() noexcept
+    {
+        size_t samples = m_samples.load(std::memory_order_relaxed);
+        if (samples < m_sample_size || !m_samples.compare_exchange_strong(samples, 0, std::memory_order_relaxed))
+            return false;
+
+        age();
+        return true;
+    }
+
+
+    // rows are indexed by double hashing of the two halves of the mixed hash
+    inline std::atomic<uint8_t> & tinylfu_admission_t::counter(size_t row, uint64_t mixed) const noexcept
+    {
+        const uint64_t step = (mixed >> 32) | 1;
+        return m_counters[row * (m_mask + 1) + ((mixed + row * step) & m_mask)];
+    }
+
+
+    // returns true if the hash was already present
+    inline bool tinylfu_admission_t::doorkeeper_insert(uint64_t mixed) noexcept
+    {
+        bool present = true;
+
+        for (uint64_t bit : { mixed & m_doorkeeper_mask, (mixed >> 32) & m_doorkeeper_mask })
+        {
+            const uint64_t mask = uint64_t{ 1 } << (bit & 63);
+            if ((m_doorkeeper[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask) == 0)
+                present = false;
+        }
+
+        return present;
+    }
+
+
+    inline bool tinylfu_admission_t::doorkeeper_contains(uint64_t mixed) const noexcept
+    {
+        for (uint64_t bit : { mixed & m_doorkeeper_mask, (mixed >> 32) & m_doorkeeper_mask })
+        {
+            if ((m_doorkeeper[bit / 64].load(std::memory_order_relaxed) & (uint64_t{ 1 } << (bit & 63))) == 0)
+                return false;
+        }
+
+        return true;
+    }
+
+
+    inline std::string lz_codec_t::encode(std::string && value)
+    {
+        const size_t size = value.size();
+        const char * const src = value.data();
+
+        std::string out;
+
+        if (size > min_match * 4)
+        {
+            out.reserve(size / 2 + 16);
+            out.push_back('\1');
+
+            // varint of the original size
+            for (size_t rest = size; ; rest >>= 7)
+            {
+                out.push_back(static_cast<char>((rest & 0x7F) | (rest > 0x7F ? 0x80 : 0)));
+                if (rest <= 0x7F)
+                    break;
+            }
+
+            // positions + 1 of the last occurrences of 4-byte sequences
+            std::array<uint32_t, size_t{ 1 } << hash_bits> table{};
+
+            size_t anchor = 0;
+            size_t pos = 0;
+
+            while (pos + min_match <= size && out.size() < size)
+            {
+                const uint32_t sequence = load32(src + pos);
+                const size_t hash = (sequence * 2654435761u) >> (32 - hash_bits);
+                const size_t candidate = table[hash];
+                table[hash] = static_cast<uint32_t>(pos + 1);
+
+                if (candidate == 0 || pos - (candidate - 1) > max_offset || load32(src + candidate - 1) != sequence)
+                {
+                    ++pos;
+                    continue;
+                }
+
+                const size_t match = candidate - 1;
+                size_t length = min_match;
+                while (pos + length < size && src[match + length] == src[pos + length])
+                    ++length;
+
+                put_sequence(out, src + anchor, pos - anchor, pos - match, length);
+                pos += length;
+                anchor = pos;
+            }
+
+            put_sequence(out, src + anchor, size - anchor, 0, 0);
+        }
+
+        // incompressible values are stored as they are
+        if (out.empty() || out.size() >= size + 1)
+        {
+            out.clear();
+            out.reserve(size + 1);
+            out.push_back('\0');
+            out.append(value);
+        }
+
+        return out;
+    }
+
+
+    inline std::string lz_codec_t::decode(const std::string & stored)
+    {
+        if (stored.empty())
+            throw std::runtime_error("kvstor: invalid compressed value");
+
+        if (stored[0] == '\0')
+            return stored.substr(1);
+
+        if (stored[0] != '\1')
+            throw std::runtime_error("kvstor: invalid compressed value");
+
+        const char * in = stored.data() + 1;
+        const char * const end = stored.data() + stored.size();
+
+        size_t size = 0;
+        for (size_t shift = 0; ; shift += 7)
+        {
+            if (in == end || shift > 63)
+                throw std::runtime_error("kvstor: invalid compressed value");
+
+            const uint8_t byte = static_cast<uint8_t>(*in++);
+            size |= static_cast<size_t>(byte & 0x7F) << shift;
+
+            if ((byte & 0x80) == 0)
+                break;
+        }
+
+        // a length byte expands to at most 255 bytes: larger sizes come from damaged values
+        if (size / 255 > stored.size())
+            throw std::runtime_error("kvstor: invalid compressed value");
+
+        std::string out(size, '\0');
+        char * const dst = out.data();
+        size_t pos = 0;
+
+        while (in != end)
+        {
+            const uint8_t token = static_cast<uint8_t>(*in++);
+
+            const size_t literal_length = get_length(in, end, token >> 4);
+            if (literal_length > static_cast<size_t>(end - in) || literal_length > size - pos)
+                throw std::runtime_error("kvstor: invalid compressed value");
+
+            std::memcpy(dst + pos, in, literal_length);
+            in += literal_length;
+            pos += literal_length;
+
+            // the last sequence has literals only
+            if (in == end)
+                break;
+
+            if (end - in < 2)
+                throw std::runtime_error("kvstor: invalid compressed value");
+
+            const size_t offset = static_cast<uint8_t>(in[0]) | (static_cast<size_t>(static_cast<uint8_t>(in[1])) << 8);
+            in += 2;
+
+            const size_t match_length = get_length(in, end, token & 0x0F) + min_match;
+            if (offset == 0 || offset > pos || match_length > size - pos)
+                throw std::runtime_error("kvstor: invalid compressed value");
+
+            // an overlapping match repeats the bytes it produces
+            if (offset >= match_length)
+            {
+                std::memcpy(dst + pos, dst + pos - offset, match_length);
+            }
+            else
+            {
+                for (size_t i = 0; i < match_length; ++i)
+                    dst[pos + i] = dst[pos - offset + i];
+            }
+
+            pos += match_length;
+        }
+
+        if (pos != size)
+            throw std::runtime_error("kvstor: invalid compressed value");
+
+        return out;
+    }
+
+
+    inline uint32_t lz_codec_t::load32(const char * data) noexcept
+    {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+
+    inline void lz_codec_t::put_length(std::string & out, size_t length)
+    {
+        for (; length >= 255; length -= 255)
+            out.push_back(static_cast<char>(255));
+
+        out.push_back(static_cast<char>(length));
+    }
+
+
+    inline size_t lz_codec_t::get_length(const char *& in, const char * end, size_t length)
+    {
+        if (length != 15)
+            return length;
+
+        for (;;)
+        {
+            if (in == end)
+                throw std::runtime_error("kvstor: invalid compressed value");
+
+            const uint8_t byte = static_cast<uint8_t>(*in++);
+            length += byte;
+
+            if (byte != 255)
+                return length;
+        }
+    }
+
+
+    // match_length == 0 writes the final literals-only sequence
+    inline void lz_codec_t::put_sequence
+    (
+        std::string   & out,
+        const char    * literals,
+        size_t          literal_length,
+        size_t          offset,
+        size_t          match_length
+    )
+    {
+        const size_t match_code = match_length == 0 ? 0 : match_length - min_match;
+        out.push_back(static_cast<char>((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15)));
+
+        if (literal_length >= 15)
+            put_length(out, literal_length - 15);
+
+        out.append(literals, literal_length);
+
+        if (match_length == 0)
+            return;
+
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+
+        if (match_code >= 15)
+            put_length(out, match_code - 15);
+    }
+
+
+    // Epoch-based memory reclamation.
+    // Readers pin the domain while they hold pointers to shared objects, retired objects are
+    // kept in per-thread limbo lists and freed in batches once every pinned reader has moved
+    // at least two epochs past the retirement.
+    class epoch_domain_t final
+    {
+    public:
+        class guard_t;
+        using deleter_t = void (*)(void * ptr);
+
+        epoch_domain_t();
+        epoch_domain_t(const epoch_domain_t &) = delete;
+        epoch_domain_t(epoch_domain_t &&) = delete;
+        ~epoch_domain_t() noexcept;
+
+        epoch_domain_t operator=(const epoch_domain_t &) = delete;
+        epoch_domain_t operator=(epoch_domain_t &&) = delete;
+
+        guard_t pin() const;
+
+        void retire(void * ptr, deleter_t deleter);
+
+        template <class item_type>
+        void retire(item_type * ptr);
+
+        void collect();
+
+        size_t epoch() const noexcept;
+        size_t retired() const;
+
+    private:
+        struct garbage_t
+        {
+            void      * ptr;
+            deleter_t   deleter;
+        };
+
+        struct limbo_t
+        {
+            size_t                  epoch = 0;
+            std::vector<garbage_t>  items;
+        };
+
+        struct alignas(cache_line_size) record_t
+        {
+            // (epoch << 1) | 1 while pinned, 0 otherwise
+            std::atomic<size_t>     state{ 0 };
+            std::atomic<bool>       in_use{ true };
+            size_t                  nesting = 0;
+            size_t                  since_collect = 0;
+            limbo_t                 limbo[3];
+            record_t              * next = nullptr;
+        };
+
+        struct thread_records_t
+        {
+            ~thread_records_t() noexcept;
+
+            uint64_t                                        last_id = 0;
+            record_t                                      * last = nullptr;
+            std::vector<std::pair<uint64_t, record_t *>>    records;
+        };
+
+        static constexpr size_t collect_batch = 64;
+
+        static uint64_t next_id() noexcept;
+        static std::mutex & live_lock() noexcept;
+        static std::vector<uint64_t> & live_domains() noexcept;
+        static thread_records_t & thread_records() noexcept;
+
+        record_t & local() const;
+        record_t & attach() const;
+        void collect(record_t & record);
+        bool try_advance() noexcept;
+        static void release(limbo_t & limbo) noexcept;
+
+        const uint64_t                      m_id;
+        mutable std::atomic<record_t *>     m_records;
+        alignas(cache_line_size)
+        std::atomic<size_t>                 m_epoch;
+    };
+
+
+    class epoch_domain_t::guard_t final
+    {
+    public:
+        explicit guard_t(record_t & record) noexcept
+        :   m_record(&record)
+        {
+        }
+
+        guard_t(guard_t && other) noexcept
+        :   m_record(other.m_record)
+        {
+            other.m_record = nullptr;
+        }
+
+        guard_t(const guard_t &) = delete;
+        guard_t operator=(const guard_t &) = delete;
+        guard_t operator=(guard_t &&) = delete;
+
+        ~guard_t() noexcept
+        {
+            if (m_record != nullptr && --m_record->nesting == 0)
+                m_record->state.store(0, std::memory_order_release);
+        }
+
+    private:
+        record_t * m_record;
+    };
+
+
+    inline epoch_domain_t::epoch_domain_t()
+    :   m_id(next_id())
+    ,   m_records(nullptr)
+    ,   m_epoch(0)
+    {
+        const std::lock_guard guard{ live_lock() };
+        live_domains().push_back(m_id);
+    }
+
+
+    inline epoch_domain_t::~epoch_domain_t() noexcept
+    {
+        {
+            // threads exiting after this point do not touch the records
+            const std::lock_guard guard{ live_lock() };
+            std::vector<uint64_t> & live = live_domains();
+            live.erase(std::find(live.begin(), live.end(), m_id));
+        }
+
+        record_t * record = m_records.load(std::memory_order_acquire);
+        while (record != nullptr)
+        {
+            for (limbo_t & limbo : record->limbo)
+                release(limbo);
+
+            record_t * next = record->next;
+            delete record;
+            record = next;
+        }
+    }
+
+
+    inline epoch_domain_t::guard_t epoch_domain_t::pin() const
+    {
+        record_t & record = local();
+
+        // a read-modify-write keeps the announcement ordered before the reads of shared pointers
+        if (record.nesting++ == 0)
+        {
+            const size_t epoch = m_epoch.load(std::memory_order_acquire);
+            record.state.exchange((epoch << 1) | 1, std::memory_order_seq_cst);
+        }
+
+        return guard_t{ record };
+    }
+
+
+    inline void epoch_domain_t::retire(void * ptr, deleter_t deleter)
+    {
+        record_t & record = local();
+
+        // the object was unlinked before the epoch it is retired in is read
+        const size_t epoch = m_epoch.fetch_add(0, std::memory_order_seq_cst);
+
+        limbo_t & limbo = record.limbo[epoch % 3];
+        if (limbo.epoch != epoch)
+        {
+            // the list holds garbage retired at least three epochs ago
+            release(limbo);
+            limbo.epoch = epoch;
+        }
+
+        try
+        {
+            limbo.items.push_back(garbage_t{ ptr, deleter });
+        }
+        catch (...)
+        {
+            // the object must not be freed while readers may hold it, leak it instead
+            assert(false);
+        }
+
+        if (++record.since_collect >= collect_batch)
+            collect(record);
+    }
+
+
+    template <class item_type>
+    inline void epoch_domain_t::retire(item_type * ptr)
+    {
+        retire(ptr, [](void * p) { delete static_cast<item_type *>(p); });
+    }
+
+
+    inline void epoch_domain_t::collect()
+    {
+        collect(local());
+    }
+
+
+    inline size_t epoch_domain_t::epoch() const noexcept
+    {
+        return m_epoch.load(std::memory_order_relaxed);
+    }
+
+
+    // number of objects waiting in the limbo list of the calling thread
+    inline size_t epoch_domain_t::retired() const
+    {
+        const record_t & record = local();
+
+        size_t count = 0;
+        for (const limbo_t & limbo : record.limbo)
+            count += limbo.items.size();
+
+        return count;
+    }
+
+
+    inline uint64_t epoch_domain_t::next_id() noexcept
+    {
+        static std::atomic<uint64_t> id{ 1 };
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+    inline std::mutex & epoch_domain_t::live_lock() noexcept
+    {
+        static std::mutex lock;
+        return lock;
+    }
+
+
+    inline std::vector<uint64_t> & epoch_domain_t::live_domains() noexcept
+    {
+        static std::vector<uint64_t> domains;
+        return domains;
+    }
+
+
+    inline epoch_domain_t::thread_records_t & epoch_domain_t::thread_records() noexcept
+    {
+        static thread_local thread_records_t records;
+        return records;
+    }
+
+
+    inline epoch_domain_t::thread_records_t::~thread_records_t() noexcept
+    {
+        // records of live domains are handed over to other threads with the remaining garbage
+        const std::lock_guard guard{ live_lock() };
+        const std::vector<uint64_t> & live = live_domains();
+
+        for (auto & [id, record] : records)
+        {
+            if (std::find(live.begin(), live.end(), id) != live.end())
+                record->in_use.store(false, std::memory_order_release);
+        }
+    }
+
+
+    inline epoch_domain_t::record_t & epoch_domain_t::local() const
+    {
+        thread_records_t & records = thread_records();
+        if (records.last_id == m_id)
+            return *records.last;
+
+        for (auto & [id, record] : records.records)
+        {
+            if (id == m_id)
+            {
+                records.last_id = id;
+                records.last = record;
+                return *record;
+            }
+        }
+
+        return attach();
+    }
+
+
+    inline epoch_domain_t::record_t & epoch_domain_t::attach() const
+    {
+        thread_records_t & records = thread_records();
+
+        {
+            // forget records of destroyed domains
+            const std::lock_guard guard{ live_lock() };
+            const std::vector<uint64_t> & live = live_domains();
+
+            auto dead = [&live](const std::pair<uint64_t, record_t *> & item)
+            {
+                return std::find(live.begin(), live.end(), item.first) == live.end();
+            };
+
+            records.records.erase(std::remove_if(records.records.begin(), records.records.end(), dead), records.records.end());
+        }
+
+        records.records.reserve(records.records.size() + 1);
+
+        record_t * found = nullptr;
+        for (record_t * record = m_records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            bool in_use = false;
+            if (record->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire))
+            {
+                found = record;
+                break;
+            }
+        }
+
+        if (found == nullptr)
+        {
+            found = new record_t();
+            found->next = m_records.load(std::memory_order_relaxed);
+            while (!m_records.compare_exchange_weak(found->next, found, std::memory_order_release, std::memory_order_relaxed))
+                ;
+        }
+
+        records.records.emplace_back(m_id, found);
+        records.last_id = m_id;
+        records.last = found;
+
+        return *found;
+    }
+
+
+    inline void epoch_domain_t::collect(record_t & record)
+    {
+        record.since_collect = 0;
+        try_advance();
+
+        const size_t epoch = m_epoch.load(std::memory_order_acquire);
+        for (limbo_t & limbo : record.limbo)
+        {
+            if (limbo.epoch + 2 <= epoch)
+                release(limbo);
+        }
+    }
+
+
+    inline bool epoch_domain_t::try_advance() noexcept
+    {
+        size_t epoch = m_epoch.load(std::memory_order_seq_cst);
+
+        for (const record_t * record = m_records.load(std::memory_order_acquire); record != nullptr; record = record->next)
+        {
+            const size_t state = record->state.load(std::memory_order_seq_cst);
+            if ((state & 1) != 0 && (state >> 1) != epoch)
+                return false;
+        }
+
+        return m_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+    }
+
+
+    inline void epoch_domain_t::release(limbo_t & limbo) noexcept
+    {
+        for (const garbage_t & item : limbo.items)
+            item.deleter(item.ptr);
+
+        limbo.items.clear();
+    }
+
+
+    // Hash index with lock-free readers and a single writer.
+    // Writers must be serialized by the caller (storage_t does it with m_lock).
+    // Unlinked nodes and replaced tables are reclaimed through epoch_domain_t.
+    // The table grows incrementally: every publish() copies a few buckets of the previous table
+    // and readers look into both tables until the copy is complete, so no write pays for a full rehash.
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    class concurrent_index_t final
+    {
+    public:
+        using time_point_t = typename clock_type::time_point;
+
+        // presize allocates the buckets for max_size entries at once instead of growing up to them,
+        // if that allocation fails the table grows on demand
+        explicit concurrent_index_t(size_t max_size, bool presize = false);
+        concurrent_index_t(const concurrent_index_t &) = delete;
+        concurrent_index_t(concurrent_index_t &&) = delete;
+        ~concurrent_index_t() noexcept;
+
+        concurrent_index_t operator=(const concurrent_index_t &) = delete;
+        concurrent_index_t operator=(concurrent_index_t &&) = delete;
+
+        std::optional<value_type> find(const key_type & key, time_point_t * updated = nullptr) const;
+        std::optional<value_type> find(const key_type & key, size_t hash, time_point_t * updated = nullptr) const;
+
+        // calls func(value, updated) for the found entry while it is protected from reclamation
+        template <class func_type>
+        bool visit(const key_type & key, func_type && func) const;
+        template <class func_type>
+        bool visit(const key_type & key, size_t hash, func_type && func) const;
+
+        void publish(const key_type & key, const value_type & value, time_point_t updated);
+        void remove(const key_type & key);
+
+        // the hash must be hash_type{}(key), e.g. cached by the caller
+        void publish(const key_type & key, size_t hash, const value_type & value, time_point_t updated);
+        void remove(const key_type & key, size_t hash);
+
+        void clear();
+
+        // copies up to the number of buckets of the previous table, returns the number of buckets left
+        size_t migrate(size_t buckets);
+
+    private:
+        struct node_t
+        {
+            node_t(size_t hash_, const key_type & key_, const value_type & value_, time_point_t updated_)
+            :   hash(hash_)
+            ,   key(key_)
+            ,   value(value_)
+            ,   updated(updated_)
+            ,   next(nullptr)
+            {
+            }
+
+            const size_t                hash;
+            const key_type              key;
+            const value_type            value;
+            const time_point_t          updated;
+            std::atomic<node_t *>       next;
+        };
+
+        struct table_t
+        {
+            explicit table_t(size_t size)
+            :   mask(size - 1)
+            ,   buckets(new std::atomic<node_t *>[size])
+            {
+                assert((size & mask) == 0);
+
+                for (size_t i = 0; i < size; ++i)
+                    buckets[i].store(nullptr, std::memory_order_relaxed);
+            }
+
+            // std::hash is the identity for integers, the hash is mixed so that strided keys do not share a chain
+            std::atomic<node_t *> & bucket(size_t hash) const noexcept
+            {
+                return buckets[fast_hash_t::hash_int(hash) & mask];
+            }
+
+            const size_t                                mask;
+            const std::unique_ptr<std::atomic<node_t *>[]> buckets;
+        };
+
+        static constexpr size_t min_buckets = 16;
+        static constexpr size_t max_initial_buckets = 1024;
+        static constexpr size_t max_presized_buckets = size_t{ 1 } << 30;
+
+        // buckets copied by every publish(), the copy completes before the table doubles again
+        static constexpr size_t migrate_step = 2;
+
+        const node_t * find_node(const table_t * table, size_t hash, const key_type & key) const;
+        bool unlink(std::atomic<node_t *> * link, size_t hash, const key_type & key);
+        void grow();
+        static void destroy(void * table) noexcept;
+
+        // read by every find()
+        std::atomic<table_t *>  m_table;
+
+        // the previous table while its buckets are copied into m_table: updates leave its nodes in place,
+        // removals unlink them from both tables
+        std::atomic<table_t *>  m_old;
+
+        hash_type               m_hash;
+        kequal_type             m_kequal;
+
+        mutable epoch_domain_t  m_domain;
+
+        // written by every publish(), kept off the lines of the readers
+        alignas(cache_line_size)
+        size_t                  m_count;    // nodes in m_table
+        size_t                  m_migrated;
+    };
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::concurrent_index_t
+    (
+        size_t  max_size,
+        bool    presize
+    )
+    :   m_table(nullptr)
+    ,   m_old(nullptr)
+    ,   m_hash()
+    ,   m_kequal()
+    ,   m_domain()
+    ,   m_count(0)
+    ,   m_migrated(0)
+    {
+        size_t buckets = min_buckets;
+        while (buckets < max_size && buckets < (presize ? max_presized_buckets : max_initial_buckets))
+            buckets *= 2;
+
+        if (buckets > max_initial_buckets)
+        {
+            try
+            {
+                m_table.store(new table_t(buckets), std::memory_order_relaxed);
+                return;
+            }
+            catch (const std::bad_alloc &)
+            {
+                // the table grows on demand
+                buckets = max_initial_buckets;
+            }
+        }
+
+        m_table.store(new table_t(buckets), std::memory_order_relaxed);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::~concurrent_index_t() noexcept
+    {
+        // no readers can exist at this point
+        destroy(m_table.load(std::memory_order_relaxed));
+
+        if (table_t * old = m_old.load(std::memory_order_relaxed))
+            destroy(old);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    inline std::optional<value_type> concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::find
+    (
+        const key_type  & key,
+        time_point_t    * updated
+    ) const
+    {
+        return find(key, m_hash(key), updated);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    std::optional<value_type> concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::find
+    (
+        const key_type  & key,
+        size_t            hash,
+        time_point_t    * updated
+    ) const
+    {
+        std::optional<value_type> found;
+
+        auto copy = [&found, updated](const value_type & value, time_point_t value_updated)
+        {
+            if (updated)
+                *updated = value_updated;
+
+            found.emplace(value);
+        };
+
+        visit(key, hash, copy);
+        return found;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    template <class func_type>
+    inline bool concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::visit
+    (
+        const key_type    & key,
+        func_type        && func
+    ) const
+    {
+        return visit(key, m_hash(key), std::forward<func_type>(func));
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    template <class func_type>
+    bool concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::visit
+    (
+        const key_type    & key,
+        size_t              hash,
+        func_type        && func
+    ) const
+    {
+        const auto guard = m_domain.pin();
+
+        for (;;)
+        {
+            // the current table has the newest nodes, the previous one holds every key which is not copied yet
+            const table_t * old = m_old.load(std::memory_order_acquire);
+            const table_t * table = m_table.load(std::memory_order_acquire);
+            const node_t * node = find_node(table, hash, key);
+
+            if (node == nullptr && old != nullptr && old != table)
+                node = find_node(old, hash, key);
+
+            if (node != nullptr)
+            {
+                func(node->value, node->updated);
+                return true;
+            }
+
+            // the copy completed or the table grew during the lookup: a present key may have been
+            // in the bucket of the previous table when the current one was looked into
+            if (m_old.load(std::memory_order_acquire) == old && m_table.load(std::memory_order_acquire) == table)
+                return false;
+        }
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    inline const typename concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::node_t *
+    concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::find_node
+    (
+        const table_t     * table,
+        size_t              hash,
+        const key_type    & key
+    ) const
+    {
+        const node_t * node = table->bucket(hash).load(std::memory_order_acquire);
+
+        for (; node != nullptr; node = node->next.load(std::memory_order_acquire))
+        {
+            if (node->hash == hash && m_kequal(node->key, key))
+                return node;
+        }
+
+        return nullptr;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    inline void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::publish
+    (
+        const key_type    & key,
+        const value_type  & value,
+        time_point_t        updated
+    )
+    {
+        publish(key, m_hash(key), value, updated);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    inline void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::remove(const key_type & key)
+    {
+        remove(key, m_hash(key));
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::publish
+    (
+        const key_type    & key,
+        size_t              hash,
+        const value_type  & value,
+        time_point_t        updated
+    )
+    {
+        table_t * table = m_table.load(std::memory_order_relaxed);
+        if (m_count >= table->mask + 1)
+        {
+            grow();
+            table = m_table.load(std::memory_order_relaxed);
+        }
+        else if (m_old.load(std::memory_order_relaxed) != nullptr)
+        {
+            migrate(migrate_step);
+        }
+
+        node_t * node = new node_t(hash, key, value, updated);
+        std::atomic<node_t *> & head = table->bucket(hash);
+
+        // readers see either the old or the new node, the new one is found first
+        node->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        head.store(node, std::memory_order_release);
+        ++m_count;
+
+        if (unlink(&node->next, hash, key))
+            --m_count;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    inline void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::remove
+    (
+        const key_type    & key,
+        size_t              hash
+    )
+    {
+        table_t * table = m_table.load(std::memory_order_relaxed);
+        if (unlink(&table->bucket(hash), hash, key))
+            --m_count;
+
+        if (table_t * old = m_old.load(std::memory_order_relaxed))
+            unlink(&old->bucket(hash), hash, key);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::clear()
+    {
+        table_t * table = m_table.load(std::memory_order_relaxed);
+        table_t * empty = new table_t(table->mask + 1);
+        table_t * old = m_old.load(std::memory_order_relaxed);
+
+        // readers which load the empty table do not see the previous one
+        m_old.store(nullptr, std::memory_order_release);
+        m_table.store(empty, std::memory_order_release);
+        m_count = 0;
+        m_domain.retire(table, &destroy);
+
+        if (old != nullptr)
+            m_domain.retire(old, &destroy);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    size_t concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::migrate(size_t buckets)
+    {
+        table_t * old = m_old.load(std::memory_order_relaxed);
+        if (old == nullptr)
+            return 0;
+
+        table_t * table = m_table.load(std::memory_order_relaxed);
+
+        // a bucket that failed to copy is copied again, the nodes already copied are skipped
+        for (; buckets > 0 && m_migrated <= old->mask; --buckets, ++m_migrated)
+        {
+            const node_t * node = old->buckets[m_migrated].load(std::memory_order_relaxed);
+
+            for (; node != nullptr; node = node->next.load(std::memory_order_relaxed))
+            {
+                // updated since the table has grown
+                if (find_node(table, node->hash, node->key) != nullptr)
+                    continue;
+
+                node_t * copy = new node_t(node->hash, node->key, node->value, node->updated);
+                std::atomic<node_t *> & head = table->bucket(node->hash);
+
+                copy->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                head.store(copy, std::memory_order_release);
+                ++m_count;
+            }
+        }
+
+        if (m_migrated <= old->mask)
+            return old->mask + 1 - m_migrated;
+
+        m_old.store(nullptr, std::memory_order_release);
+        m_domain.retire(old, &destroy);
+        return 0;
+    }
+
+
+    // unlinks the first node with the key found in the chain starting at the link
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    bool concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::unlink
+    (
+        std::atomic<node_t *>     * link,
+        size_t                      hash,
+        const key_type            & key
+    )
+    {
+        for (node_t * node = link->load(std::memory_order_relaxed); node != nullptr; node = link->load(std::memory_order_relaxed))
+        {
+            if (node->hash == hash && m_kequal(node->key, key))
+            {
+                // readers standing on the node still see the rest of the chain
+                link->store(node->next.load(std::memory_order_relaxed), std::memory_order_release);
+
+                m_domain.retire(node);
+                return true;
+            }
+
+            link = &node->next;
+        }
+
+        return false;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::grow()
+    {
+        // at most one table is being copied
+        migrate(SIZE_MAX);
+
+        table_t * table = m_table.load(std::memory_order_relaxed);
+        table_t * bigger = new table_t(2 * (table->mask + 1));
+
+        // the nodes stay in the previous table and are copied by the following publish() calls;
+        // readers which load the bigger table see the previous one in m_old
+        m_old.store(table, std::memory_order_relaxed);
+        m_migrated = 0;
+        m_table.store(bigger, std::memory_order_release);
+        m_count = 0;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type, class clock_type>
+    void concurrent_index_t<key_type, value_type, hash_type, kequal_type, clock_type>::destroy(void * ptr) noexcept
+    {
+        table_t * table = static_cast<table_t *>(ptr);
+
+        for (size_t i = 0; i <= table->mask; ++i)
+        {
+            node_t * node = table->buckets[i].load(std::memory_order_relaxed);
+            while (node != nullptr)
+            {
+                node_t * next = node->next.load(std::memory_order_relaxed);
+                delete node;
+                node = next;
+            }
+        }
+
+        delete table;
+    }
+
+
+    // a visitor with a single non-template operator() accepting const value_type & cannot change the values;
+    // generic lambdas are not inspected since checking them instantiates their body
+    template <class func_type, class key_type, class value_type, class = void>
+    struct read_only_visitor_t : std::false_type
+    {
+    };
+
+    template <class func_type, class key_type, class value_type>
+    struct read_only_visitor_t<func_type, key_type, value_type, std::void_t<decltype(&std::decay_t<func_type>::operator())>>
+        : std::bool_constant<std::is_invocable_v<func_type &, const key_type &, const value_type &>>
+    {
+    };
+
+
+    template
+    <
+        class key_type,
+        class value_type,
+        class traits_type = traits_t<key_type, value_type>
+    >
+    class storage_t final
+    {
+    public:
+        using key_t = key_type;
+        using value_t = value_type;
+        using hash_t = typename traits_type::hash_t;
+        using kequal_t = typename traits_type::kequal_t;
+        using clock_t = typename traits_type::clock_t;
+        using duration_t = typename clock_t::duration;
+        using codec_t = typename traits_type::codec_t;
+        using admission_t = typename traits_type::admission_t;
+        using evict_handler_t = std::function<void (key_t && key, value_t && value)>;
+
+        static constexpr bool lock_free_find = traits_type::lock_free_find;
+        static constexpr size_t version_stripes = traits_type::version_stripes;
+        static constexpr bool flat_combining = traits_type::flat_combining;
+        static constexpr size_t low_watermark = traits_type::low_watermark;
+        static constexpr bool presize_index = traits_type::presize_index;
+
+        static_assert(low_watermark <= 100, "low_watermark is a percentage of max_size");
+        static_assert(!presize_index || std::is_same_v<codec_t, identity_codec_t<value_t>>,
+            "presize_index takes max_size as the number of entries, a weighing codec limits their total weight");
+
+        class cursor_t;
+
+        // allocates the admission sketch and the lock-free index, throws std::bad_alloc
+        explicit storage_t(size_t max_size);
+        storage_t(const std::vector<std::pair<key_t, value_t>> & dump_data, size_t max_size);
+        storage_t(const storage_t &) = delete;
+        storage_t(storage_t &&) = delete;
+        ~storage_t() noexcept;
+
+        storage_t operator=(const storage_t &) = delete;
+        storage_t operator=(storage_t &&) = delete;
+
+        void push(const key_t & key, value_t && value);
+        void push(const key_t & key, const value_t & value);
+
+        // pushes the items in order under one lock, the storage is trimmed to max_size once after all of them
+        void push(std::vector<std::pair<key_t, value_t>> && items);
+
+        // applied is the number of leading items stored or rejected by admission_t, also when an exception is thrown
+        void push(std::vector<std::pair<key_t, value_t>> && items, size_t & applied);
+
+        bool compare_exchange(const key_t & key, value_t && desired, std::optional<value_t> & expected);
+        bool compare_exchange(const key_t & key, const value_t & desired, std::optional<value_t> & expected);
+
+        std::optional<value_t> find(const key_t & key) const;
+        std::optional<value_t> find(const key_t & key, duration_t & age) const;
+        std::optional<value_t> first() const;
+        std::optional<value_t> last() const;
+
+        // newest entries first
+        std::vector<std::pair<key_t, value_t>> newest(size_t count) const;
+        // oldest entries first
+        std::vector<std::pair<key_t, value_t>> oldest(size_t count) const;
+        std::vector<std::pair<key_t, value_t>> pop_oldest(size_t count);
+
+        bool contains(const key_t & key) const;
+        std::vector<bool> contains(const std::vector<key_t> & keys) const;
+        size_t count(const key_t & key) const;
+        size_t count(const std::vector<key_t> & keys) const;
+        std::optional<duration_t> age(const key_t & key) const;
+        std::vector<std::optional<duration_t>> age(const std::vector<key_t> & keys) const;
+
+        // calls func(const value_t &) for the found value without copying it
+        template <class func_type>
+        bool peek(const key_t & key, func_type && func) const;
+
+        void map(std::function<void (const key_t & key, value_t & value)> func);
+        void map(std::function<void (const key_t & key, const value_t & value)> func) const;
+
+        // the traversals of a mutable storage encode the values back and republish them to the lock-free index,
+        // read-only visitors (read_only_visitor_t) take the const path instead
+        template <class func_type, std::enable_if_t<read_only_visitor_t<func_type, key_t, value_t>::value, int> = 0>
+        void map(func_type && func);
+
+        template <class func_type>
+        void for_each(func_type && func);
+        template <class func_type>
+        void for_each(func_type && func) const;
+
+        // stops as soon as func returns false
+        template <class func_type>
+        bool for_each_while(func_type && func);
+        template <class func_type>
+        bool for_each_while(func_type && func) const;
+
+        // func is called concurrently from several threads, threads == 0 uses all hardware threads
+        template <class func_type>
+        void parallel_for_each(func_type && func, size_t threads = 0);
+        template <class func_type>
+        void parallel_for_each(func_type && func, size_t threads = 0) const;
+
+        // returns up to count entries following the cursor position in MRU to LRU order;
+        // entries present and unchanged during the whole walk are returned exactly once
+        std::vector<std::pair<key_t, value_t>> next(cursor_t & cursor, size_t count) const;
+
+        size_t size() const noexcept;
+        bool empty() const noexcept;
+        size_t max_size() const noexcept;
+
+        // total codec_t::weight() of the stored values limited by max_size()
+        size_t weight() const noexcept;
+
+        // new entries turned down by admission_t
+        size_t rejected() const noexcept;
+
+        uint64_t version(const key_t & key) const noexcept;
+
+        void erase(const key_t& key);
+        void clear() noexcept;
+
+        // evicts the LRU entries down to the low watermark, returns the number of evicted entries;
+        // called in the background it leaves room for the following pushes
+        size_t trim();
+
+        // evicts up to limit entries not updated for max_age or longer, oldest first;
+        // returns the number of expired entries, which are reported to on_evict()
+        size_t expire(duration_t max_age, size_t limit = SIZE_MAX);
+
+        // copies up to the number of buckets of the grown lock-free index ahead of the pushes,
+        // returns the number of buckets left
+        size_t rehash(size_t buckets);
+
+        // the handler receives entries evicted by push() / compare_exchange() / trim() / expire() after m_lock is released
+        void on_evict(evict_handler_t handler);
+
+        // the handler receives the new entries turned down by admission_t, after m_lock is released;
+        // they were never stored and are not reported to on_evict()
+        void on_reject(evict_handler_t handler);
+
+        std::vector<std::pair<key_t, value_t>> dump() const;
+
+        // e.g. for tinylfu_admission_t::age_if_due() from a maintenance thread
+        admission_t & admission() const noexcept;
+
+    private:
+        using stored_t = typename codec_t::stored_t;
+
+        struct handlers_t
+        {
+            evict_handler_t     evict;
+            evict_handler_t     reject;
+        };
+
+        using handlers_ptr_t = std::shared_ptr<const handlers_t>;
+
+        // the seq of a rejected entry handed over with the evicted ones, stored entries start at 1
+        static constexpr uint64_t rejected_seq = 0;
+
+        // values of the identity codec are used without conversions
+        static constexpr bool transparent_codec = std::is_same_v<codec_t, identity_codec_t<value_t>>;
+        static constexpr bool admission_enabled = !std::is_same_v<admission_t, no_admission_t>;
+
+        struct item_t
+        {
+            item_t(const stored_t & value_, const key_t& key_, size_t hash_, uint64_t seq_)
+                : value(value_)
+                , key(key_)
+                , hash(hash_)
+                , updated(clock_t::now())
+                , seq(seq_)
+            {
+            }
+
+            item_t(stored_t && value_, const key_t & key_, size_t hash_, uint64_t seq_)
+            :   value(std::move(value_))
+            ,   key(key_)
+            ,   hash(hash_)
+            ,   updated(clock_t::now())
+            ,   seq(seq_)
+            {
+            }
+
+            stored_t                        value;
+            key_t                           key;
+            // hash_t{}(key), reused by eviction, rehashing and versioning
+            size_t                          hash;
+            typename clock_t::time_point    updated;
+            uint64_t                        seq;
+        };
+
+        using list_alloc_t = typename traits_type::template alloc_t<item_t>;
+        using list_t = std::list<item_t, list_alloc_t>;
+        using index_item_t = typename list_t::iterator;
+
+        // refers to the key of a list entry, so every key is stored once;
+        // lookups convert the searched key implicitly and hash it once
+        struct key_ref_t
+        {
+            key_ref_t(const key_t & key_)
+            :   key(&key_)
+            ,   hash(hash_t{}(key_))
+            {
+            }
+
+            key_ref_t(const key_t & key_, size_t hash_) noexcept
+            :   key(&key_)
+            ,   hash(hash_)
+            {
+            }
+
+            const key_t   * key;
+            size_t          hash;
+        };
+
+        struct key_ref_hash_t
+        {
+            size_t operator()(const key_ref_t & ref) const noexcept
+            {
+                return ref.hash;
+            }
+        };
+
+        // different hashes are rejected without calling kequal_t
+        struct key_ref_equal_t
+        {
+            bool operator()(const key_ref_t & left, const key_ref_t & right) const
+            {
+                return left.hash == right.hash && kequal_t{}(*left.key, *right.key);
+            }
+        };
+
+        using index_pair_t = std::pair<const key_ref_t, index_item_t>;
+        using index_alloc_t = typename traits_type::template alloc_t<index_pair_t>;
+        using index_t = std::unordered_map<key_ref_t, index_item_t, key_ref_hash_t, key_ref_equal_t, index_alloc_t>;
+
+        struct no_read_index_t
+        {
+            no_read_index_t(size_t, bool) noexcept {}
+        };
+
+        using read_index_t = std::conditional_t
+        <
+            lock_free_find,
+            concurrent_index_t<key_t, stored_t, hash_t, kequal_t, clock_t>,
+            no_read_index_t
+        >;
+
+        // a write published by a thread waiting for the combiner, it lives on the stack of that thread
+        struct combined_op_t
+        {
+            enum class kind_t
+            {
+                push,
+                compare_exchange,
+                erase,
+            };
+
+            combined_op_t(kind_t kind_, const key_ref_t & ref_, stored_t * value_, std::optional<value_t> * expected_)
+            :   kind(kind_)
+            ,   ref(ref_)
+            ,   value(value_)
+            ,   expected(expected_)
+            ,   result(false)
+            ,   error()
+            ,   done(false)
+            {
+            }
+
+            const kind_t                kind;
+            const key_ref_t             ref;
+            stored_t                  * value;
+            std::optional<value_t>    * expected;
+            bool                        result;
+            std::exception_ptr          error;
+            std::atomic<bool>           done;
+        };
+
+        struct combiner_t
+        {
+            static constexpr size_t slots = 64;
+
+            explicit combiner_t(size_t) noexcept {}
+
+            std::array<std::atomic<combined_op_t *>, slots> published{};
+        };
+
+        struct no_combiner_t
+        {
+            explicit no_combiner_t(size_t) noexcept {}
+        };
+
+        using combiner_state_t = std::conditional_t<flat_combining, combiner_t, no_combiner_t>;
+
+        void apply_new(const key_ref_t & ref, stored_t && value, typename index_t::iterator found);
+        void store(const key_ref_t & ref, stored_t && value, typename index_t::iterator found, list_t & evicted);
+        void reject(const key_ref_t & ref, stored_t && value, list_t & evicted);
+        void remove(typename index_t::iterator found);
+        bool combine(combined_op_t & op);
+        void apply_op(combined_op_t & op, list_t & evicted) noexcept;
+        bool admit(const key_ref_t & ref, const stored_t & value, typename index_t::iterator found);
+        void record(const key_ref_t & ref) const noexcept;
+        void fix_size(list_t & evicted);
+        void evict(list_t & evicted, size_t weight);
+        void set_handler(evict_handler_t handlers_t::* member, evict_handler_t && handler);
+
+        // passes the entries to the evict or the reject handler
+        static void notify_evicted(list_t & evicted, const handlers_ptr_t & handlers);
+        void build_from_dump(const std::vector<std::pair<key_t, value_t>> & dump_data);
+        bool compare_with(typename index_t::iterator found, std::optional<value_t> & expected);
+        void touch(size_t hash) noexcept;
+        void touch_all() noexcept;
+
+        // calls func(const stored_t &, time_point) for the found entry
+        template <class func_type>
+        bool visit(const key_t & key, func_type && func) const;
+
+        static stored_t encode(value_t && value);
+        static value_t decode(const stored_t & stored);
+        static value_t decode(stored_t && stored);
+        static std::optional<value_t> decode(std::optional<stored_t> && stored);
+        static std::vector<std::pair<key_t, value_t>> decode(std::vector<std::pair<key_t, stored_t>> && items);
+
+        // calls func(key, value) with the decoded value, changes made by a mutable func are encoded back
+        template <class item_type, class func_type>
+        static decltype(auto) apply_item(item_type & item, func_type & func);
+
+        template <class list_type, class func_type>
+        static void parallel_apply(list_type & data, func_type & func, size_t threads);
+
+        void republish(typename list_t::iterator first, typename list_t::iterator last);
+
+        list_t              m_data;
+        index_t             m_index;
+        read_index_t        m_read_index;
+        const size_t        m_max_size;
+        const size_t        m_low_weight;
+
+        handlers_ptr_t                      m_handlers;
+        mutable admission_t                 m_admission;
+
+        // the fields written by every push() and erase() take separate cache lines,
+        // so that size() and lock-free finds do not contend with the writers on the line of the mutex
+        alignas(cache_line_size)
+        mutable std::mutex  m_lock;
+        uint64_t            m_seq;
+
+        alignas(cache_line_size)
+        std::atomic<size_t> m_size;
+        std::atomic<size_t> m_weight;
+        std::atomic<size_t> m_rejected;
+
+        alignas(cache_line_size)
+        std::atomic<uint64_t>                                   m_generation;
+        std::array<std::atomic<uint64_t>, version_stripes>      m_versions;
+
+        // written by the threads waiting for a combiner
+        alignas(cache_line_size)
+        combiner_state_t    m_combiner;
+    };
+
+
+    // position in the MRU to LRU order of a storage, a default constructed cursor starts at the newest entry
+    template <class key_type, class value_type, class traits_type>
+    class storage_t<key_type, value_type, traits_type>::cursor_t final
+    {
+    public:
+        bool done() const noexcept
+        {
+            return m_done;
+        }
+
+    private:
+        friend class storage_t;
+
+        // keys of the tail of the last batch: the walk resumes after the newest of them still in place
+        static constexpr size_t max_anchors = 8;
+
+        std::vector<std::pair<key_t, uint64_t>>     m_anchors;
+        uint64_t                                    m_seq = UINT64_MAX;
+        bool                                        m_done = false;
+    };
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline storage_t<key_type, value_type, traits_type>::storage_t(size_t max_size)
+    :   m_data()
+    ,   m_index()
+    ,   m_read_index(max_size, presize_index)
+    ,   m_max_size(max_size)
+    ,   m_low_weight(max_size / 100 * low_watermark + max_size % 100 * low_watermark / 100)
+    ,   m_handlers()
+    ,   m_admission(max_size)
+    ,   m_lock()
+    ,   m_seq(0)
+    ,   m_size(0)
+    ,   m_weight(0)
+    ,   m_rejected(0)
+    ,   m_generation(0)
+    ,   m_versions()
+    ,   m_combiner(max_size)
+    {
+        if constexpr (presize_index)
+        {
+            try
+            {
+                m_index.reserve(max_size);
+            }
+            catch (...)
+            {
+                // the index grows on demand
+            }
+        }
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline storage_t<key_type, value_type, traits_type>::storage_t
+    (
+        const std::vector<std::pair<key_t, value_t>>  & dump_data,
+        size_t                                          max_size
+    )
+    :   storage_t(max_size)
+    {
+        build_from_dump(dump_data);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline storage_t<key_type, value_type, traits_type>::~storage_t() noexcept
+    {
+        clear();
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::push(const key_t & key, value_t && value)
+    {
+        // hashed and encoded before the lock is taken
+        const key_ref_t ref{ key };
+        stored_t stored = encode(std::move(value));
+
+        record(ref);
+
+        if constexpr (flat_combining)
+        {
+            combined_op_t op{ combined_op_t::kind_t::push, ref, &stored, nullptr };
+            combine(op);
+            return;
+        }
+
+        list_t evicted;
+        handlers_ptr_t handlers;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            store(ref, std::move(stored), m_index.find(ref), evicted);
+
+            if (!evicted.empty())
+                handlers = m_handlers;
+        }
+
+        notify_evicted(evicted, handlers);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::push(const key_t & key, const value_t & value)
+    {
+        push(key, std::move(value_t(value)));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::push(std::vector<std::pair<key_t, value_t>> && items)
+    {
+        size_t applied = 0;
+        push(std::move(items), applied);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::push
+    (
+        std::vector<std::pair<key_t, value_t>>   && items,
+        size_t                                    & applied
+    )
+    {
+        applied = 0;
+
+        std::vector<key_ref_t> refs;
+        std::vector<stored_t> values;
+        refs.reserve(items.size());
+        values.reserve(items.size());
+
+        for (auto & item : items)
+        {
+            refs.emplace_back(item.first);
+            values.push_back(encode(std::move(item.second)));
+            record(refs.back());
+        }
+
+        list_t evicted;
+        handlers_ptr_t handlers;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            try
+            {
+                for (size_t i = 0; i < refs.size(); ++i)
+                {
+                    auto found = m_index.find(refs[i]);
+                    if (admit(refs[i], values[i], found))
+                        apply_new(refs[i], std::move(values[i]), found);
+                    else
+                        reject(refs[i], std::move(values[i]), evicted);
+
+                    applied = i + 1;
+                }
+            }
+            catch (...)
+            {
+                // the items applied so far stay within max_size
+                fix_size(evicted);
+                throw;
+            }
+
+            fix_size(evicted);
+
+            if (!evicted.empty())
+                handlers = m_handlers;
+        }
+
+        notify_evicted(evicted, handlers);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    bool storage_t<key_type, value_type, traits_type>::compare_exchange
+    (
+        const key_t              & key,
+        value_t                 && desired,
+        std::optional<value_t>   & expected
+    )
+    {
+        const key_ref_t ref{ key };
+        stored_t stored = encode(std::move(desired));
+
+        record(ref);
+
+        if constexpr (flat_combining)
+        {
+            combined_op_t op{ combined_op_t::kind_t::compare_exchange, ref, &stored, &expected };
+            return combine(op);
+        }
+
+        list_t evicted;
+        handlers_ptr_t handlers;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            auto found = m_index.find(ref);
+            if (!compare_with(found, expected))
+                return false;
+
+            store(ref, std::move(stored), found, evicted);
+
+            if (!evicted.empty())
+                handlers = m_handlers;
+        }
+
+        notify_evicted(evicted, handlers);
+        return true;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline bool storage_t<key_type, value_type, traits_type>::compare_exchange
+    (
+        const key_t              & key,
+        const value_t            & desired,
+        std::optional<value_t>   & expected
+    )
+    {
+        return compare_exchange(key, std::move(value_t(desired)), expected);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::find(const key_t & key) const
+    {
+        const key_ref_t ref{ key };
+        record(ref);
+
+        if constexpr (lock_free_find)
+            return decode(m_read_index.find(key, ref.hash));
+
+        std::optional<stored_t> stored;
+
+        {
+            const std::lock_guard guard{ m_lock };
+            auto found = m_index.find(ref);
+
+            if (found == m_index.end())
+                return std::optional<value_t>{};
+
+            assert(found->second->key == key);
+            stored.emplace(found->second->value);
+        }
+
+        // decoded after the lock is released
+        return decode(std::move(stored));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::find
+    (
+        const key_t & key,
+        duration_t  & age
+    ) const
+    {
+        const key_ref_t ref{ key };
+        record(ref);
+
+        if constexpr (lock_free_find)
+        {
+            typename clock_t::time_point updated;
+            std::optional<stored_t> found = m_read_index.find(key, ref.hash, &updated);
+
+            if (found)
+                age = clock_t::now() - updated;
+
+            return decode(std::move(found));
+        }
+
+        std::optional<stored_t> stored;
+
+        {
+            const std::lock_guard guard{ m_lock };
+            auto found = m_index.find(ref);
+
+            if (found == m_index.end())
+                return std::optional<value_t>{};
+
+            assert(found->second->key == key);
+            age = clock_t::now() - found->second->updated;
+            stored.emplace(found->second->value);
+        }
+
+        return decode(std::move(stored));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::first() const
+    {
+        std::optional<stored_t> stored;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            if (m_size == 0)
+            {
+                assert(m_index.empty());
+                assert(m_data.empty());
+                return std::optional<value_t>{};
+            }
+
+            stored.emplace(m_data.front().value);
+        }
+
+        return decode(std::move(stored));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::last() const
+    {
+        std::optional<stored_t> stored;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            if (m_size == 0)
+            {
+                assert(m_index.empty());
+                assert(m_data.empty());
+                return std::optional<value_t>{};
+            }
+
+            stored.emplace(m_data.back().value);
+        }
+
+        return decode(std::move(stored));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::newest(size_t count) const
+    {
+        std::vector<std::pair<key_t, stored_t>> items;
+
+        {
+            const std::lock_guard guard{ m_lock };
+            items.reserve(std::min(count, m_data.size()));
+
+            for (auto it = m_data.begin(); it != m_data.end() && items.size() < count; ++it)
+                items.emplace_back(it->key, it->value);
+        }
+
+        return decode(std::move(items));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::oldest(size_t count) const
+    {
+        std::vector<std::pair<key_t, stored_t>> items;
+
+        {
+            const std::lock_guard guard{ m_lock };
+            items.reserve(std::min(count, m_data.size()));
+
+            for (auto it = m_data.rbegin(); it != m_data.rend() && items.size() < count; ++it)
+                items.emplace_back(it->key, it->value);
+        }
+
+        return decode(std::move(items));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::pop_oldest(size_t count)
+    {
+        list_t popped;
+
+        {
+            const std::lock_guard guard{ m_lock };
+            count = std::min(count, m_data.size());
+
+            auto first = std::prev(m_data.end(), static_cast<std::ptrdiff_t>(count));
+            for (auto it = first; it != m_data.end(); ++it)
+            {
+                if constexpr (lock_free_find)
+                    m_read_index.remove(it->key, it->hash);
+
+                m_index.erase(key_ref_t{ it->key, it->hash });
+                m_weight -= codec_t::weight(it->value);
+                touch(it->hash);
+            }
+
+            // the entries are moved out and freed after the lock is released
+            popped.splice(popped.end(), m_data, first, m_data.end());
+
+            m_size = m_data.size();
+            assert(m_size == m_index.size());
+        }
+
+        std::vector<std::pair<key_t, value_t>> items;
+        items.reserve(popped.size());
+
+        for (auto it = popped.rbegin(); it != popped.rend(); ++it)
+            items.emplace_back(std::move(it->key), decode(std::move(it->value)));
+
+        return items;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline bool storage_t<key_type, value_type, traits_type>::contains(const key_t & key) const
+    {
+        return visit(key, [](const stored_t &, typename clock_t::time_point) {});
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<bool> storage_t<key_type, value_type, traits_type>::contains(const std::vector<key_t> & keys) const
+    {
+        std::vector<bool> found;
+        found.reserve(keys.size());
+
+        if constexpr (lock_free_find)
+        {
+            for (const key_t & key : keys)
+                found.push_back(contains(key));
+
+            return found;
+        }
+
+        const std::lock_guard guard{ m_lock };
+
+        for (const key_t & key : keys)
+            found.push_back(m_index.find(key) != m_index.end());
+
+        return found;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline size_t storage_t<key_type, value_type, traits_type>::count(const key_t & key) const
+    {
+        return contains(key) ? 1 : 0;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    size_t storage_t<key_type, value_type, traits_type>::count(const std::vector<key_t> & keys) const
+    {
+        size_t found = 0;
+
+        if constexpr (lock_free_find)
+        {
+            for (const key_t & key : keys)
+                found += count(key);
+
+            return found;
+        }
+
+        const std::lock_guard guard{ m_lock };
+
+        for (const key_t & key : keys)
+            found += m_index.count(key);
+
+        return found;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::optional<typename storage_t<key_type, value_type, traits_type>::duration_t>
+    storage_t<key_type, value_type, traits_type>::age(const key_t & key) const
+    {
+        std::optional<typename clock_t::time_point> updated;
+        visit(key, [&updated](const stored_t &, typename clock_t::time_point value_updated) { updated = value_updated; });
+
+        if (!updated)
+            return std::optional<duration_t>{};
+
+        return std::optional<duration_t>{ clock_t::now() - *updated };
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<std::optional<typename storage_t<key_type, value_type, traits_type>::duration_t>>
+    storage_t<key_type, value_type, traits_type>::age(const std::vector<key_t> & keys) const
+    {
+        std::vector<std::optional<duration_t>> ages;
+        ages.reserve(keys.size());
+
+        if constexpr (lock_free_find)
+        {
+            for (const key_t & key : keys)
+                ages.push_back(age(key));
+
+            return ages;
+        }
+
+        const std::lock_guard guard{ m_lock };
+        const auto now = clock_t::now();
+
+        for (const key_t & key : keys)
+        {
+            auto found = m_index.find(key);
+
+            if (found == m_index.end())
+                ages.emplace_back();
+            else
+                ages.emplace_back(now - found->second->updated);
+        }
+
+        return ages;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    inline bool storage_t<key_type, value_type, traits_type>::peek(const key_t & key, func_type && func) const
+    {
+        if constexpr (transparent_codec)
+        {
+            return visit(key, [&func](const value_t & value, typename clock_t::time_point) { func(value); });
+        }
+        else
+        {
+            // the stored value is copied and decoded after the lock is released
+            std::optional<stored_t> stored;
+            visit(key, [&stored](const stored_t & value, typename clock_t::time_point) { stored.emplace(value); });
+
+            if (!stored)
+                return false;
+
+            const value_t value = codec_t::decode(*stored);
+            func(value);
+
+            return true;
+        }
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::map(std::function<void (const key_t & key, value_t & value)> func)
+    {
+        for_each(func);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::map(std::function<void (const key_t & key, const value_t & value)> func) const
+    {
+        for_each(func);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type, std::enable_if_t<read_only_visitor_t<func_type, key_type, value_type>::value, int>>
+    inline void storage_t<key_type, value_type, traits_type>::map(func_type && func)
+    {
+        std::as_const(*this).for_each(std::forward<func_type>(func));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    void storage_t<key_type, value_type, traits_type>::for_each(func_type && func)
+    {
+        if constexpr (read_only_visitor_t<func_type, key_t, value_t>::value)
+        {
+            std::as_const(*this).for_each(std::forward<func_type>(func));
+            return;
+        }
+
+        const std::lock_guard guard{ m_lock };
+
+        try
+        {
+            for (item_t & item : m_data)
+                apply_item(item, func);
+        }
+        catch (...)
+        {
+            republish(m_data.begin(), m_data.end());
+            throw;
+        }
+
+        // values may have been changed in place
+        republish(m_data.begin(), m_data.end());
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    void storage_t<key_type, value_type, traits_type>::for_each(func_type && func) const
+    {
+        const std::lock_guard guard{ m_lock };
+
+        for (const item_t & item : m_data)
+            apply_item(item, func);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    bool storage_t<key_type, value_type, traits_type>::for_each_while(func_type && func)
+    {
+        if constexpr (read_only_visitor_t<func_type, key_t, value_t>::value)
+            return std::as_const(*this).for_each_while(std::forward<func_type>(func));
+
+        const std::lock_guard guard{ m_lock };
+
+        auto it = m_data.begin();
+        bool completed = true;
+
+        try
+        {
+            for (; it != m_data.end(); ++it)
+            {
+                if (!apply_item(*it, func))
+                {
+                    completed = false;
+                    ++it;
+                    break;
+                }
+            }
+        }
+        catch (...)
+        {
+            republish(m_data.begin(), m_data.end());
+            throw;
+        }
+
+        republish(m_data.begin(), it);
+        return completed;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    bool storage_t<key_type, value_type, traits_type>::for_each_while(func_type && func) const
+    {
+        const std::lock_guard guard{ m_lock };
+
+        for (const item_t & item : m_data)
+        {
+            if (!apply_item(item, func))
+                return false;
+        }
+
+        return true;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    void storage_t<key_type, value_type, traits_type>::parallel_for_each(func_type && func, size_t threads)
+    {
+        if constexpr (read_only_visitor_t<func_type, key_t, value_t>::value)
+        {
+            std::as_const(*this).parallel_for_each(std::forward<func_type>(func), threads);
+            return;
+        }
+
+        const std::lock_guard guard{ m_lock };
+
+        try
+        {
+            parallel_apply(m_data, func, threads);
+        }
+        catch (...)
+        {
+            republish(m_data.begin(), m_data.end());
+            throw;
+        }
+
+        republish(m_data.begin(), m_data.end());
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    template <class func_type>
+    void storage_t<key_type, value_type, traits_type>::parallel_for_each(func_type && func, size_t threads) const
+    {
+        const std::lock_guard guard{ m_lock };
+
+        parallel_apply(m_data, func, threads);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::next
+    (
+        cursor_t  & cursor,
+        size_t      count
+    ) const
+    {
+        std::vector<std::pair<key_t, stored_t>> batch;
+
+        if (cursor.m_done || count == 0)
+            return decode(std::move(batch));
+
+        batch.reserve(count);
+
+        std::unique_lock guard{ m_lock };
+        auto it = m_data.begin();
+
+        for (auto anchor = cursor.m_anchors.rbegin(); anchor != cursor.m_anchors.rend(); ++anchor)
+        {
+            auto found = m_index.find(anchor->first);
+            if (found != m_index.end() && found->second->seq == anchor->second)
+            {
+                it = std::next(found->second);
+                break;
+            }
+        }
+
+        // entries at or above the position were returned already or changed after the walk passed them
+        while (it != m_data.end() && it->seq >= cursor.m_seq)
+            ++it;
+
+        for (; it != m_data.end() && batch.size() < count; ++it)
+            batch.emplace_back(it->key, it->value);
+
+        if (it == m_data.end())
+            cursor.m_done = true;
+
+        if (!batch.empty())
+        {
+            cursor.m_seq = std::prev(it)->seq;
+            cursor.m_anchors.clear();
+
+            const size_t anchors = std::min(batch.size(), cursor_t::max_anchors);
+            auto item = std::prev(it, static_cast<std::ptrdiff_t>(anchors));
+            for (; item != it; ++item)
+                cursor.m_anchors.emplace_back(item->key, item->seq);
+        }
+
+        guard.unlock();
+        return decode(std::move(batch));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline size_t storage_t<key_type, value_type, traits_type>::size() const noexcept
+    {
+        return m_size;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline bool storage_t<key_type, value_type, traits_type>::empty() const noexcept
+    {
+        return m_size == 0;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline size_t storage_t<key_type, value_type, traits_type>::max_size() const noexcept
+    {
+        return m_max_size;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline size_t storage_t<key_type, value_type, traits_type>::weight() const noexcept
+    {
+        return m_weight;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline size_t storage_t<key_type, value_type, traits_type>::rejected() const noexcept
+    {
+        return m_rejected;
+    }
+
+
+    // changes after every modification of the entry with the key (and of the keys sharing its stripe)
+    template <class key_type, class value_type, class traits_type>
+    inline uint64_t storage_t<key_type, value_type, traits_type>::version(const key_t & key) const noexcept
+    {
+        static_assert(version_stripes > 0, "versioning is disabled by traits_type::version_stripes");
+
+        const size_t stripe = hash_t{}(key) % version_stripes;
+        return m_generation.load(std::memory_order_acquire) + m_versions[stripe].load(std::memory_order_acquire);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::erase(const key_t & key)
+    {
+        const key_ref_t ref{ key };
+
+        if constexpr (flat_combining)
+        {
+            combined_op_t op{ combined_op_t::kind_t::erase, ref, nullptr, nullptr };
+            combine(op);
+            return;
+        }
+
+        const std::lock_guard guard{ m_lock };
+        remove(m_index.find(ref));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::clear() noexcept
+    {
+        try
+        {
+            const std::lock_guard guard{ m_lock };
+            m_index.clear();
+            m_data.clear();
+            m_size = 0;
+            m_weight = 0;
+
+            if constexpr (lock_free_find)
+                m_read_index.clear();
+
+            touch_all();
+        }
+        catch (...)
+        {
+            // ignore unexpected exception in release
+            assert(false);
+        }
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    size_t storage_t<key_type, value_type, traits_type>::trim()
+    {
+        list_t evicted;
+        handlers_ptr_t handlers;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            if (m_weight <= m_low_weight)
+                return 0;
+
+            evict(evicted, m_low_weight);
+            handlers = m_handlers;
+        }
+
+        const size_t count = evicted.size();
+        notify_evicted(evicted, handlers);
+
+        return count;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    size_t storage_t<key_type, value_type, traits_type>::expire(duration_t max_age, size_t limit)
+    {
+        list_t expired;
+        handlers_ptr_t handlers;
+
+        {
+            const auto deadline = clock_t::now() - max_age;
+            const std::lock_guard guard{ m_lock };
+
+            // the list is ordered by the update time, the oldest entries are at the back
+            while (!m_data.empty() && expired.size() < limit && m_data.back().updated <= deadline)
+            {
+                const item_t & item = m_data.back();
+
+                if constexpr (lock_free_find)
+                    m_read_index.remove(item.key, item.hash);
+
+                m_index.erase(key_ref_t{ item.key, item.hash });
+                m_weight -= codec_t::weight(item.value);
+                touch(item.hash);
+
+                expired.splice(expired.end(), m_data, std::prev(m_data.end()));
+            }
+
+            m_size = m_data.size();
+            assert(m_size == m_index.size());
+
+            if (!expired.empty())
+                handlers = m_handlers;
+        }
+
+        const size_t count = expired.size();
+        notify_evicted(expired, handlers);
+
+        return count;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    size_t storage_t<key_type, value_type, traits_type>::rehash(size_t buckets)
+    {
+        if constexpr (lock_free_find)
+        {
+            const std::lock_guard guard{ m_lock };
+            return m_read_index.migrate(buckets);
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::on_evict(evict_handler_t handler)
+    {
+        set_handler(&handlers_t::evict, std::move(handler));
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::on_reject(evict_handler_t handler)
+    {
+        set_handler(&handlers_t::reject, std::move(handler));
+    }
+
+
+    // the handlers are replaced as a whole: notifications in flight keep using the previous ones
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::set_handler
+    (
+        evict_handler_t handlers_t::*   member,
+        evict_handler_t              && handler
+    )
+    {
+        const std::lock_guard guard{ m_lock };
+
+        auto handlers = m_handlers ? std::make_shared<handlers_t>(*m_handlers) : std::make_shared<handlers_t>();
+        (*handlers).*member = std::move(handler);
+        m_handlers = std::move(handlers);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::dump() const
+    {
+        std::vector<std::pair<key_t, value_t>> dump_data;
+        dump_data.reserve(size());
+
+        auto do_dump = [&dump_data](const key_t & key, const value_t & value)
+        {
+            dump_data.emplace_back(key, value);
+        };
+
+        for_each(do_dump);
+
+        return dump_data;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    inline typename traits_type::admission_t & storage_t<key_type, value_type, traits_type>::admission() const noexcept
+    {
+        return m_admission;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::apply_new
+    (
+        const key_ref_t              & ref,
+        stored_t                    && value,
+        typename index_t::iterator     found
+    )
+    {
+        const key_t & key = *ref.key;
+
+        if (found == m_index.end())
+        {
+            m_data.emplace_front(std::move(value), key, ref.hash, ++m_seq);
+
+            try
+            {
+                m_index.emplace(key_ref_t{ m_data.front().key, ref.hash }, m_data.begin());
+            }
+            catch (...)
+            {
+                m_data.pop_front();
+                throw;
+            }
+        }
+        else
+        {
+            // the entry is updated in place: the index keeps referring to its key
+            item_t & item = *found->second;
+            assert(item.key == key);
+
+            m_weight -= codec_t::weight(item.value);
+            item.value = std::move(value);
+            item.updated = clock_t::now();
+            item.seq = ++m_seq;
+
+            m_data.splice(m_data.begin(), m_data, found->second);
+        }
+
+        m_weight += codec_t::weight(m_data.front().value);
+
+        if constexpr (lock_free_find)
+            m_read_index.publish(key, ref.hash, m_data.front().value, m_data.front().updated);
+
+        touch(ref.hash);
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::store
+    (
+        const key_ref_t              & ref,
+        stored_t                    && value,
+        typename index_t::iterator     found,
+        list_t                       & evicted
+    )
+    {
+        if (admit(ref, value, found))
+        {
+            apply_new(ref, std::move(value), found);
+            fix_size(evicted);
+        }
+        else
+        {
+            reject(ref, std::move(value), evicted);
+        }
+    }
+
+
+    // the entry is handed over with the evicted ones and marked by rejected_seq
+    template <class key_type, class value_type, class traits_type>
+    inline void storage_t<key_type, value_type, traits_type>::reject
+    (
+        const key_ref_t   & ref,
+        stored_t         && value,
+        list_t            & evicted
+    )
+    {
+        evicted.emplace_back(std::move(value), *ref.key, ref.hash, rejected_seq);
+        ++m_rejected;
+    }
+
+
+    template <class key_type, class value_type, class traits_type>
+    void storage_t<key_type, value_type, traits_type>::remove(typename index_t::iterator found)
+    {
+        if (found == m_index.end())
+            return;
+
+        m_weight -= codec_t::weight(found->second->value);
 
-        void push(const key_t & key, value_t && value);
-        void push(const key_t & key, const value_t & value);
+        // the index entry refers to the key of the list entry
+        const auto item = found->second;
+        const size_t hash = item->hash;
 
-        bool compare_exchange(const key_t & key, value_t && desired, std::optional<value_t> & expected);
-        bool compare_exchange(const key_t & key, const value_t & desired, std::optional<value_t> & expected);
+        if constexpr (lock_free_find)
+            m_read_index.remove(item->key, hash);
 
-        std::optional<value_t> find(const key_t & key) const;
-        std::optional<value_t> first() const;
-        std::optional<value_t> last() const;
+        m_index.erase(found);
+        m_data.erase(item);
 
-        void map(std::function<void (const key_t & key, value_t & value)> func);
-        void map(std::function<void (const key_t & key, const value_t & value)> func) const;
+        touch(hash);
 
-        size_t size() const noexcept;
-        bool empty() const noexcept;
-        size_t max_size() const noexcept;
+        m_size = m_data.size();
+        assert(m_size == m_index.size());
+    }
 
-        void erase(const key_t& key);
-        void clear() noexcept;
 
-        std::vector<std::pair<key_t, value_t>> dump() const;
+    // applies the operation at once if m_lock is free, otherwise publishes it and waits until a combiner applies it;
+    // the thread that takes m_lock becomes the combiner and applies every published operation
+    template <class key_type, class value_type, class traits_type>
+    bool storage_t<key_type, value_type, traits_type>::combine(combined_op_t & op)
+    {
+        auto & published = m_combiner.published;
+        bool is_owner = m_lock.try_lock();
 
-    private:
-        struct item_t
+        if (!is_owner)
         {
-            item_t(const value_type & value_, const key_t& key_)
-                : value(value_)
-                , key(key_)
+            const size_t first = std::hash<std::thread::id>{}(std::this_thread::get_id()) % combiner_t::slots;
+
+            bool is_published = false;
+            for (size_t i = 0; i < combiner_t::slots && !is_published; ++i)
             {
+                combined_op_t * empty = nullptr;
+                is_published = published[(first + i) % combiner_t::slots].compare_exchange_strong(empty, &op, std::memory_order_release);
             }
 
-            item_t(value_type && value_, const key_t & key_)
-            :   value(std::move(value_))
-            ,   key(key_)
+            // more waiting threads than slots
+            if (!is_published)
             {
+                m_lock.lock();
+                is_owner = true;
             }
+        }
 
-            value_t value;
-            key_t   key;
-        };
+        list_t evicted;
+        handlers_ptr_t handlers;
 
-        using list_alloc_t = typename traits_t<key_t, value_t>::template alloc_t<item_t>;
-        using list_t = std::list<item_t, list_alloc_t>;
-        using index_item_t = typename list_t::iterator;
-        using index_pair_t = std::pair<const key_t, index_item_t>;
-        using index_alloc_t = typename traits_t<key_t, value_t>::template alloc_t<index_pair_t>;
-        using index_t = std::unordered_map<key_t, index_item_t, hash_t, kequal_t, index_alloc_t>;
+        bool is_locked = is_owner;
+        while (!is_locked && !op.done.load(std::memory_order_acquire))
+        {
+            is_locked = m_lock.try_lock();
+            if (!is_locked)
+                std::this_thread::yield();
+        }
 
-        void apply_new(const key_t & key, value_t && value, typename index_t::iterator found);
-        void fix_size();
-        void build_from_dump(const std::vector<std::pair<key_t, value_t>> & dump_data);
-        bool compare_with(typename index_t::iterator found, std::optional<value_t> & expected);
+        if (is_locked)
+        {
+            const std::lock_guard guard{ m_lock, std::adopt_lock };
 
-        list_t  m_data;
-        index_t m_index;
+            if (is_owner)
+                apply_op(op, evicted);
 
-        mutable std::mutex  m_lock;
+            // a published own operation is applied with the others
+            for (std::atomic<combined_op_t *> & slot : published)
+            {
+                combined_op_t * pending = slot.load(std::memory_order_acquire);
+                if (pending == nullptr)
+                    continue;
+
+                // the slot is freed before the owner is released and may destroy the operation
+                slot.store(nullptr, std::memory_order_relaxed);
+                apply_op(*pending, evicted);
+                pending->done.store(true, std::memory_order_release);
+            }
 
-        std::atomic<size_t> m_size;
-        const size_t        m_max_size;
-    };
+            if (!evicted.empty())
+                handlers = m_handlers;
+        }
+
+        // entries evicted for other threads are handed over by the combiner
+        notify_evicted(evicted, handlers);
+
+        if (op.error)
+            std::rethrow_exception(op.error);
+
+        return op.result;
+    }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline storage_t<key_type, value_type, traits_type>::storage_t(size_t max_size) noexcept
-    :   m_data()
-    ,   m_index()
-    ,   m_lock()
-    ,   m_size(0)
-    ,   m_max_size(max_size)
+    void storage_t<key_type, value_type, traits_type>::apply_op(combined_op_t & op, list_t & evicted) noexcept
     {
+        try
+        {
+            auto found = m_index.find(op.ref);
+
+            switch (op.kind)
+            {
+            case combined_op_t::kind_t::push:
+                store(op.ref, std::move(*op.value), found, evicted);
+                op.result = true;
+                break;
+
+            case combined_op_t::kind_t::compare_exchange:
+                op.result = compare_with(found, *op.expected);
+                if (op.result)
+                    store(op.ref, std::move(*op.value), found, evicted);
+                break;
+
+            case combined_op_t::kind_t::erase:
+                remove(found);
+                op.result = true;
+                break;
+            }
+        }
+        catch (...)
+        {
+            op.error = std::current_exception();
+        }
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline storage_t<key_type, value_type, traits_type>::storage_t
-    (
-        const std::vector<std::pair<key_t, value_t>>  & dump_data,
-        size_t                                          max_size
-    )
-    :   storage_t(max_size)
+    inline void storage_t<key_type, value_type, traits_type>::fix_size(list_t & evicted)
     {
-        build_from_dump(dump_data);
+        evict(evicted, m_weight > m_max_size ? m_low_weight : m_max_size);
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline storage_t<key_type, value_type, traits_type>::~storage_t() noexcept
+    void storage_t<key_type, value_type, traits_type>::evict(list_t & evicted, size_t weight)
     {
-        clear();
+        // an entry heavier than max_size evicts everything including itself,
+        // otherwise the newest entry stays whatever the watermark
+        while (m_weight > m_max_size || (m_weight > weight && m_data.size() > 1))
+        {
+            const item_t & item = m_data.back();
+
+            // the cached hash spares rehashing the evicted key
+            if constexpr (lock_free_find)
+                m_read_index.remove(item.key, item.hash);
+
+            m_index.erase(key_ref_t{ item.key, item.hash });
+            m_weight -= codec_t::weight(item.value);
+            touch(item.hash);
+
+            // the entry is freed or handed over after the lock is released
+            evicted.splice(evicted.end(), m_data, std::prev(m_data.end()));
+        }
+
+        m_size = m_data.size();
+        assert(m_size == m_index.size());
     }
 
 
+    // a new key that does not fit is admitted if it is used more often than the LRU victim
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::push(const key_t & key, value_t && value)
+    inline bool storage_t<key_type, value_type, traits_type>::admit
+    (
+        const key_ref_t              & ref,
+        const stored_t               & value,
+        typename index_t::iterator     found
+    )
     {
-        const std::lock_guard guard{ m_lock };
+        if constexpr (admission_enabled)
+        {
+            if (found != m_index.end() || m_data.empty() || m_weight + codec_t::weight(value) <= m_max_size)
+                return true;
 
-        auto found = m_index.find(key);
-        apply_new(key, std::move(value), found);
-        fix_size();
+            return m_admission.admit(ref.hash, m_data.back().hash);
+        }
+        else
+        {
+            return true;
+        }
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline void storage_t<key_type, value_type, traits_type>::push(const key_t & key, const value_t & value)
+    inline void storage_t<key_type, value_type, traits_type>::record(const key_ref_t & ref) const noexcept
     {
-        push(key, std::move(value_t(value)));
+        if constexpr (admission_enabled)
+            m_admission.record(ref.hash);
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    bool storage_t<key_type, value_type, traits_type>::compare_exchange
+    void storage_t<key_type, value_type, traits_type>::notify_evicted
     (
-        const key_t              & key,
-        value_t                 && desired,
-        std::optional<value_t>   & expected
+        list_t                  & evicted,
+        const handlers_ptr_t    & handlers
     )
     {
-        const std::lock_guard guard{ m_lock };
-
-        auto found = m_index.find(key);
-        if (!compare_with(found, expected))
-            return false;
-
-        apply_new(key, std::move(desired), found);
-        fix_size();
+        if (!handlers)
+            return;
 
-        return true;
+        for (item_t & item : evicted)
+        {
+            const evict_handler_t & handler = item.seq == rejected_seq ? handlers->reject : handlers->evict;
+            if (handler)
+                handler(std::move(item.key), decode(std::move(item.value)));
+        }
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline bool storage_t<key_type, value_type, traits_type>::compare_exchange
+    void storage_t<key_type, value_type, traits_type>::build_from_dump
     (
-        const key_t              & key,
-        const value_t            & desired,
-        std::optional<value_t>   & expected
+        const std::vector<std::pair<key_t, value_t>> & dump_data
     )
     {
-        return compare_exchange(key, std::move(value_t(desired)), expected);
+        const size_t dump_size = dump_data.size();
+        const size_t offset = dump_size < m_max_size ? 0 : dump_size - m_max_size;
+
+        for (auto it = dump_data.rbegin() + offset; it < dump_data.rend(); ++it)
+        {
+            const key_type & key = it->first;
+            stored_t value = encode(value_t(it->second));
+            const key_ref_t ref{ key };
+            const auto found = m_index.find(ref);
+
+            apply_new(ref, std::move(value), found);
+
+            list_t evicted;
+            fix_size(evicted);
+        }
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::find(const key_t & key) const
+    template <class func_type>
+    bool storage_t<key_type, value_type, traits_type>::visit(const key_t & key, func_type && func) const
     {
+        if constexpr (lock_free_find)
+            return m_read_index.visit(key, std::forward<func_type>(func));
+
         const std::lock_guard guard{ m_lock };
         auto found = m_index.find(key);
 
         if (found == m_index.end())
-            return std::optional<value_t>{};
+            return false;
 
         assert(found->second->key == key);
+        func(std::as_const(found->second->value), found->second->updated);
 
-        return std::optional<value_t>{ found->second->value };
+        return true;
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::first() const
+    inline typename storage_t<key_type, value_type, traits_type>::stored_t
+    storage_t<key_type, value_type, traits_type>::encode(value_t && value)
     {
-        const std::lock_guard guard{ m_lock };
-
-        if (m_size == 0)
-        {
-            assert(m_index.empty());
-            assert(m_data.empty());
-            return std::optional<value_t>{};
-        }
-
-        return std::optional<value_t>{ m_data.front().value };
+        if constexpr (transparent_codec)
+            return std::move(value);
+        else
+            return codec_t::encode(std::move(value));
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::last() const
+    inline value_type storage_t<key_type, value_type, traits_type>::decode(const stored_t & stored)
     {
-        const std::lock_guard guard{ m_lock };
-
-        if (m_size == 0)
-        {
-            assert(m_index.empty());
-            assert(m_data.empty());
-            return std::optional<value_t>{};
-        }
-
-        return std::optional<value_t>{ m_data.back().value };
+        if constexpr (transparent_codec)
+            return stored;
+        else
+            return codec_t::decode(stored);
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::map(std::function<void (const key_t & key, value_t & value)> func)
+    inline value_type storage_t<key_type, value_type, traits_type>::decode(stored_t && stored)
     {
-        const std::lock_guard guard{ m_lock };
-
-        for (item_t & item : m_data)
-            func(item.key, item.value);
+        if constexpr (transparent_codec)
+            return std::move(stored);
+        else
+            return codec_t::decode(stored);
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::map(std::function<void (const key_t & key, const value_t & value)> func) const
+    inline std::optional<value_type> storage_t<key_type, value_type, traits_type>::decode(std::optional<stored_t> && stored)
     {
-        const std::lock_guard guard{ m_lock };
+        if constexpr (transparent_codec)
+        {
+            return std::move(stored);
+        }
+        else
+        {
+            if (!stored)
+                return std::optional<value_t>{};
 
-        for (const item_t & item : m_data)
-            func(item.key, item.value);
+            return std::optional<value_t>{ codec_t::decode(*stored) };
+        }
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline size_t storage_t<key_type, value_type, traits_type>::size() const noexcept
+    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::decode
+    (
+        std::vector<std::pair<key_t, stored_t>> && items
+    )
     {
-        return m_size;
-    }
+        if constexpr (transparent_codec)
+        {
+            return std::move(items);
+        }
+        else
+        {
+            std::vector<std::pair<key_t, value_t>> decoded;
+            decoded.reserve(items.size());
 
+            for (auto & item : items)
+                decoded.emplace_back(std::move(item.first), codec_t::decode(item.second));
 
-    template <class key_type, class value_type, class traits_type>
-    inline bool storage_t<key_type, value_type, traits_type>::empty() const noexcept
-    {
-        return m_size == 0;
+            return decoded;
+        }
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    inline size_t storage_t<key_type, value_type, traits_type>::max_size() const noexcept
+    template <class item_type, class func_type>
+    inline decltype(auto) storage_t<key_type, value_type, traits_type>::apply_item(item_type & item, func_type & func)
     {
-        return m_max_size;
+        if constexpr (transparent_codec)
+        {
+            return func(std::as_const(item.key), item.value);
+        }
+        else if constexpr (std::is_const_v<item_type>)
+        {
+            const value_t value = codec_t::decode(item.value);
+            return func(item.key, value);
+        }
+        else
+        {
+            // the value is encoded back even when func did not change it
+            value_t value = codec_t::decode(item.value);
+
+            if constexpr (std::is_void_v<std::invoke_result_t<func_type &, const key_t &, value_t &>>)
+            {
+                func(std::as_const(item.key), value);
+                item.value = codec_t::encode(std::move(value));
+            }
+            else
+            {
+                auto result = func(std::as_const(item.key), value);
+                item.value = codec_t::encode(std::move(value));
+                return result;
+            }
+        }
     }
 
 
+    // splits the list into contiguous ranges, the calling thread handles the last one;
+    // m_lock is held by the caller during the whole traversal
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::erase(const key_t & key)
+    template <class list_type, class func_type>
+    void storage_t<key_type, value_type, traits_type>::parallel_apply(list_type & data, func_type & func, size_t threads)
     {
-        const std::lock_guard guard{ m_lock };
-        auto found = m_index.find(key);
+        if (threads == 0)
+            threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
 
-        if (found != m_index.end())
+        const size_t size = data.size();
+        threads = std::min(threads, std::max<size_t>(size, 1));
+
+        auto apply = [&func](auto first, auto last)
         {
-            assert(found->second->key == key);
-            m_data.erase(found->second);
-            m_index.erase(found);
+            for (; first != last; ++first)
+                apply_item(*first, func);
+        };
 
-            m_size = m_data.size();
-            assert(m_size == m_index.size());
+        const size_t chunk = size / threads;
+        std::vector<std::future<void>> futures;
+        futures.reserve(threads - 1);
+
+        auto first = data.begin();
+        for (size_t i = 0; i + 1 < threads; ++i)
+        {
+            auto last = std::next(first, chunk);
+            futures.push_back(std::async(std::launch::async, apply, first, last));
+            first = last;
         }
-    }
 
+        std::exception_ptr error;
 
-    template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::clear() noexcept
-    {
         try
         {
-            const std::lock_guard guard{ m_lock };
-            m_index.clear();
-            m_data.clear();
-            m_size = 0;
+            apply(first, data.end());
         }
         catch (...)
         {
-            // ignore unexpected exception in release
-            assert(false);
+            error = std::current_exception();
         }
-    }
 
-
-    template <class key_type, class value_type, class traits_type>
-    std::vector<std::pair<key_type, value_type>> storage_t<key_type, value_type, traits_type>::dump() const
-    {
-        std::vector<std::pair<key_t, value_t>> dump_data;
-        dump_data.reserve(size());
-
-        auto do_dump = [&dump_data](key_t key, const value_t& value)
+        for (std::future<void> & future : futures)
         {
-            dump_data.emplace_back(key, value);
-        };
-
-        map(do_dump);
+            try
+            {
+                future.get();
+            }
+            catch (...)
+            {
+                if (!error)
+                    error = std::current_exception();
+            }
+        }
 
-        return dump_data;
+        if (error)
+            std::rethrow_exception(error);
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::apply_new
+    void storage_t<key_type, value_type, traits_type>::republish
     (
-        const key_t                  & key,
-        value_t                     && value,
-        typename index_t::iterator     found
+        typename list_t::iterator first,
+        typename list_t::iterator last
     )
     {
-        m_data.emplace_front(std::move(value), key);
-
-        if (found == m_index.end())
+        if constexpr (!transparent_codec)
         {
-            m_index.emplace(key, m_data.begin());
+            size_t weight = 0;
+            for (const item_t & item : m_data)
+                weight += codec_t::weight(item.value);
+
+            // the limit is enforced again by the next push()
+            m_weight = weight;
         }
-        else
+
+        if constexpr (lock_free_find)
         {
-            assert(found->second->key == key);
-            m_data.erase(found->second);
-            found->second = m_data.begin();
+            for (; first != last; ++first)
+                m_read_index.publish(first->key, first->hash, first->value, first->updated);
         }
+
+        touch_all();
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::fix_size()
+    inline void storage_t<key_type, value_type, traits_type>::touch(size_t hash) noexcept
     {
-        if (m_data.size() > m_max_size)
-        {
-            m_index.erase(m_data.back().key);
-            m_data.pop_back();
-        }
-
-        m_size = m_data.size();
-        assert(m_size == m_index.size());
+        if constexpr (version_stripes > 0)
+            m_versions[hash % version_stripes].fetch_add(1, std::memory_order_release);
     }
 
 
     template <class key_type, class value_type, class traits_type>
-    void storage_t<key_type, value_type, traits_type>::build_from_dump
-    (
-        const std::vector<std::pair<key_t, value_t>> & dump_data
-    )
+    inline void storage_t<key_type, value_type, traits_type>::touch_all() noexcept
     {
-        const size_t dump_size = dump_data.size();
-        const size_t offset = dump_size < m_max_size ? 0 : dump_size - m_max_size;
-
-        for (auto it = dump_data.rbegin() + offset; it < dump_data.rend(); ++it)
-        {
-            const key_type & key = it->first;
-            value_t value = it->second;
-            const auto found = m_index.find(key);
-
-            apply_new(key, std::move(value), found);
-            fix_size();
-        }
+        if constexpr (version_stripes > 0)
+            m_generation.fetch_add(1, std::memory_order_release);
     }
 
 
@@ -410,15 +3402,27 @@ namespace kvstor
                 return false;
             }
 
-            expected = found->second->value;
+            expected = decode(found->second->value);
             return false;
         }
 
-        if (*expected == found->second->value)
-            return true;
+        if constexpr (transparent_codec)
+        {
+            if (*expected == found->second->value)
+                return true;
 
-        expected = found->second->value;
-        return false;
+            expected = found->second->value;
+            return false;
+        }
+        else
+        {
+            value_t current = codec_t::decode(found->second->value);
+            if (*expected == current)
+                return true;
+
+            expected = std::move(current);
+            return false;
+        }
     }
 
 }   // namespace kvstor
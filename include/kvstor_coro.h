@@ -0,0 +1,356 @@
+﻿// kvstor_coro.h : C++20 coroutine get-or-load for kvstor::storage_t<>
+
+#pragma once
+
+#include "kvstor.h"
+
+#if !__has_include(<coroutine>) || !defined(__cpp_impl_coroutine)
+#error "kvstor_coro.h requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+namespace kvstor
+{
+
+    // co_await async_get_or_load(key, loader) returns the stored value or loads it;
+    // concurrent awaiters of a missing key suspend on one load and resume when it completes.
+    // The storage and this object must outlive the loads in flight.
+    template <class storage_type>
+    class async_storage_t final
+    {
+    public:
+        using key_t = typename storage_type::key_t;
+        using value_t = typename storage_type::value_t;
+        using hash_t = typename storage_type::hash_t;
+        using kequal_t = typename storage_type::kequal_t;
+        using task_t = std::function<void ()>;
+        using executor_t = std::function<void (task_t task)>;
+
+        class completion_t;
+        class awaiter_t;
+
+        // a blocking loader runs as an executor task; std::nullopt means there is no value, nothing is stored
+        using loader_t = std::function<std::optional<value_t> (const key_t & key)>;
+
+        // a non-blocking loader starts the load and completes it exactly once, from any thread
+        using async_loader_t = std::function<void (const key_t & key, completion_t completion)>;
+
+        // the executor runs loads and resumes awaiters; by default both run in the calling thread
+        explicit async_storage_t(storage_type & stor, executor_t executor = nullptr);
+        async_storage_t(const async_storage_t &) = delete;
+        async_storage_t(async_storage_t &&) = delete;
+        ~async_storage_t() noexcept = default;
+
+        async_storage_t operator=(const async_storage_t &) = delete;
+        async_storage_t operator=(async_storage_t &&) = delete;
+
+        awaiter_t async_get_or_load(const key_t & key, loader_t loader);
+        awaiter_t async_get_or_load(const key_t & key, async_loader_t loader);
+
+        // keys being loaded
+        size_t in_flight() const;
+
+        storage_type & storage() noexcept { return m_stor; }
+
+    private:
+        struct flight_t
+        {
+            std::vector<std::coroutine_handle<>>    waiters;
+            std::optional<value_t>                  value;
+            std::exception_ptr                      error;
+            bool                                    closed = false;
+        };
+
+        using flight_ptr_t = std::shared_ptr<flight_t>;
+
+        void complete(const key_t & key, const flight_ptr_t & flight, std::optional<value_t> && value, std::exception_ptr error);
+
+        // resumes the waiters of the flight once, later calls are ignored
+        void close(const key_t & key, const flight_ptr_t & flight, std::optional<value_t> && value, std::exception_ptr error);
+        void execute(task_t task);
+
+        storage_type      & m_stor;
+        const executor_t    m_executor;
+
+        mutable std::mutex                                          m_lock;
+        std::unordered_map<key_t, flight_ptr_t, hash_t, kequal_t>   m_flights;
+    };
+
+
+    template <class storage_type>
+    class async_storage_t<storage_type>::completion_t final
+    {
+    public:
+        void set_value(std::optional<value_t> value) const;
+        void set_exception(std::exception_ptr error) const;
+
+    private:
+        friend class async_storage_t;
+
+        completion_t(async_storage_t * owner, key_t key, flight_ptr_t flight);
+
+        async_storage_t   * m_owner;
+        key_t               m_key;
+        flight_ptr_t        m_flight;
+    };
+
+
+    template <class storage_type>
+    class async_storage_t<storage_type>::awaiter_t final
+    {
+    public:
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> handle);
+        std::optional<value_t> await_resume();
+
+    private:
+        friend class async_storage_t;
+
+        using start_t = std::function<void (completion_t completion)>;
+
+        awaiter_t(async_storage_t * owner, const key_t & key, start_t start);
+
+        async_storage_t           * m_owner;
+        key_t                       m_key;
+        start_t                     m_start;
+        std::optional<value_t>      m_found;
+        flight_ptr_t                m_flight;
+    };
+
+
+    template <class storage_type>
+    inline async_storage_t<storage_type>::async_storage_t(storage_type & stor, executor_t executor)
+    :   m_stor(stor)
+    ,   m_executor(std::move(executor))
+    ,   m_lock()
+    ,   m_flights()
+    {
+    }
+
+
+    template <class storage_type>
+    typename async_storage_t<storage_type>::awaiter_t async_storage_t<storage_type>::async_get_or_load
+    (
+        const key_t   & key,
+        loader_t        loader
+    )
+    {
+        return awaiter_t{ this, key, [this, key, loader = std::move(loader)](completion_t completion)
+        {
+            execute([key, loader, completion]
+            {
+                try
+                {
+                    completion.set_value(loader(key));
+                }
+                catch (...)
+                {
+                    completion.set_exception(std::current_exception());
+                }
+            });
+        } };
+    }
+
+
+    template <class storage_type>
+    typename async_storage_t<storage_type>::awaiter_t async_storage_t<storage_type>::async_get_or_load
+    (
+        const key_t     & key,
+        async_loader_t    loader
+    )
+    {
+        return awaiter_t{ this, key, [key, loader = std::move(loader)](completion_t completion)
+        {
+            try
+            {
+                loader(key, completion);
+            }
+            catch (...)
+            {
+                completion.set_exception(std::current_exception());
+            }
+        } };
+    }
+
+
+    template <class storage_type>
+    inline size_t async_storage_t<storage_type>::in_flight() const
+    {
+        const std::lock_guard guard{ m_lock };
+        return m_flights.size();
+    }
+
+
+    template <class storage_type>
+    void async_storage_t<storage_type>::complete
+    (
+        const key_t             & key,
+        const flight_ptr_t      & flight,
+        std::optional<value_t> && value,
+        std::exception_ptr        error
+    )
+    {
+        // stored before the flight is closed: an awaiter that misses the flight finds the value
+        if (value)
+        {
+            try
+            {
+                m_stor.push(key, *value);
+            }
+            catch (...)
+            {
+                // e.g. a failed evict handler, the awaiters get the error
+                value.reset();
+                error = std::current_exception();
+            }
+        }
+
+        close(key, flight, std::move(value), std::move(error));
+    }
+
+
+    template <class storage_type>
+    void async_storage_t<storage_type>::close
+    (
+        const key_t             & key,
+        const flight_ptr_t      & flight,
+        std::optional<value_t> && value,
+        std::exception_ptr        error
+    )
+    {
+        std::vector<std::coroutine_handle<>> waiters;
+        {
+            const std::lock_guard guard{ m_lock };
+
+            if (flight->closed)
+                return;
+
+            flight->closed = true;
+            flight->value = std::move(value);
+            flight->error = std::move(error);
+            waiters.swap(flight->waiters);
+
+            const auto found = m_flights.find(key);
+            if (found != m_flights.end() && found->second == flight)
+                m_flights.erase(found);
+        }
+
+        for (std::coroutine_handle<> waiter : waiters)
+            execute([waiter] { waiter.resume(); });
+    }
+
+
+    template <class storage_type>
+    inline void async_storage_t<storage_type>::execute(task_t task)
+    {
+        if (m_executor)
+            m_executor(std::move(task));
+        else
+            task();
+    }
+
+
+    template <class storage_type>
+    inline async_storage_t<storage_type>::completion_t::completion_t(async_storage_t * owner, key_t key, flight_ptr_t flight)
+    :   m_owner(owner)
+    ,   m_key(std::move(key))
+    ,   m_flight(std::move(flight))
+    {
+    }
+
+
+    template <class storage_type>
+    inline void async_storage_t<storage_type>::completion_t::set_value(std::optional<value_t> value) const
+    {
+        m_owner->complete(m_key, m_flight, std::move(value), nullptr);
+    }
+
+
+    template <class storage_type>
+    inline void async_storage_t<storage_type>::completion_t::set_exception(std::exception_ptr error) const
+    {
+        m_owner->complete(m_key, m_flight, std::nullopt, std::move(error));
+    }
+
+
+    template <class storage_type>
+    inline async_storage_t<storage_type>::awaiter_t::awaiter_t(async_storage_t * owner, const key_t & key, start_t start)
+    :   m_owner(owner)
+    ,   m_key(key)
+    ,   m_start(std::move(start))
+    ,   m_found()
+    ,   m_flight()
+    {
+    }
+
+
+    template <class storage_type>
+    inline bool async_storage_t<storage_type>::awaiter_t::await_ready()
+    {
+        m_found = m_owner->m_stor.find(m_key);
+        return m_found.has_value();
+    }
+
+
+    template <class storage_type>
+    bool async_storage_t<storage_type>::awaiter_t::await_suspend(std::coroutine_handle<> handle)
+    {
+        flight_ptr_t flight;
+        {
+            const std::lock_guard guard{ m_owner->m_lock };
+
+            const auto found = m_owner->m_flights.find(m_key);
+            if (found != m_owner->m_flights.end())
+            {
+                m_flight = found->second;
+                m_flight->waiters.push_back(handle);
+                return true;
+            }
+
+            flight = std::make_shared<flight_t>();
+            flight->waiters.push_back(handle);
+            m_flight = flight;
+            m_owner->m_flights.emplace(m_key, flight);
+        }
+
+        // the coroutine may be resumed and this awaiter destroyed before close() or start() returns
+        async_storage_t * owner = m_owner;
+
+        // a load may have completed since await_ready(): its value was stored before its flight was closed,
+        // so it is found here without holding m_lock, and the awaiters joined meanwhile get it as well
+        std::optional<value_t> stored = owner->m_stor.find(m_key);
+        if (stored)
+        {
+            owner->close(m_key, flight, std::move(stored), nullptr);
+            return true;
+        }
+
+        const start_t start = std::move(m_start);
+        start(completion_t{ owner, m_key, std::move(flight) });
+        return true;
+    }
+
+
+    template <class storage_type>
+    std::optional<typename storage_type::value_t> async_storage_t<storage_type>::awaiter_t::await_resume()
+    {
+        if (m_found || !m_flight)
+            return std::move(m_found);
+
+        if (m_flight->error)
+            std::rethrow_exception(m_flight->error);
+
+        return m_flight->value;
+    }
+
+}   // namespace kvstor
@@ -0,0 +1,478 @@
+﻿// kvstor_delegate.h : single-writer kvstor::storage_t<> fed by a lock-free operation queue
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace kvstor
+{
+
+    // bounded multi-producer single-consumer ring (D. Vyukov's bounded queue),
+    // the capacity is rounded up to a power of two
+    template <class item_type>
+    class mpsc_ring_t final
+    {
+    public:
+        explicit mpsc_ring_t(size_t capacity);
+        mpsc_ring_t(const mpsc_ring_t &) = delete;
+        mpsc_ring_t(mpsc_ring_t &&) = delete;
+        ~mpsc_ring_t() noexcept = default;
+
+        mpsc_ring_t operator=(const mpsc_ring_t &) = delete;
+        mpsc_ring_t operator=(mpsc_ring_t &&) = delete;
+
+        // returns false and keeps the item if the ring is full
+        bool try_push(item_type && item);
+
+        // called by the consumer only
+        std::optional<item_type> try_pop();
+        bool empty() const noexcept;
+
+        // number of positions taken by producers so far, including items still being written
+        uint64_t claimed() const noexcept;
+        size_t capacity() const noexcept;
+
+    private:
+        struct alignas(cache_line_size) cell_t
+        {
+            std::atomic<uint64_t>       sequence{ 0 };
+            std::optional<item_type>    item;
+        };
+
+        std::unique_ptr<cell_t[]>   m_cells;
+        const size_t                m_mask;
+
+        alignas(cache_line_size)
+        std::atomic<uint64_t>       m_tail;
+
+        alignas(cache_line_size)
+        uint64_t                    m_head;
+    };
+
+
+    // every mutation is queued and applied by one owner thread, so writers never wait for m_lock
+    // and the owner trims the storage once per batch of pushes;
+    // reads go to the lock-free index of the storage and see a mutation once the owner has applied it
+    template <class storage_type>
+    class delegated_storage_t final
+    {
+        static_assert(storage_type::lock_free_find, "delegated_storage_t reads through the lock-free index");
+
+    public:
+        using key_t = typename storage_type::key_t;
+        using value_t = typename storage_type::value_t;
+
+        explicit delegated_storage_t(size_t max_size, size_t queue_size = 65536, size_t max_batch = 256);
+        delegated_storage_t(const delegated_storage_t &) = delete;
+        delegated_storage_t(delegated_storage_t &&) = delete;
+        // applies the queued operations and stops the owner thread
+        ~delegated_storage_t() noexcept;
+
+        delegated_storage_t operator=(const delegated_storage_t &) = delete;
+        delegated_storage_t operator=(delegated_storage_t &&) = delete;
+
+        // queue the operation, waiting while the queue is full
+        void push(const key_t & key, value_t && value);
+        void push(const key_t & key, const value_t & value);
+        void erase(const key_t & key);
+
+        // return false if the queue is full
+        bool try_push(const key_t & key, value_t && value);
+        bool try_erase(const key_t & key);
+
+        std::optional<value_t> find(const key_t & key) const;
+        bool contains(const key_t & key) const;
+
+        // waits until every operation queued before the call is applied
+        void flush();
+
+        // queued operations not applied yet
+        size_t pending() const noexcept;
+
+        // queued operations not applied because of an exception in the owner thread; a batch of pushes that fails
+        // partway counts only the pushes from the failed one on, an exception of the evict handler counts none
+        size_t apply_errors() const noexcept;
+
+        // compare_exchange() and other synchronous operations go to the storage directly
+        storage_type & storage() noexcept;
+
+    private:
+        // an operation without a value is an erase
+        struct op_t
+        {
+            key_t                   key;
+            std::optional<value_t>  value;
+        };
+
+        bool enqueue(op_t && op);
+        void run() noexcept;
+        void apply(std::vector<std::pair<key_t, value_t>> & batch) noexcept;
+
+        storage_type                m_stor;
+        mpsc_ring_t<op_t>           m_queue;
+        const size_t                m_max_batch;
+
+        std::atomic<uint64_t>       m_applied;
+        std::atomic<size_t>         m_apply_errors;
+        std::atomic<bool>           m_sleeping;
+        std::atomic<size_t>         m_flush_waiters;
+
+        std::mutex                  m_lock;
+        std::condition_variable     m_wakeup;
+        std::condition_variable     m_flushed;
+        bool                        m_stop;
+
+        // must be the last member: stopped before the queue and the storage are destroyed
+        std::thread                 m_owner;
+    };
+
+
+    inline size_t ring_capacity(size_t capacity) noexcept
+    {
+        size_t rounded = 2;
+        while (rounded < capacity)
+            rounded <<= 1;
+
+        return rounded;
+    }
+
+
+    template <class item_type>
+    inline mpsc_ring_t<item_type>::mpsc_ring_t(size_t capacity)
+    :   m_cells(new cell_t[ring_capacity(capacity)])
+    ,   m_mask(ring_capacity(capacity) - 1)
+    ,   m_tail(0)
+    ,   m_head(0)
+    {
+        for (size_t i = 0; i <= m_mask; ++i)
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+
+    template <class item_type>
+    bool mpsc_ring_t<item_type>::try_push(item_type && item)
+    {
+        uint64_t position = m_tail.load(std::memory_order_relaxed);
+        cell_t * cell = nullptr;
+
+        while (true)
+        {
+            cell = &m_cells[position & m_mask];
+            const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+
+            if (sequence == position)
+            {
+                if (m_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (sequence < position)
+            {
+                // the consumer has not freed the cell of the previous lap
+                return false;
+            }
+            else
+            {
+                position = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->item.emplace(std::move(item));
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+
+    template <class item_type>
+    std::optional<item_type> mpsc_ring_t<item_type>::try_pop()
+    {
+        cell_t & cell = m_cells[m_head & m_mask];
+
+        if (cell.sequence.load(std::memory_order_acquire) != m_head + 1)
+            return std::nullopt;
+
+        std::optional<item_type> item{ std::move(cell.item) };
+        cell.item.reset();
+        cell.sequence.store(m_head + m_mask + 1, std::memory_order_release);
+        ++m_head;
+
+        return item;
+    }
+
+
+    template <class item_type>
+    inline bool mpsc_ring_t<item_type>::empty() const noexcept
+    {
+        return m_cells[m_head & m_mask].sequence.load(std::memory_order_acquire) != m_head + 1;
+    }
+
+
+    template <class item_type>
+    inline uint64_t mpsc_ring_t<item_type>::claimed() const noexcept
+    {
+        return m_tail.load(std::memory_order_acquire);
+    }
+
+
+    template <class item_type>
+    inline size_t mpsc_ring_t<item_type>::capacity() const noexcept
+    {
+        return m_mask + 1;
+    }
+
+
+    template <class storage_type>
+    inline delegated_storage_t<storage_type>::delegated_storage_t(size_t max_size, size_t queue_size, size_t max_batch)
+    :   m_stor(max_size)
+    ,   m_queue(queue_size)
+    ,   m_max_batch(max_batch > 0 ? max_batch : 1)
+    ,   m_applied(0)
+    ,   m_apply_errors(0)
+    ,   m_sleeping(false)
+    ,   m_flush_waiters(0)
+    ,   m_lock()
+    ,   m_wakeup()
+    ,   m_flushed()
+    ,   m_stop(false)
+    ,   m_owner(&delegated_storage_t::run, this)
+    {
+    }
+
+
+    template <class storage_type>
+    inline delegated_storage_t<storage_type>::~delegated_storage_t() noexcept
+    {
+        {
+            const std::lock_guard guard{ m_lock };
+            m_stop = true;
+        }
+
+        m_wakeup.notify_one();
+        m_owner.join();
+    }
+
+
+    template <class storage_type>
+    void delegated_storage_t<storage_type>::push(const key_t & key, value_t && value)
+    {
+        op_t op{ key, std::move(value) };
+        while (!enqueue(std::move(op)))
+            std::this_thread::yield();
+    }
+
+
+    template <class storage_type>
+    inline void delegated_storage_t<storage_type>::push(const key_t & key, const value_t & value)
+    {
+        push(key, value_t(value));
+    }
+
+
+    template <class storage_type>
+    void delegated_storage_t<storage_type>::erase(const key_t & key)
+    {
+        op_t op{ key, std::nullopt };
+        while (!enqueue(std::move(op)))
+            std::this_thread::yield();
+    }
+
+
+    template <class storage_type>
+    inline bool delegated_storage_t<storage_type>::try_push(const key_t & key, value_t && value)
+    {
+        op_t op{ key, std::move(value) };
+        if (enqueue(std::move(op)))
+            return true;
+
+        // the value is given back
+        value = std::move(*op.value);
+        return false;
+    }
+
+
+    template <class storage_type>
+    inline bool delegated_storage_t<storage_type>::try_erase(const key_t & key)
+    {
+        return enqueue(op_t{ key, std::nullopt });
+    }
+
+
+    template <class storage_type>
+    inline std::optional<typename storage_type::value_t> delegated_storage_t<storage_type>::find(const key_t & key) const
+    {
+        return m_stor.find(key);
+    }
+
+
+    template <class storage_type>
+    inline bool delegated_storage_t<storage_type>::contains(const key_t & key) const
+    {
+        return m_stor.contains(key);
+    }
+
+
+    template <class storage_type>
+    void delegated_storage_t<storage_type>::flush()
+    {
+        const uint64_t ticket = m_queue.claimed();
+        if (m_applied.load(std::memory_order_acquire) >= ticket)
+            return;
+
+        std::unique_lock guard{ m_lock };
+        m_flush_waiters.fetch_add(1, std::memory_order_relaxed);
+
+        // pairs with the fence of the owner after applying: either it sees the waiter or we see the progress
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        m_flushed.wait(guard, [this, ticket] { return m_applied.load(std::memory_order_acquire) >= ticket; });
+        m_flush_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+
+    template <class storage_type>
+    inline size_t delegated_storage_t<storage_type>::pending() const noexcept
+    {
+        const uint64_t applied = m_applied.load(std::memory_order_acquire);
+        const uint64_t claimed = m_queue.claimed();
+        return claimed > applied ? static_cast<size_t>(claimed - applied) : 0;
+    }
+
+
+    template <class storage_type>
+    inline size_t delegated_storage_t<storage_type>::apply_errors() const noexcept
+    {
+        return m_apply_errors.load(std::memory_order_relaxed);
+    }
+
+
+    template <class storage_type>
+    inline storage_type & delegated_storage_t<storage_type>::storage() noexcept
+    {
+        return m_stor;
+    }
+
+
+    template <class storage_type>
+    bool delegated_storage_t<storage_type>::enqueue(op_t && op)
+    {
+        if (!m_queue.try_push(std::move(op)))
+            return false;
+
+        // pairs with the fence of the owner going to sleep: either it sees the operation or we see it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (m_sleeping.load(std::memory_order_relaxed))
+        {
+            const std::lock_guard guard{ m_lock };
+            m_wakeup.notify_one();
+        }
+
+        return true;
+    }
+
+
+    template <class storage_type>
+    void delegated_storage_t<storage_type>::run() noexcept
+    {
+        std::vector<std::pair<key_t, value_t>> batch;
+
+        while (true)
+        {
+            size_t count = 0;
+
+            while (count < m_max_batch)
+            {
+                std::optional<op_t> op = m_queue.try_pop();
+                if (!op)
+                    break;
+
+                ++count;
+
+                if (op->value)
+                {
+                    batch.emplace_back(std::move(op->key), std::move(*op->value));
+                    continue;
+                }
+
+                // the pushes queued before the erase are applied first
+                apply(batch);
+
+                try
+                {
+                    m_stor.erase(op->key);
+                }
+                catch (...)
+                {
+                    ++m_apply_errors;
+                }
+            }
+
+            apply(batch);
+
+            if (count > 0)
+            {
+                m_applied.fetch_add(count, std::memory_order_release);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (m_flush_waiters.load(std::memory_order_relaxed) > 0)
+                {
+                    { const std::lock_guard guard{ m_lock }; }
+                    m_flushed.notify_all();
+                }
+
+                continue;
+            }
+
+            std::unique_lock guard{ m_lock };
+
+            m_sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (m_queue.empty())
+            {
+                if (m_stop)
+                    break;
+
+                // the timeout only guards against a missed wakeup
+                m_wakeup.wait_for(guard, std::chrono::milliseconds(10));
+            }
+
+            m_sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+
+    // the pushes are applied under one lock and trimmed to max_size once
+    template <class storage_type>
+    void delegated_storage_t<storage_type>::apply(std::vector<std::pair<key_t, value_t>> & batch) noexcept
+    {
+        if (batch.empty())
+            return;
+
+        // the pushes stored before the failure stay applied
+        size_t applied = 0;
+
+        try
+        {
+            m_stor.push(std::move(batch), applied);
+        }
+        catch (...)
+        {
+            m_apply_errors += batch.size() - applied;
+        }
+
+        batch.clear();
+    }
+
+}   // namespace kvstor
@@ -0,0 +1,162 @@
+﻿// kvstor_front_cache.h : per-thread front cache for kvstor::storage_t<>
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+namespace kvstor
+{
+
+    // Small direct-mapped cache kept by every reading thread in front of a storage.
+    // A cached entry is valid while storage_t::version() of its key is unchanged,
+    // so hits take no lock and see every modification made before the lookup.
+    template <class storage_type>
+    class front_cache_t final
+    {
+    public:
+        using key_t = typename storage_type::key_t;
+        using value_t = typename storage_type::value_t;
+        using hash_t = typename storage_type::hash_t;
+        using kequal_t = typename storage_type::kequal_t;
+
+        static_assert(storage_type::version_stripes > 0, "front_cache_t requires traits_type::version_stripes > 0");
+
+        explicit front_cache_t(storage_type & stor, size_t slots = 1024);
+        front_cache_t(const front_cache_t &) = delete;
+        front_cache_t(front_cache_t &&) = delete;
+        ~front_cache_t() noexcept = default;
+
+        front_cache_t operator=(const front_cache_t &) = delete;
+        front_cache_t operator=(front_cache_t &&) = delete;
+
+        std::optional<value_t> find(const key_t & key) const;
+
+        // drops entries cached by the calling thread
+        void reset_local() const;
+
+        size_t slots() const noexcept;
+        storage_type & storage() const noexcept;
+
+    private:
+        struct slot_t
+        {
+            std::optional<std::pair<key_t, value_t>>    entry;
+            uint64_t                                    version = 0;
+        };
+
+        struct local_t
+        {
+            uint64_t                owner;
+            std::vector<slot_t>     slots;
+        };
+
+        // a thread keeps slots for the most recently used front caches only
+        static constexpr size_t max_local_caches = 8;
+
+        static uint64_t next_id() noexcept;
+        std::vector<slot_t> & local_slots() const;
+
+        storage_type      & m_stor;
+        const size_t        m_slots;
+        const uint64_t      m_id;
+    };
+
+
+    template <class storage_type>
+    inline front_cache_t<storage_type>::front_cache_t(storage_type & stor, size_t slots)
+    :   m_stor(stor)
+    ,   m_slots(slots > 0 ? slots : 1)
+    ,   m_id(next_id())
+    {
+    }
+
+
+    template <class storage_type>
+    std::optional<typename storage_type::value_t> front_cache_t<storage_type>::find(const key_t & key) const
+    {
+        std::vector<slot_t> & slots = local_slots();
+        slot_t & slot = slots[hash_t{}(key) % m_slots];
+
+        const uint64_t version = m_stor.version(key);
+        if (slot.entry && slot.version == version && kequal_t{}(slot.entry->first, key))
+            return std::optional<value_t>{ slot.entry->second };
+
+        // the version is read before the value: a concurrent update makes the entry stale, not wrong
+        std::optional<value_t> found = m_stor.find(key);
+        if (found)
+        {
+            slot.entry.emplace(key, *found);
+            slot.version = version;
+        }
+        else if (slot.entry && kequal_t{}(slot.entry->first, key))
+        {
+            slot.entry.reset();
+        }
+
+        return found;
+    }
+
+
+    template <class storage_type>
+    void front_cache_t<storage_type>::reset_local() const
+    {
+        for (slot_t & slot : local_slots())
+            slot.entry.reset();
+    }
+
+
+    template <class storage_type>
+    inline size_t front_cache_t<storage_type>::slots() const noexcept
+    {
+        return m_slots;
+    }
+
+
+    template <class storage_type>
+    inline storage_type & front_cache_t<storage_type>::storage() const noexcept
+    {
+        return m_stor;
+    }
+
+
+    template <class storage_type>
+    inline uint64_t front_cache_t<storage_type>::next_id() noexcept
+    {
+        static std::atomic<uint64_t> id{ 1 };
+        return id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+    template <class storage_type>
+    std::vector<typename front_cache_t<storage_type>::slot_t> & front_cache_t<storage_type>::local_slots() const
+    {
+        // ordered from the most recently used, ids are never reused
+        static thread_local std::vector<local_t> caches;
+
+        if (!caches.empty() && caches.front().owner == m_id)
+            return caches.front().slots;
+
+        auto found = std::find_if(caches.begin(), caches.end(), [this](const local_t & item) { return item.owner == m_id; });
+
+        if (found == caches.end())
+        {
+            if (caches.size() >= max_local_caches)
+                caches.pop_back();
+
+            caches.push_back(local_t{ m_id, std::vector<slot_t>(m_slots) });
+            found = caches.end() - 1;
+        }
+
+        std::rotate(caches.begin(), found, found + 1);
+        return caches.front().slots;
+    }
+
+}   // namespace kvstor
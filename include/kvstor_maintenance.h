@@ -0,0 +1,194 @@
+﻿// kvstor_maintenance.h : background maintenance thread for kvstor::storage_t<>
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+
+
+namespace kvstor
+{
+
+    // runs the amortized work of a storage once per period, so that push() and find() do only their own work:
+    // expires entries not updated for max_age (at most batch of them per tick), trims the storage down to
+    // its low watermark, copies up to batch buckets of a grown lock-free index, ages the tinylfu_admission_t
+    // sketch instead of the pushing threads and aggregates stats.
+    // A zero period starts no thread: the owner calls tick(), e.g. in tests.
+    template <class storage_type>
+    class maintenance_t final
+    {
+    public:
+        using duration_t = typename storage_type::duration_t;
+
+        struct stats_t
+        {
+            uint64_t    ticks = 0;
+            uint64_t    expired = 0;
+            uint64_t    trimmed = 0;
+            uint64_t    agings = 0;
+
+            // as of the last tick
+            size_t      size = 0;
+            size_t      weight = 0;
+        };
+
+        maintenance_t
+        (
+            storage_type                  & stor,
+            duration_t                      period,
+            std::optional<duration_t>       max_age = std::nullopt,
+            size_t                          batch = 1024
+        );
+        maintenance_t(const maintenance_t &) = delete;
+        maintenance_t(maintenance_t &&) = delete;
+        ~maintenance_t() noexcept;
+
+        maintenance_t operator=(const maintenance_t &) = delete;
+        maintenance_t operator=(maintenance_t &&) = delete;
+
+        // runs one round in the calling thread
+        void tick();
+
+        // no background tick runs after it returns, must not be called concurrently
+        void stop() noexcept;
+
+        stats_t stats() const;
+
+    private:
+        static constexpr bool tinylfu = std::is_same_v<typename storage_type::admission_t, tinylfu_admission_t>;
+
+        void run() noexcept;
+
+        storage_type                      & m_stor;
+        const duration_t                    m_period;
+        const std::optional<duration_t>     m_max_age;
+        const size_t                        m_batch;
+
+        // ticks are serialized, the stats lock is not held while the storage is maintained
+        std::mutex                          m_tick_lock;
+        mutable std::mutex                  m_lock;
+        std::condition_variable             m_wakeup;
+        bool                                m_stop;
+        stats_t                             m_stats;
+
+        // must be the last member: started after the other members are constructed
+        std::thread                         m_thread;
+    };
+
+
+    template <class storage_type>
+    inline maintenance_t<storage_type>::maintenance_t
+    (
+        storage_type                  & stor,
+        duration_t                      period,
+        std::optional<duration_t>       max_age,
+        size_t                          batch
+    )
+    :   m_stor(stor)
+    ,   m_period(period)
+    ,   m_max_age(max_age)
+    ,   m_batch(batch)
+    ,   m_tick_lock()
+    ,   m_lock()
+    ,   m_wakeup()
+    ,   m_stop(false)
+    ,   m_stats()
+    ,   m_thread()
+    {
+        if constexpr (tinylfu)
+            m_stor.admission().defer_aging(true);
+
+        if (m_period > duration_t::zero())
+            m_thread = std::thread(&maintenance_t::run, this);
+    }
+
+
+    template <class storage_type>
+    inline maintenance_t<storage_type>::~maintenance_t() noexcept
+    {
+        stop();
+
+        if constexpr (tinylfu)
+            m_stor.admission().defer_aging(false);
+    }
+
+
+    template <class storage_type>
+    void maintenance_t<storage_type>::tick()
+    {
+        const std::lock_guard tick_guard{ m_tick_lock };
+
+        size_t expired = 0;
+        if (m_max_age)
+            expired = m_stor.expire(*m_max_age, m_batch);
+
+        const size_t trimmed = m_stor.trim();
+        m_stor.rehash(m_batch);
+
+        bool aged = false;
+        if constexpr (tinylfu)
+            aged = m_stor.admission().age_if_due();
+
+        const std::lock_guard guard{ m_lock };
+
+        ++m_stats.ticks;
+        m_stats.expired += expired;
+        m_stats.trimmed += trimmed;
+        m_stats.agings += aged ? 1 : 0;
+        m_stats.size = m_stor.size();
+        m_stats.weight = m_stor.weight();
+    }
+
+
+    template <class storage_type>
+    void maintenance_t<storage_type>::stop() noexcept
+    {
+        {
+            const std::lock_guard guard{ m_lock };
+            m_stop = true;
+        }
+
+        m_wakeup.notify_one();
+
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+
+    template <class storage_type>
+    inline typename maintenance_t<storage_type>::stats_t maintenance_t<storage_type>::stats() const
+    {
+        const std::lock_guard guard{ m_lock };
+        return m_stats;
+    }
+
+
+    template <class storage_type>
+    void maintenance_t<storage_type>::run() noexcept
+    {
+        std::unique_lock guard{ m_lock };
+
+        while (!m_wakeup.wait_for(guard, m_period, [this] { return m_stop; }))
+        {
+            guard.unlock();
+
+            try
+            {
+                tick();
+            }
+            catch (...)
+            {
+                // an evict handler failed, the next tick continues
+            }
+
+            guard.lock();
+        }
+    }
+
+}   // namespace kvstor
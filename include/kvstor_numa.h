@@ -0,0 +1,713 @@
+﻿// kvstor_numa.h : NUMA-aware sharding of kvstor::storage_t<>
+//
+// Memory is bound to nodes through libnuma when KVSTOR_USE_LIBNUMA is defined and <numa.h> is available
+// (link with -lnuma); otherwise the machine is treated as a single node and memory is placed by the OS.
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#if defined(KVSTOR_USE_LIBNUMA) && __has_include(<numa.h>)
+#define KVSTOR_NUMA_ENABLED 1
+#include <numa.h>
+#include <sched.h>
+#else
+#define KVSTOR_NUMA_ENABLED 0
+#endif
+
+
+namespace kvstor
+{
+
+    struct numa_t
+    {
+        // allocations of at least this size get their own pages bound to a node,
+        // smaller ones are carved from the chunks of numa_arena_t bound to the node
+        static constexpr size_t min_bound_size = 4096;
+
+        static bool available() noexcept;
+        static size_t nodes() noexcept;
+
+        // the node of the innermost numa_scope_t of the calling thread, otherwise the node it runs on
+        static size_t current_node() noexcept;
+
+        // runs the calling thread on the cpus of the node, returns false if it is not possible
+        static bool bind_thread(size_t node) noexcept;
+
+        // bound to the node (the current one by default) if libnuma is available, throws std::bad_alloc;
+        // nodes beyond nodes() are simulated and wrap around
+        static void * allocate(size_t size, size_t alignment, std::optional<size_t> node);
+        static void deallocate(void * ptr, size_t size, size_t alignment) noexcept;
+
+    private:
+        friend class numa_scope_t;
+
+        template <class item_type>
+        friend struct numa_alloc_t;
+
+        static int & scope_node() noexcept;
+    };
+
+
+    // allocations of the thread made by numa_alloc_t and the routing of sharded_storage_t
+    // go to the node while the scope is alive
+    class numa_scope_t final
+    {
+    public:
+        explicit numa_scope_t(size_t node) noexcept;
+        numa_scope_t(const numa_scope_t &) = delete;
+        numa_scope_t(numa_scope_t &&) = delete;
+        ~numa_scope_t() noexcept;
+
+        numa_scope_t operator=(const numa_scope_t &) = delete;
+        numa_scope_t operator=(numa_scope_t &&) = delete;
+
+    private:
+        const int   m_previous;
+    };
+
+
+    // blocks of the allocations smaller than numa_t::min_bound_size, e.g. list and index nodes:
+    // per node and size free lists refilled from chunks bound to the node; a chunk starts with its node,
+    // so a block freed on another thread goes back to its own node; the chunks are never returned to the system
+    class numa_arena_t final
+    {
+    public:
+        static constexpr size_t chunk_size = 65536;
+        static constexpr size_t granularity = 16;
+
+        static bool fits(size_t size, size_t alignment) noexcept;
+
+        // node < numa_t::nodes(), throws std::bad_alloc
+        static void * allocate(size_t size, size_t alignment, size_t node);
+        static void deallocate(void * ptr, size_t size, size_t alignment) noexcept;
+
+    private:
+        struct chunk_header_t
+        {
+            size_t node;
+        };
+
+        struct free_block_t
+        {
+            free_block_t * next;
+        };
+
+        struct alignas(cache_line_size) size_class_t
+        {
+            std::mutex      lock;
+            free_block_t  * free = nullptr;
+            char          * next = nullptr;
+            char          * end = nullptr;
+        };
+
+        static constexpr size_t size_classes = numa_t::min_bound_size / granularity;
+
+        struct node_arena_t
+        {
+            size_class_t    classes[size_classes];
+        };
+
+        static size_t block_size(size_t size, size_t alignment) noexcept;
+        static size_class_t & size_class(size_t node, size_t block) noexcept;
+        static char * allocate_chunk(size_t node);
+    };
+
+
+    // binds the allocations to the node of the current numa_scope_t, otherwise to the node the thread runs on;
+    // memory that the items allocate on their own, e.g. the buffer of a long std::string, is not covered
+    template <class item_type>
+    struct numa_alloc_t
+    {
+        using value_type = item_type;
+
+        numa_alloc_t() noexcept = default;
+
+        template <class other_type>
+        numa_alloc_t(const numa_alloc_t<other_type> &) noexcept {}
+
+        item_type * allocate(size_t count);
+        void deallocate(item_type * ptr, size_t count) noexcept;
+
+        template <class other_type>
+        bool operator==(const numa_alloc_t<other_type> &) const noexcept { return true; }
+
+        template <class other_type>
+        bool operator!=(const numa_alloc_t<other_type> &) const noexcept { return false; }
+    };
+
+
+    template <class key_type, class value_type>
+    struct numa_traits_t : traits_t<key_type, value_type>
+    {
+        template <class item_type>
+        using alloc_t = numa_alloc_t<item_type>;
+    };
+
+
+    enum class numa_route_t
+    {
+        // a key always lives in the same shard
+        hash,
+
+        // a key is written to the shards of the writer's node and removed from the other nodes,
+        // lookups try the local node first; for workloads where every key is written by one node,
+        // writes of a key from several nodes are serialized by a lock striped by key
+        local,
+    };
+
+
+    // storage split into shards_per_node shards on every NUMA node, every shard is a storage_type
+    // of max_size / shards entries allocated on its node; push() runs in a numa_scope_t of the shard's node,
+    // so with numa_traits_t the entries live on the node of their shard whichever thread writes them
+    template <class storage_type>
+    class sharded_storage_t final
+    {
+    public:
+        using key_t = typename storage_type::key_t;
+        using value_t = typename storage_type::value_t;
+        using hash_t = typename storage_type::hash_t;
+
+        // nodes == 0 uses numa_t::nodes(), other values simulate nodes
+        explicit sharded_storage_t
+        (
+            size_t          max_size,
+            numa_route_t    route = numa_route_t::hash,
+            size_t          shards_per_node = 4,
+            size_t          nodes = 0
+        );
+        sharded_storage_t(const sharded_storage_t &) = delete;
+        sharded_storage_t(sharded_storage_t &&) = delete;
+        ~sharded_storage_t() noexcept = default;
+
+        sharded_storage_t operator=(const sharded_storage_t &) = delete;
+        sharded_storage_t operator=(sharded_storage_t &&) = delete;
+
+        void push(const key_t & key, value_t && value);
+        void push(const key_t & key, const value_t & value);
+        std::optional<value_t> find(const key_t & key) const;
+        bool contains(const key_t & key) const;
+        void erase(const key_t & key);
+
+        size_t size() const noexcept;
+        size_t max_size() const noexcept;
+
+        size_t nodes() const noexcept;
+        size_t shards() const noexcept;
+        storage_type & shard(size_t index) noexcept;
+        size_t node_of(size_t index) const noexcept;
+
+    private:
+        // storage_t aligns its counters, so no two shards share a cache line
+        struct shard_t
+        {
+            shard_t(size_t node_, size_t max_size)
+            :   node(node_)
+            ,   stor(max_size)
+            {
+            }
+
+            const size_t    node;
+            storage_type    stor;
+        };
+
+        struct shard_deleter_t
+        {
+            void operator()(shard_t * shard) const noexcept;
+        };
+
+        using shard_ptr_t = std::unique_ptr<shard_t, shard_deleter_t>;
+
+        struct alignas(cache_line_size) write_lock_t
+        {
+            std::mutex      lock;
+        };
+
+        static constexpr size_t write_locks = 64;
+
+        size_t local_node() const noexcept;
+        std::mutex & write_lock(const key_t & key) const;
+        size_t slot(const key_t & key) const;
+        shard_t & at(size_t node, size_t slot) const noexcept;
+
+        const numa_route_t          m_route;
+        const size_t                m_nodes;
+        const size_t                m_shards_per_node;
+        std::vector<shard_ptr_t>    m_shards;
+
+        // the local route only: the push to one node and the erase from the others are one step
+        std::unique_ptr<write_lock_t[]>     m_write_locks;
+    };
+
+
+    inline bool numa_t::available() noexcept
+    {
+#if KVSTOR_NUMA_ENABLED
+        static const bool available = numa_available() >= 0;
+        return available;
+#else
+        return false;
+#endif
+    }
+
+
+    inline size_t numa_t::nodes() noexcept
+    {
+#if KVSTOR_NUMA_ENABLED
+        if (available())
+            return static_cast<size_t>(numa_max_node()) + 1;
+#endif
+        return 1;
+    }
+
+
+    inline size_t numa_t::current_node() noexcept
+    {
+        if (scope_node() >= 0)
+            return static_cast<size_t>(scope_node());
+
+#if KVSTOR_NUMA_ENABLED
+        if (available())
+        {
+            const int cpu = sched_getcpu();
+            const int node = cpu >= 0 ? numa_node_of_cpu(cpu) : -1;
+            if (node >= 0)
+                return static_cast<size_t>(node);
+        }
+#endif
+        return 0;
+    }
+
+
+    inline bool numa_t::bind_thread(size_t node) noexcept
+    {
+#if KVSTOR_NUMA_ENABLED
+        if (available())
+            return numa_run_on_node(static_cast<int>(node)) == 0;
+#endif
+        return node == 0;
+    }
+
+
+    // memory of min_bound_size or more is page aligned
+    inline void * numa_t::allocate(size_t size, size_t alignment, std::optional<size_t> node)
+    {
+#if KVSTOR_NUMA_ENABLED
+        if (available())
+        {
+            const size_t target = (node ? *node : current_node()) % nodes();
+
+            if (numa_arena_t::fits(size, alignment))
+                return numa_arena_t::allocate(size, alignment, target);
+
+            void * ptr = numa_alloc_onnode(size, static_cast<int>(target));
+            if (ptr == nullptr)
+                throw std::bad_alloc();
+
+            return ptr;
+        }
+#endif
+        (void)node;
+
+        if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            return ::operator new(size, std::align_val_t{ alignment });
+
+        return ::operator new(size);
+    }
+
+
+    // the size selects the same allocator as allocate() did
+    inline void numa_t::deallocate(void * ptr, size_t size, size_t alignment) noexcept
+    {
+#if KVSTOR_NUMA_ENABLED
+        if (available())
+        {
+            if (numa_arena_t::fits(size, alignment))
+                numa_arena_t::deallocate(ptr, size, alignment);
+            else
+                numa_free(ptr, size);
+
+            return;
+        }
+#endif
+        if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            ::operator delete(ptr, std::align_val_t{ alignment });
+        else
+            ::operator delete(ptr);
+    }
+
+
+    inline int & numa_t::scope_node() noexcept
+    {
+        static thread_local int node = -1;
+        return node;
+    }
+
+
+    inline numa_scope_t::numa_scope_t(size_t node) noexcept
+    :   m_previous(numa_t::scope_node())
+    {
+        numa_t::scope_node() = static_cast<int>(node);
+    }
+
+
+    inline numa_scope_t::~numa_scope_t() noexcept
+    {
+        numa_t::scope_node() = m_previous;
+    }
+
+
+    inline bool numa_arena_t::fits(size_t size, size_t alignment) noexcept
+    {
+        // the size is checked first, rounding a huge size up would overflow
+        return size < numa_t::min_bound_size && block_size(size, alignment) < numa_t::min_bound_size;
+    }
+
+
+    inline void * numa_arena_t::allocate(size_t size, size_t alignment, size_t node)
+    {
+        const size_t block = block_size(size, alignment);
+        size_class_t & sizes = size_class(node, block);
+
+        const std::lock_guard guard{ sizes.lock };
+
+        if (sizes.free != nullptr)
+        {
+            free_block_t * ptr = sizes.free;
+            sizes.free = ptr->next;
+            return ptr;
+        }
+
+        if (static_cast<size_t>(sizes.end - sizes.next) < block)
+        {
+            char * chunk = allocate_chunk(node);
+
+            // the blocks follow the header at a multiple of the alignment of the block size
+            const size_t first = std::max(sizeof(chunk_header_t), block & (~block + 1));
+            sizes.next = chunk + first;
+            sizes.end = chunk + first + (chunk_size - first) / block * block;
+        }
+
+        void * ptr = sizes.next;
+        sizes.next += block;
+        return ptr;
+    }
+
+
+    inline void numa_arena_t::deallocate(void * ptr, size_t size, size_t alignment) noexcept
+    {
+        const auto * header = reinterpret_cast<const chunk_header_t *>(reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t{ chunk_size } - 1));
+        size_class_t & sizes = size_class(header->node, block_size(size, alignment));
+
+        const std::lock_guard guard{ sizes.lock };
+
+        auto * block = static_cast<free_block_t *>(ptr);
+        block->next = sizes.free;
+        sizes.free = block;
+    }
+
+
+    // a multiple of the alignment and of granularity, so a block is aligned if its chunk is
+    inline size_t numa_arena_t::block_size(size_t size, size_t alignment) noexcept
+    {
+        const size_t unit = std::max(alignment, granularity);
+        return (std::max<size_t>(size, 1) + unit - 1) / unit * unit;
+    }
+
+
+    inline numa_arena_t::size_class_t & numa_arena_t::size_class(size_t node, size_t block) noexcept
+    {
+        // never destroyed: blocks may be freed by destructors of other static objects
+        static node_arena_t * const arenas = new node_arena_t[numa_t::nodes()];
+        return arenas[node].classes[block / granularity - 1];
+    }
+
+
+    // aligned to chunk_size, so a block finds its header by masking its address
+    inline char * numa_arena_t::allocate_chunk(size_t node)
+    {
+        char * chunk = nullptr;
+
+#if KVSTOR_NUMA_ENABLED
+        // numa_free() unmaps, so the pages around the aligned chunk go back to the system
+        char * raw = static_cast<char *>(numa_alloc_onnode(2 * chunk_size, static_cast<int>(node)));
+        if (raw == nullptr)
+            throw std::bad_alloc();
+
+        chunk = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + chunk_size - 1) & ~(uintptr_t{ chunk_size } - 1));
+
+        if (chunk != raw)
+            numa_free(raw, static_cast<size_t>(chunk - raw));
+
+        numa_free(chunk + chunk_size, static_cast<size_t>(raw + 2 * chunk_size - chunk - chunk_size));
+#else
+        chunk = static_cast<char *>(::operator new(chunk_size, std::align_val_t{ chunk_size }));
+#endif
+
+        new (chunk) chunk_header_t{ node };
+        return chunk;
+    }
+
+
+    template <class item_type>
+    inline item_type * numa_alloc_t<item_type>::allocate(size_t count)
+    {
+        if (count > SIZE_MAX / sizeof(item_type))
+            throw std::bad_alloc();
+
+        const int node = numa_t::scope_node();
+        const std::optional<size_t> target = node >= 0 ? std::optional<size_t>{ static_cast<size_t>(node) } : std::nullopt;
+
+        return static_cast<item_type *>(numa_t::allocate(count * sizeof(item_type), alignof(item_type), target));
+    }
+
+
+    template <class item_type>
+    inline void numa_alloc_t<item_type>::deallocate(item_type * ptr, size_t count) noexcept
+    {
+        numa_t::deallocate(ptr, count * sizeof(item_type), alignof(item_type));
+    }
+
+
+    template <class storage_type>
+    sharded_storage_t<storage_type>::sharded_storage_t
+    (
+        size_t          max_size,
+        numa_route_t    route,
+        size_t          shards_per_node,
+        size_t          nodes
+    )
+    :   m_route(route)
+    ,   m_nodes(nodes > 0 ? nodes : numa_t::nodes())
+    ,   m_shards_per_node(shards_per_node > 0 ? shards_per_node : 1)
+    ,   m_shards()
+    ,   m_write_locks(route == numa_route_t::local ? new write_lock_t[write_locks] : nullptr)
+    {
+        const size_t count = m_nodes * m_shards_per_node;
+        const size_t shard_size = (max_size + count - 1) / count;
+
+        m_shards.reserve(count);
+
+        for (size_t node = 0; node < m_nodes; ++node)
+        {
+            // the presized buckets of the shard are bound to its node as well
+            const numa_scope_t scope{ node };
+
+            for (size_t i = 0; i < m_shards_per_node; ++i)
+            {
+                void * memory = numa_t::allocate(sizeof(shard_t), alignof(shard_t), node);
+
+                try
+                {
+                    m_shards.emplace_back(new (memory) shard_t(node, shard_size));
+                }
+                catch (...)
+                {
+                    numa_t::deallocate(memory, sizeof(shard_t), alignof(shard_t));
+                    throw;
+                }
+            }
+        }
+    }
+
+
+    template <class storage_type>
+    void sharded_storage_t<storage_type>::push(const key_t & key, value_t && value)
+    {
+        const size_t index = slot(key);
+        if (m_route == numa_route_t::hash)
+        {
+            shard_t & shard = *m_shards[index];
+            const numa_scope_t scope{ shard.node };
+            shard.stor.push(key, std::move(value));
+            return;
+        }
+
+        const size_t node = local_node();
+        shard_t & shard = at(node, index);
+
+        // otherwise two nodes writing the key could each erase the copy of the other
+        const std::lock_guard guard{ write_lock(key) };
+
+        {
+            const numa_scope_t scope{ shard.node };
+            shard.stor.push(key, std::move(value));
+        }
+
+        // a copy written earlier from another node is stale now
+        for (size_t other = 0; other < m_nodes; ++other)
+        {
+            if (other != node && at(other, index).stor.contains(key))
+                at(other, index).stor.erase(key);
+        }
+    }
+
+
+    template <class storage_type>
+    inline void sharded_storage_t<storage_type>::push(const key_t & key, const value_t & value)
+    {
+        push(key, value_t(value));
+    }
+
+
+    template <class storage_type>
+    std::optional<typename storage_type::value_t> sharded_storage_t<storage_type>::find(const key_t & key) const
+    {
+        const size_t index = slot(key);
+        if (m_route == numa_route_t::hash)
+            return m_shards[index]->stor.find(key);
+
+        const size_t node = local_node();
+        std::optional<value_t> found = at(node, index).stor.find(key);
+
+        for (size_t other = 0; !found && other < m_nodes; ++other)
+        {
+            if (other != node)
+                found = at(other, index).stor.find(key);
+        }
+
+        return found;
+    }
+
+
+    template <class storage_type>
+    bool sharded_storage_t<storage_type>::contains(const key_t & key) const
+    {
+        const size_t index = slot(key);
+        if (m_route == numa_route_t::hash)
+            return m_shards[index]->stor.contains(key);
+
+        const size_t node = local_node();
+        if (at(node, index).stor.contains(key))
+            return true;
+
+        for (size_t other = 0; other < m_nodes; ++other)
+        {
+            if (other != node && at(other, index).stor.contains(key))
+                return true;
+        }
+
+        return false;
+    }
+
+
+    template <class storage_type>
+    void sharded_storage_t<storage_type>::erase(const key_t & key)
+    {
+        const size_t index = slot(key);
+        if (m_route == numa_route_t::hash)
+        {
+            m_shards[index]->stor.erase(key);
+            return;
+        }
+
+        const std::lock_guard guard{ write_lock(key) };
+
+        for (size_t node = 0; node < m_nodes; ++node)
+            at(node, index).stor.erase(key);
+    }
+
+
+    template <class storage_type>
+    size_t sharded_storage_t<storage_type>::size() const noexcept
+    {
+        size_t size = 0;
+        for (const shard_ptr_t & shard : m_shards)
+            size += shard->stor.size();
+
+        return size;
+    }
+
+
+    template <class storage_type>
+    size_t sharded_storage_t<storage_type>::max_size() const noexcept
+    {
+        size_t max_size = 0;
+        for (const shard_ptr_t & shard : m_shards)
+            max_size += shard->stor.max_size();
+
+        return max_size;
+    }
+
+
+    template <class storage_type>
+    inline size_t sharded_storage_t<storage_type>::nodes() const noexcept
+    {
+        return m_nodes;
+    }
+
+
+    template <class storage_type>
+    inline size_t sharded_storage_t<storage_type>::shards() const noexcept
+    {
+        return m_shards.size();
+    }
+
+
+    template <class storage_type>
+    inline storage_type & sharded_storage_t<storage_type>::shard(size_t index) noexcept
+    {
+        return m_shards[index]->stor;
+    }
+
+
+    template <class storage_type>
+    inline size_t sharded_storage_t<storage_type>::node_of(size_t index) const noexcept
+    {
+        return m_shards[index]->node;
+    }
+
+
+    template <class storage_type>
+    inline size_t sharded_storage_t<storage_type>::local_node() const noexcept
+    {
+        return numa_t::current_node() % m_nodes;
+    }
+
+
+    template <class storage_type>
+    inline std::mutex & sharded_storage_t<storage_type>::write_lock(const key_t & key) const
+    {
+        return m_write_locks[hash_t{}(key) % write_locks].lock;
+    }
+
+
+    // with the hash route all shards form one slot range, with the local route every node has its own;
+    // the hash is mixed so that the keys of a shard do not share the low bits of their index buckets
+    template <class storage_type>
+    inline size_t sharded_storage_t<storage_type>::slot(const key_t & key) const
+    {
+        const uint64_t mixed = fast_hash_t::hash_int(static_cast<uint64_t>(hash_t{}(key)));
+        return static_cast<size_t>(mixed % (m_route == numa_route_t::hash ? m_shards.size() : m_shards_per_node));
+    }
+
+
+    template <class storage_type>
+    inline typename sharded_storage_t<storage_type>::shard_t & sharded_storage_t<storage_type>::at
+    (
+        size_t      node,
+        size_t      slot
+    ) const noexcept
+    {
+        return *m_shards[node * m_shards_per_node + slot];
+    }
+
+
+    template <class storage_type>
+    inline void sharded_storage_t<storage_type>::shard_deleter_t::operator()(shard_t * shard) const noexcept
+    {
+        shard->~shard_t();
+        numa_t::deallocate(shard, sizeof(shard_t), alignof(shard_t));
+    }
+
+}   // namespace kvstor
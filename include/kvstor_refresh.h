@@ -0,0 +1,296 @@
+﻿// kvstor_refresh.h : refresh-ahead wrapper for kvstor::storage_t<>
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+
+namespace kvstor
+{
+
+    class thread_pool_t final
+    {
+    public:
+        using task_t = std::function<void ()>;
+
+        // throws std::invalid_argument if threads is zero
+        thread_pool_t(size_t threads, size_t max_queue);
+        thread_pool_t(const thread_pool_t &) = delete;
+        thread_pool_t(thread_pool_t &&) = delete;
+        ~thread_pool_t() noexcept;
+
+        thread_pool_t operator=(const thread_pool_t &) = delete;
+        thread_pool_t operator=(thread_pool_t &&) = delete;
+
+        // returns false if the queue is full or the pool is stopping
+        bool try_post(task_t task);
+        void wait_idle();
+
+    private:
+        void run();
+
+        std::vector<std::thread>    m_threads;
+        std::deque<task_t>          m_queue;
+        std::mutex                  m_lock;
+        std::condition_variable     m_has_task;
+        std::condition_variable     m_idle;
+        size_t                      m_busy;
+        bool                        m_stop;
+        const size_t                m_max_queue;
+    };
+
+
+    // a hit older than the threshold returns the current value and reloads it in the background;
+    // the reloaded value replaces the entry only if it still holds the value that was hit,
+    // so a key erased or overwritten meanwhile keeps its new state (value_t needs operator==)
+    template <class storage_type>
+    class refresh_ahead_t final
+    {
+    public:
+        using key_t = typename storage_type::key_t;
+        using value_t = typename storage_type::value_t;
+        using hash_t = typename storage_type::hash_t;
+        using kequal_t = typename storage_type::kequal_t;
+        using duration_t = typename storage_type::duration_t;
+        using loader_t = std::function<std::optional<value_t> (const key_t & key)>;
+
+        refresh_ahead_t
+        (
+            storage_type  & stor,
+            loader_t        loader,
+            duration_t      threshold,
+            size_t          threads = 1,
+            size_t          max_queue = 1024
+        );
+        refresh_ahead_t(const refresh_ahead_t &) = delete;
+        refresh_ahead_t(refresh_ahead_t &&) = delete;
+        ~refresh_ahead_t() noexcept = default;
+
+        refresh_ahead_t operator=(const refresh_ahead_t &) = delete;
+        refresh_ahead_t operator=(refresh_ahead_t &&) = delete;
+
+        std::optional<value_t> find(const key_t & key);
+        void wait_idle();
+
+        size_t pending() const;
+
+    private:
+        void schedule(const key_t & key, const value_t & current);
+        void reload(const key_t & key, std::optional<value_t> & current) noexcept;
+
+        storage_type      & m_stor;
+        const loader_t      m_loader;
+        const duration_t    m_threshold;
+
+        mutable std::mutex                              m_lock;
+        std::unordered_set<key_t, hash_t, kequal_t>     m_pending;
+
+        // must be the last member: workers are joined before the other members are destroyed
+        thread_pool_t       m_pool;
+    };
+
+
+    inline thread_pool_t::thread_pool_t(size_t threads, size_t max_queue)
+    :   m_threads()
+    ,   m_queue()
+    ,   m_lock()
+    ,   m_has_task()
+    ,   m_idle()
+    ,   m_busy(0)
+    ,   m_stop(false)
+    ,   m_max_queue(max_queue)
+    {
+        // without workers the posted tasks would never run
+        if (threads == 0)
+            throw std::invalid_argument("kvstor: thread_pool_t needs at least one thread");
+
+        m_threads.reserve(threads);
+        for (size_t i = 0; i < threads; ++i)
+            m_threads.emplace_back(&thread_pool_t::run, this);
+    }
+
+
+    inline thread_pool_t::~thread_pool_t() noexcept
+    {
+        {
+            const std::lock_guard guard{ m_lock };
+            m_stop = true;
+        }
+
+        m_has_task.notify_all();
+
+        for (std::thread & thread : m_threads)
+            thread.join();
+    }
+
+
+    inline bool thread_pool_t::try_post(task_t task)
+    {
+        {
+            const std::lock_guard guard{ m_lock };
+
+            if (m_stop || m_queue.size() >= m_max_queue)
+                return false;
+
+            m_queue.push_back(std::move(task));
+        }
+
+        m_has_task.notify_one();
+        return true;
+    }
+
+
+    inline void thread_pool_t::wait_idle()
+    {
+        std::unique_lock guard{ m_lock };
+        m_idle.wait(guard, [this] { return m_queue.empty() && m_busy == 0; });
+    }
+
+
+    inline void thread_pool_t::run()
+    {
+        std::unique_lock guard{ m_lock };
+
+        while (true)
+        {
+            m_has_task.wait(guard, [this] { return m_stop || !m_queue.empty(); });
+
+            // pending tasks are discarded on stop
+            if (m_stop)
+                break;
+
+            task_t task = std::move(m_queue.front());
+            m_queue.pop_front();
+            ++m_busy;
+
+            guard.unlock();
+            task();
+            guard.lock();
+
+            --m_busy;
+            if (m_queue.empty() && m_busy == 0)
+                m_idle.notify_all();
+        }
+
+        m_queue.clear();
+        m_idle.notify_all();
+    }
+
+
+    template <class storage_type>
+    inline refresh_ahead_t<storage_type>::refresh_ahead_t
+    (
+        storage_type  & stor,
+        loader_t        loader,
+        duration_t      threshold,
+        size_t          threads,
+        size_t          max_queue
+    )
+    :   m_stor(stor)
+    ,   m_loader(std::move(loader))
+    ,   m_threshold(threshold)
+    ,   m_lock()
+    ,   m_pending()
+    ,   m_pool(threads, max_queue)
+    {
+    }
+
+
+    template <class storage_type>
+    std::optional<typename storage_type::value_t> refresh_ahead_t<storage_type>::find(const key_t & key)
+    {
+        duration_t age{};
+        std::optional<value_t> found = m_stor.find(key, age);
+
+        if (found && age >= m_threshold)
+            schedule(key, *found);
+
+        return found;
+    }
+
+
+    template <class storage_type>
+    inline void refresh_ahead_t<storage_type>::wait_idle()
+    {
+        m_pool.wait_idle();
+    }
+
+
+    template <class storage_type>
+    inline size_t refresh_ahead_t<storage_type>::pending() const
+    {
+        const std::lock_guard guard{ m_lock };
+        return m_pending.size();
+    }
+
+
+    template <class storage_type>
+    void refresh_ahead_t<storage_type>::schedule(const key_t & key, const value_t & current)
+    {
+        {
+            const std::lock_guard guard{ m_lock };
+            if (!m_pending.insert(key).second)
+                return;
+        }
+
+        bool posted = false;
+
+        try
+        {
+            posted = m_pool.try_post([this, key, current = std::optional<value_t>{ current }]() mutable { reload(key, current); });
+        }
+        catch (...)
+        {
+            // e.g. std::bad_alloc from the task or the queue, a pending key would never be refreshed again
+            const std::lock_guard guard{ m_lock };
+            m_pending.erase(key);
+            throw;
+        }
+
+        if (!posted)
+        {
+            // the queue is full: the key is refreshed by one of the next hits
+            const std::lock_guard guard{ m_lock };
+            m_pending.erase(key);
+        }
+    }
+
+
+    template <class storage_type>
+    void refresh_ahead_t<storage_type>::reload(const key_t & key, std::optional<value_t> & current) noexcept
+    {
+        try
+        {
+            // not stored if the key was erased, evicted or overwritten since the hit
+            std::optional<value_t> value = m_loader(key);
+            if (value)
+                m_stor.compare_exchange(key, std::move(*value), current);
+        }
+        catch (...)
+        {
+            // a failed reload keeps the current value
+        }
+
+        try
+        {
+            const std::lock_guard guard{ m_lock };
+            m_pending.erase(key);
+        }
+        catch (...)
+        {
+            // ignore unexpected exception in release
+            assert(false);
+        }
+    }
+
+}   // namespace kvstor
@@ -0,0 +1,723 @@
+﻿// kvstor_spill.h : local disk spill tier for kvstor::storage_t<>
+
+#pragma once
+
+#include "kvstor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+
+namespace kvstor
+{
+
+    // converts keys and values to bytes of spill records,
+    // specialize it for types that are neither trivially copyable nor std::string
+    template <class item_type, class enable_type = void>
+    struct serializer_t;
+
+
+    template <class item_type>
+    struct serializer_t<item_type, std::enable_if_t<std::is_trivially_copyable_v<item_type>>>
+    {
+        static void write(std::string & out, const item_type & item)
+        {
+            out.append(reinterpret_cast<const char *>(&item), sizeof(item));
+        }
+
+        static item_type read(const char * data, size_t size)
+        {
+            if (size != sizeof(item_type))
+                throw std::runtime_error("kvstor: invalid size of a spill record field");
+
+            item_type item;
+            std::memcpy(&item, data, sizeof(item));
+            return item;
+        }
+    };
+
+
+    template <>
+    struct serializer_t<std::string>
+    {
+        static void write(std::string & out, const std::string & item)
+        {
+            out.append(item);
+        }
+
+        static std::string read(const char * data, size_t size)
+        {
+            return std::string(data, size);
+        }
+    };
+
+
+    // Append-only log of records with an in-memory index: key -> record offset and size.
+    // The keys are kept in memory, so put() and erase() never read the file.
+    // Replaced, taken and erased records stay in the file as dead bytes until compact().
+    // The file is truncated on open and removed on destruction.
+    template
+    <
+        class key_type,
+        class value_type,
+        class hash_type = std::hash<key_type>,
+        class kequal_type = std::equal_to<key_type>
+    >
+    class disk_tier_t final
+    {
+    public:
+        explicit disk_tier_t(std::string path, double compact_ratio = 0.5);
+        disk_tier_t(const disk_tier_t &) = delete;
+        disk_tier_t(disk_tier_t &&) = delete;
+        ~disk_tier_t() noexcept;
+
+        disk_tier_t operator=(const disk_tier_t &) = delete;
+        disk_tier_t operator=(disk_tier_t &&) = delete;
+
+        // throws std::length_error if the key or the value is 4 GiB or more
+        void put(const key_type & key, const value_type & value);
+        std::optional<value_type> find(const key_type & key) const;
+        std::optional<value_type> take(const key_type & key);
+        bool erase(const key_type & key);
+        void clear();
+
+        // compacts the file once dead bytes reach compact_ratio of its size
+        bool compact_if_needed();
+
+        // copies the live records without the lock, puts and finds wait only while the records written
+        // meanwhile are appended and the files are swapped; a clear() during the copy cancels it
+        void compact();
+
+        size_t size() const;
+        uint64_t file_size() const;
+        uint64_t dead_bytes() const;
+
+    private:
+        struct header_t
+        {
+            uint32_t key_size;
+            uint32_t value_size;
+        };
+
+        struct record_t
+        {
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        using index_t = std::unordered_map<key_type, record_t, hash_type, kequal_type>;
+
+        static void read_record(std::fstream & file, uint64_t offset, std::string & record);
+        static void write_record(std::fstream & file, const std::string & record, const std::string & path);
+        static std::string encode(const key_type & key, const value_type & value);
+        static value_type decode_value(const std::string & record);
+        static void open(std::fstream & file, const std::string & path, std::ios::openmode mode);
+
+        const std::string       m_path;
+        const double            m_compact_ratio;
+
+        // one compaction at a time, taken before m_lock
+        std::mutex              m_compact_lock;
+
+        mutable std::mutex      m_lock;
+        mutable std::fstream    m_file;
+        index_t                 m_index;
+        uint64_t                m_end;
+        uint64_t                m_dead;
+
+        // changed by clear(), a compaction of the cleared file is discarded
+        uint64_t                m_generation;
+    };
+
+
+    // In-memory storage_t with evicted entries spilled to a disk_tier_t.
+    // find() misses consult the disk tier and promote found entries back to memory.
+    // An entry being spilled by a concurrent push() may be briefly missing from both tiers.
+    // erase() and clear() wait for the pushes and promotions in flight, so an erased entry is never
+    // spilled or promoted back; pushes made through memory() bypass this.
+    template <class storage_type>
+    class tiered_storage_t final
+    {
+    public:
+        using key_t = typename storage_type::key_t;
+        using value_t = typename storage_type::value_t;
+        using disk_t = disk_tier_t<key_t, value_t, typename storage_type::hash_t, typename storage_type::kequal_t>;
+
+        tiered_storage_t
+        (
+            size_t                      max_size,
+            std::string                 path,
+            std::chrono::milliseconds   compact_period = std::chrono::seconds(1),
+            double                      compact_ratio = 0.5
+        );
+        tiered_storage_t(const tiered_storage_t &) = delete;
+        tiered_storage_t(tiered_storage_t &&) = delete;
+        ~tiered_storage_t() noexcept;
+
+        tiered_storage_t operator=(const tiered_storage_t &) = delete;
+        tiered_storage_t operator=(tiered_storage_t &&) = delete;
+
+        void push(const key_t & key, value_t && value);
+        void push(const key_t & key, const value_t & value);
+
+        std::optional<value_t> find(const key_t & key);
+
+        void erase(const key_t & key);
+        void clear();
+
+        storage_type & memory() noexcept;
+        disk_t & disk() noexcept;
+
+        // number of evicted entries lost because of disk errors
+        size_t spill_errors() const noexcept;
+
+    private:
+        void spill(key_t && key, value_t && value) noexcept;
+        void run_compactor() noexcept;
+
+        disk_t                      m_disk;
+        storage_type                m_memory;
+        std::atomic<size_t>         m_spill_errors;
+
+        // shared by push() with its spills and by promotions, exclusive for erase() and clear()
+        std::shared_mutex           m_erase_lock;
+
+        std::mutex                  m_compactor_lock;
+        std::condition_variable     m_wakeup;
+        bool                        m_stop;
+        const std::chrono::milliseconds m_compact_period;
+
+        // must be the last member: stopped before the tiers are destroyed
+        std::thread                 m_compactor;
+    };
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    disk_tier_t<key_type, value_type, hash_type, kequal_type>::disk_tier_t(std::string path, double compact_ratio)
+    :   m_path(std::move(path))
+    ,   m_compact_ratio(compact_ratio)
+    ,   m_compact_lock()
+    ,   m_lock()
+    ,   m_file()
+    ,   m_index()
+    ,   m_end(0)
+    ,   m_dead(0)
+    ,   m_generation(0)
+    {
+        open(m_file, m_path, std::ios::trunc);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    disk_tier_t<key_type, value_type, hash_type, kequal_type>::~disk_tier_t() noexcept
+    {
+        m_file.close();
+
+        std::error_code error;
+        std::filesystem::remove(m_path, error);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    void disk_tier_t<key_type, value_type, hash_type, kequal_type>::put(const key_type & key, const value_type & value)
+    {
+        const std::string data = encode(key, value);
+
+        const std::lock_guard guard{ m_lock };
+
+        // a failed operation does not fail the following ones, a partly written record is overwritten
+        m_file.clear();
+        m_file.seekp(static_cast<std::streamoff>(m_end));
+        write_record(m_file, data, m_path);
+
+        const record_t written{ m_end, data.size() };
+
+        auto [found, inserted] = m_index.try_emplace(key, written);
+        if (!inserted)
+        {
+            m_dead += found->second.size;
+            found->second = written;
+        }
+
+        m_end += data.size();
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    std::optional<value_type> disk_tier_t<key_type, value_type, hash_type, kequal_type>::find(const key_type & key) const
+    {
+        std::string record;
+
+        const std::lock_guard guard{ m_lock };
+
+        auto found = m_index.find(key);
+        if (found == m_index.end())
+            return std::optional<value_type>{};
+
+        read_record(m_file, found->second.offset, record);
+        return std::optional<value_type>{ decode_value(record) };
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    std::optional<value_type> disk_tier_t<key_type, value_type, hash_type, kequal_type>::take(const key_type & key)
+    {
+        std::string record;
+
+        const std::lock_guard guard{ m_lock };
+
+        auto found = m_index.find(key);
+        if (found == m_index.end())
+            return std::optional<value_type>{};
+
+        read_record(m_file, found->second.offset, record);
+
+        std::optional<value_type> value{ decode_value(record) };
+        m_dead += found->second.size;
+        m_index.erase(found);
+
+        return value;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    bool disk_tier_t<key_type, value_type, hash_type, kequal_type>::erase(const key_type & key)
+    {
+        const std::lock_guard guard{ m_lock };
+
+        auto found = m_index.find(key);
+        if (found == m_index.end())
+            return false;
+
+        m_dead += found->second.size;
+        m_index.erase(found);
+
+        return true;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    void disk_tier_t<key_type, value_type, hash_type, kequal_type>::clear()
+    {
+        const std::lock_guard guard{ m_lock };
+
+        m_file.close();
+        open(m_file, m_path, std::ios::trunc);
+
+        m_index.clear();
+        m_end = 0;
+        m_dead = 0;
+        ++m_generation;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    bool disk_tier_t<key_type, value_type, hash_type, kequal_type>::compact_if_needed()
+    {
+        {
+            const std::lock_guard guard{ m_lock };
+
+            if (m_dead == 0 || static_cast<double>(m_dead) < m_compact_ratio * static_cast<double>(m_end))
+                return false;
+        }
+
+        compact();
+        return true;
+    }
+
+
+    // the records live at the start are copied to a new file without the lock, they stay where they are
+    // because the file is append-only; the records written meanwhile are appended under the lock before the swap
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    void disk_tier_t<key_type, value_type, hash_type, kequal_type>::compact()
+    {
+        const std::string compact_path = m_path + ".compact";
+        const std::lock_guard compact_guard{ m_compact_lock };
+
+        std::vector<record_t> live;
+        std::fstream source;
+        uint64_t copied_end = 0;
+        uint64_t generation = 0;
+
+        {
+            const std::lock_guard guard{ m_lock };
+
+            live.reserve(m_index.size());
+            for (const auto & item : m_index)
+                live.push_back(item.second);
+
+            // the copy reads the file through its own stream
+            m_file.flush();
+            if (!m_file)
+                throw std::runtime_error("kvstor: cannot write spill file " + m_path);
+
+            open(source, m_path, std::ios::openmode{});
+            copied_end = m_end;
+            generation = m_generation;
+        }
+
+        // in the order of the file, the new offsets follow the same order
+        std::sort(live.begin(), live.end(), [](const record_t & a, const record_t & b) { return a.offset < b.offset; });
+
+        std::fstream compacted;
+        open(compacted, compact_path, std::ios::trunc);
+
+        std::vector<uint64_t> offsets;
+        offsets.reserve(live.size());
+
+        uint64_t end = 0;
+        std::string record;
+
+        try
+        {
+            for (const record_t & item : live)
+            {
+                read_record(source, item.offset, record);
+                write_record(compacted, record, compact_path);
+
+                offsets.push_back(end);
+                end += record.size();
+            }
+        }
+        catch (...)
+        {
+            // the file was truncated by clear()
+            const std::lock_guard guard{ m_lock };
+            if (m_generation != generation)
+                return;
+
+            throw;
+        }
+
+        source.close();
+
+        const std::lock_guard guard{ m_lock };
+
+        if (m_generation != generation)
+            return;
+
+        index_t index{ m_index.bucket_count(), m_index.hash_function(), m_index.key_eq() };
+
+        for (const auto & [key, item] : m_index)
+        {
+            if (item.offset < copied_end)
+            {
+                // still live, so it was live at the start
+                const auto copied = std::lower_bound(live.begin(), live.end(), item.offset,
+                    [](const record_t & a, uint64_t offset) { return a.offset < offset; });
+
+                index.emplace(key, record_t{ offsets[static_cast<size_t>(copied - live.begin())], item.size });
+                continue;
+            }
+
+            read_record(m_file, item.offset, record);
+            write_record(compacted, record, compact_path);
+
+            index.emplace(key, record_t{ end, item.size });
+            end += record.size();
+        }
+
+        compacted.close();
+        m_file.close();
+
+        try
+        {
+            std::filesystem::rename(compact_path, m_path);
+        }
+        catch (...)
+        {
+            // the tier goes on with the uncompacted file
+            open(m_file, m_path, std::ios::openmode{});
+            throw;
+        }
+
+        open(m_file, m_path, std::ios::openmode{});
+
+        m_index.swap(index);
+        m_end = end;
+        m_dead = 0;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    inline size_t disk_tier_t<key_type, value_type, hash_type, kequal_type>::size() const
+    {
+        const std::lock_guard guard{ m_lock };
+        return m_index.size();
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    inline uint64_t disk_tier_t<key_type, value_type, hash_type, kequal_type>::file_size() const
+    {
+        const std::lock_guard guard{ m_lock };
+        return m_end;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    inline uint64_t disk_tier_t<key_type, value_type, hash_type, kequal_type>::dead_bytes() const
+    {
+        const std::lock_guard guard{ m_lock };
+        return m_dead;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    void disk_tier_t<key_type, value_type, hash_type, kequal_type>::read_record
+    (
+        std::fstream  & file,
+        uint64_t        offset,
+        std::string   & record
+    )
+    {
+        header_t header{};
+
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset));
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+
+        record.resize(sizeof(header) + header.key_size + header.value_size);
+        std::memcpy(record.data(), &header, sizeof(header));
+        file.read(record.data() + sizeof(header), static_cast<std::streamsize>(record.size() - sizeof(header)));
+
+        if (!file)
+            throw std::runtime_error("kvstor: cannot read spill file");
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    void disk_tier_t<key_type, value_type, hash_type, kequal_type>::write_record
+    (
+        std::fstream          & file,
+        const std::string     & record,
+        const std::string     & path
+    )
+    {
+        file.write(record.data(), static_cast<std::streamsize>(record.size()));
+        if (!file)
+            throw std::runtime_error("kvstor: cannot write spill file " + path);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    std::string disk_tier_t<key_type, value_type, hash_type, kequal_type>::encode(const key_type & key, const value_type & value)
+    {
+        std::string record(sizeof(header_t), '\0');
+
+        serializer_t<key_type>::write(record, key);
+        const size_t key_size = record.size() - sizeof(header_t);
+
+        serializer_t<value_type>::write(record, value);
+        const size_t value_size = record.size() - sizeof(header_t) - key_size;
+
+        // the header would silently truncate the sizes and corrupt the following records
+        if (key_size > UINT32_MAX || value_size > UINT32_MAX)
+            throw std::length_error("kvstor: a spill record field is 4 GiB or more");
+
+        const header_t header{ static_cast<uint32_t>(key_size), static_cast<uint32_t>(value_size) };
+        std::memcpy(record.data(), &header, sizeof(header));
+
+        return record;
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    value_type disk_tier_t<key_type, value_type, hash_type, kequal_type>::decode_value(const std::string & record)
+    {
+        header_t header{};
+        std::memcpy(&header, record.data(), sizeof(header));
+
+        return serializer_t<value_type>::read(record.data() + sizeof(header) + header.key_size, header.value_size);
+    }
+
+
+    template <class key_type, class value_type, class hash_type, class kequal_type>
+    void disk_tier_t<key_type, value_type, hash_type, kequal_type>::open
+    (
+        std::fstream          & file,
+        const std::string     & path,
+        std::ios::openmode      mode
+    )
+    {
+        file.open(path, std::ios::in | std::ios::out | std::ios::binary | mode);
+        if (!file.is_open())
+            throw std::runtime_error("kvstor: cannot open spill file " + path);
+    }
+
+
+    template <class storage_type>
+    tiered_storage_t<storage_type>::tiered_storage_t
+    (
+        size_t                      max_size,
+        std::string                 path,
+        std::chrono::milliseconds   compact_period,
+        double                      compact_ratio
+    )
+    :   m_disk(std::move(path), compact_ratio)
+    ,   m_memory(max_size)
+    ,   m_spill_errors(0)
+    ,   m_erase_lock()
+    ,   m_compactor_lock()
+    ,   m_wakeup()
+    ,   m_stop(false)
+    ,   m_compact_period(compact_period)
+    ,   m_compactor()
+    {
+        m_memory.on_evict([this](key_t && key, value_t && value) { spill(std::move(key), std::move(value)); });
+
+        // a new value turned down by the admission filter of the memory tier still replaces the spilled one
+        m_memory.on_reject([this](key_t && key, value_t && value) { spill(std::move(key), std::move(value)); });
+
+        if (m_compact_period.count() > 0)
+            m_compactor = std::thread(&tiered_storage_t::run_compactor, this);
+    }
+
+
+    template <class storage_type>
+    tiered_storage_t<storage_type>::~tiered_storage_t() noexcept
+    {
+        {
+            const std::lock_guard guard{ m_compactor_lock };
+            m_stop = true;
+        }
+
+        m_wakeup.notify_all();
+
+        if (m_compactor.joinable())
+            m_compactor.join();
+    }
+
+
+    template <class storage_type>
+    inline void tiered_storage_t<storage_type>::push(const key_t & key, value_t && value)
+    {
+        const std::shared_lock guard{ m_erase_lock };
+        m_memory.push(key, std::move(value));
+    }
+
+
+    template <class storage_type>
+    inline void tiered_storage_t<storage_type>::push(const key_t & key, const value_t & value)
+    {
+        const std::shared_lock guard{ m_erase_lock };
+        m_memory.push(key, value);
+    }
+
+
+    template <class storage_type>
+    std::optional<typename storage_type::value_t> tiered_storage_t<storage_type>::find(const key_t & key)
+    {
+        std::optional<value_t> found = m_memory.find(key);
+        if (found)
+            return found;
+
+        // the entry is not erased between taking it from the disk and putting it back to memory
+        const std::shared_lock guard{ m_erase_lock };
+
+        std::optional<value_t> spilled = m_disk.take(key);
+        if (!spilled)
+            return spilled;
+
+        // a value pushed to memory in the meantime is newer than the spilled one
+        std::optional<value_t> expected;
+        if (m_memory.compare_exchange(key, *spilled, expected))
+            return spilled;
+
+        return expected;
+    }
+
+
+    template <class storage_type>
+    inline void tiered_storage_t<storage_type>::erase(const key_t & key)
+    {
+        const std::unique_lock guard{ m_erase_lock };
+
+        m_memory.erase(key);
+        m_disk.erase(key);
+    }
+
+
+    template <class storage_type>
+    inline void tiered_storage_t<storage_type>::clear()
+    {
+        const std::unique_lock guard{ m_erase_lock };
+
+        m_memory.clear();
+        m_disk.clear();
+    }
+
+
+    template <class storage_type>
+    inline storage_type & tiered_storage_t<storage_type>::memory() noexcept
+    {
+        return m_memory;
+    }
+
+
+    template <class storage_type>
+    inline typename tiered_storage_t<storage_type>::disk_t & tiered_storage_t<storage_type>::disk() noexcept
+    {
+        return m_disk;
+    }
+
+
+    template <class storage_type>
+    inline size_t tiered_storage_t<storage_type>::spill_errors() const noexcept
+    {
+        return m_spill_errors.load(std::memory_order_relaxed);
+    }
+
+
+    template <class storage_type>
+    void tiered_storage_t<storage_type>::spill(key_t && key, value_t && value) noexcept
+    {
+        try
+        {
+            m_disk.put(key, value);
+        }
+        catch (...)
+        {
+            m_spill_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+
+    template <class storage_type>
+    void tiered_storage_t<storage_type>::run_compactor() noexcept
+    {
+        std::unique_lock guard{ m_compactor_lock };
+
+        while (!m_wakeup.wait_for(guard, m_compact_period, [this] { return m_stop; }))
+        {
+            guard.unlock();
+
+            try
+            {
+                m_disk.compact_if_needed();
+            }
+            catch (...)
+            {
+                // the next period retries
+            }
+
+            guard.lock();
+        }
+    }
+
+}   // namespace kvstor
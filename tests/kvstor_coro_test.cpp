@@ -0,0 +1,348 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "doctest.h"
+
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+
+#include "kvstor_coro.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    // fire-and-forget coroutine
+    struct detached_t
+    {
+        struct promise_type
+        {
+            detached_t get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+
+    // runs posted tasks only when asked, to observe suspended awaiters
+    struct manual_executor_t
+    {
+        std::deque<std::function<void ()>> tasks;
+
+        size_t run()
+        {
+            size_t count = 0;
+            while (!tasks.empty())
+            {
+                auto task = std::move(tasks.front());
+                tasks.pop_front();
+                task();
+                ++count;
+            }
+
+            return count;
+        }
+    };
+
+
+    using stor_t = kvstor::storage_t<int, std::string>;
+    using async_stor_t = kvstor::async_storage_t<stor_t>;
+
+
+    template <class loader_type>
+    detached_t get(async_stor_t & stor, int key, loader_type loader, std::optional<std::string> & result, bool & done)
+    {
+        result = co_await stor.async_get_or_load(key, loader);
+        done = true;
+    }
+
+
+    template <class loader_type>
+    detached_t get_or_error(async_stor_t & stor, int key, loader_type loader, std::string & error, bool & done)
+    {
+        try
+        {
+            co_await stor.async_get_or_load(key, loader);
+        }
+        catch (const std::exception & e)
+        {
+            error = e.what();
+        }
+
+        done = true;
+    }
+
+}   // namespace
+
+
+TEST_CASE("kvstor::async_storage_t hit and inline load")
+{
+    stor_t stor{ 10 };
+    async_stor_t async_stor{ stor };
+
+    size_t loads = 0;
+    const async_stor_t::loader_t loader = [&loads](const int & key) -> std::optional<std::string>
+    {
+        ++loads;
+        return std::to_string(key);
+    };
+
+    stor.push(1, "stored");
+
+    std::optional<std::string> result;
+    bool done = false;
+
+    get(async_stor, 1, loader, result, done);
+    REQUIRE(done);
+    REQUIRE(result.value() == "stored");
+    REQUIRE(loads == 0);
+
+    // the inline executor loads in the awaiting thread and resumes it there
+    done = false;
+    get(async_stor, 2, loader, result, done);
+    REQUIRE(done);
+    REQUIRE(result.value() == "2");
+    REQUIRE(loads == 1);
+    REQUIRE(stor.find(2).value() == "2");
+    REQUIRE(async_stor.in_flight() == 0);
+
+    // nothing to load
+    const async_stor_t::loader_t empty = [](const int &) -> std::optional<std::string> { return std::nullopt; };
+
+    done = false;
+    get(async_stor, 3, empty, result, done);
+    REQUIRE(done);
+    REQUIRE(!result);
+    REQUIRE(!stor.contains(3));
+}
+
+
+TEST_CASE("kvstor::async_storage_t awaiters share one load")
+{
+    stor_t stor{ 10 };
+    manual_executor_t executor;
+    async_stor_t async_stor{ stor, [&executor](async_stor_t::task_t task) { executor.tasks.push_back(std::move(task)); } };
+
+    size_t loads = 0;
+    const async_stor_t::loader_t loader = [&loads](const int & key) -> std::optional<std::string>
+    {
+        ++loads;
+        return "value " + std::to_string(key);
+    };
+
+    std::optional<std::string> results[3];
+    bool done[3] = {};
+
+    for (size_t i = 0; i < 3; ++i)
+        get(async_stor, 7, loader, results[i], done[i]);
+
+    // every awaiter is suspended on the same load
+    REQUIRE(!done[0]);
+    REQUIRE(!done[1]);
+    REQUIRE(!done[2]);
+    REQUIRE(async_stor.in_flight() == 1);
+    REQUIRE(executor.tasks.size() == 1);
+
+    // one load task, then one resumption per awaiter
+    REQUIRE(executor.run() == 4);
+    REQUIRE(loads == 1);
+    REQUIRE(async_stor.in_flight() == 0);
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        REQUIRE(done[i]);
+        REQUIRE(results[i].value() == "value 7");
+    }
+
+    // the loaded value is a hit
+    bool hit_done = false;
+    std::optional<std::string> hit;
+    get(async_stor, 7, loader, hit, hit_done);
+    REQUIRE(hit_done);
+    REQUIRE(executor.tasks.empty());
+    REQUIRE(loads == 1);
+}
+
+
+TEST_CASE("kvstor::async_storage_t load errors")
+{
+    stor_t stor{ 10 };
+    manual_executor_t executor;
+    async_stor_t async_stor{ stor, [&executor](async_stor_t::task_t task) { executor.tasks.push_back(std::move(task)); } };
+
+    size_t loads = 0;
+    const async_stor_t::loader_t failing = [&loads](const int &) -> std::optional<std::string>
+    {
+        ++loads;
+        throw std::runtime_error("backend is down");
+    };
+
+    std::string errors[2];
+    bool done[2] = {};
+
+    get_or_error(async_stor, 1, failing, errors[0], done[0]);
+    get_or_error(async_stor, 1, failing, errors[1], done[1]);
+    executor.run();
+
+    REQUIRE(loads == 1);
+    REQUIRE(done[0]);
+    REQUIRE(done[1]);
+    REQUIRE(errors[0] == "backend is down");
+    REQUIRE(errors[1] == "backend is down");
+    REQUIRE(!stor.contains(1));
+    REQUIRE(async_stor.in_flight() == 0);
+
+    // a failed load is not cached
+    std::optional<std::string> result;
+    bool loaded = false;
+    get(async_stor, 1, async_stor_t::loader_t{ [](const int &) { return std::optional<std::string>{ "ok" }; } }, result, loaded);
+    executor.run();
+
+    REQUIRE(loaded);
+    REQUIRE(result.value() == "ok");
+}
+
+
+TEST_CASE("kvstor::async_storage_t failed store")
+{
+    stor_t stor{ 1 };
+    async_stor_t async_stor{ stor };
+
+    stor.push(1, "one");
+    stor.on_evict([](int &&, std::string &&) { throw std::runtime_error("evict handler failed"); });
+
+    std::vector<async_stor_t::completion_t> pending;
+    const async_stor_t::async_loader_t loader = [&pending](const int &, async_stor_t::completion_t completion)
+    {
+        pending.push_back(std::move(completion));
+    };
+
+    std::string errors[2];
+    bool done[2] = {};
+
+    get_or_error(async_stor, 2, loader, errors[0], done[0]);
+    get_or_error(async_stor, 2, loader, errors[1], done[1]);
+    REQUIRE(pending.size() == 1);
+
+    // the push evicts key 1 and the handler throws: the flight is closed with the error
+    pending.front().set_value("two");
+
+    REQUIRE(done[0]);
+    REQUIRE(done[1]);
+    REQUIRE(errors[0] == "evict handler failed");
+    REQUIRE(errors[1] == "evict handler failed");
+    REQUIRE(async_stor.in_flight() == 0);
+
+    // a second completion is ignored
+    pending.front().set_exception(std::make_exception_ptr(std::runtime_error("late")));
+    REQUIRE(async_stor.in_flight() == 0);
+
+    // the blocking loader reports the same error once
+    const async_stor_t::loader_t blocking = [](const int &) -> std::optional<std::string> { return "three"; };
+
+    std::string error;
+    bool loaded = false;
+    get_or_error(async_stor, 3, blocking, error, loaded);
+
+    REQUIRE(loaded);
+    REQUIRE(error == "evict handler failed");
+    REQUIRE(async_stor.in_flight() == 0);
+}
+
+
+TEST_CASE("kvstor::async_storage_t non-blocking loader")
+{
+    stor_t stor{ 10 };
+    async_stor_t async_stor{ stor };
+
+    std::vector<async_stor_t::completion_t> pending;
+    const async_stor_t::async_loader_t loader = [&pending](const int &, async_stor_t::completion_t completion)
+    {
+        pending.push_back(std::move(completion));
+    };
+
+    std::optional<std::string> results[2];
+    bool done[2] = {};
+
+    get(async_stor, 5, loader, results[0], done[0]);
+    get(async_stor, 5, loader, results[1], done[1]);
+
+    REQUIRE(pending.size() == 1);
+    REQUIRE(!done[0]);
+    REQUIRE(!done[1]);
+
+    // completed from another thread, the awaiters resume there
+    std::thread completer{ [&pending] { pending.front().set_value("five"); } };
+    completer.join();
+
+    REQUIRE(done[0]);
+    REQUIRE(done[1]);
+    REQUIRE(results[0].value() == "five");
+    REQUIRE(results[1].value() == "five");
+    REQUIRE(stor.find(5).value() == "five");
+}
+
+
+TEST_CASE("kvstor::async_storage_t concurrent awaiters")
+{
+    constexpr int keys = 50;
+    constexpr size_t threads = 4;
+
+    stor_t stor{ keys };
+    async_stor_t async_stor{ stor };
+
+    std::atomic<size_t> loads[keys] = {};
+    const async_stor_t::loader_t loader = [&loads](const int & key) -> std::optional<std::string>
+    {
+        ++loads[key];
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        return std::to_string(key);
+    };
+
+    std::atomic<size_t> finished{ 0 };
+    std::atomic<size_t> wrong{ 0 };
+
+    auto awaiter = [&async_stor, &loader, &finished, &wrong](int key) -> detached_t
+    {
+        const std::optional<std::string> value = co_await async_stor.async_get_or_load(key, loader);
+        if (value != std::to_string(key))
+            ++wrong;
+
+        ++finished;
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&awaiter]
+        {
+            for (int key = 0; key < keys; ++key)
+                awaiter(key);
+        });
+    }
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (finished < threads * keys && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    REQUIRE(finished == threads * keys);
+    REQUIRE(wrong == 0);
+    REQUIRE(async_stor.in_flight() == 0);
+
+    for (int key = 0; key < keys; ++key)
+        REQUIRE(loads[key] == 1);
+}
+
+#endif
@@ -0,0 +1,197 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor_delegate.h"
+#include "doctest.h"
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+    template <class key_type, class value_type>
+    using stor_t = kvstor::storage_t<key_type, value_type, lock_free_traits_t<key_type, value_type>>;
+
+
+    // fails every push of a new key into a full storage
+    struct throwing_admission_t
+    {
+        explicit throwing_admission_t(size_t) noexcept {}
+
+        void record(size_t) noexcept {}
+
+        bool admit(size_t, size_t)
+        {
+            throw std::runtime_error("admit");
+        }
+    };
+
+
+    template <class key_type, class value_type>
+    struct throwing_traits_t : lock_free_traits_t<key_type, value_type>
+    {
+        using admission_t = throwing_admission_t;
+    };
+
+}   // namespace
+
+
+TEST_CASE("kvstor::mpsc_ring_t")
+{
+    kvstor::mpsc_ring_t<int> ring{ 3 };
+    REQUIRE(ring.capacity() == 4);
+    REQUIRE(ring.empty());
+    REQUIRE(!ring.try_pop());
+
+    for (int i = 0; i < 4; ++i)
+        REQUIRE(ring.try_push(int(i)));
+
+    REQUIRE(!ring.try_push(4));
+    REQUIRE(ring.claimed() == 4);
+
+    // fifo, the cells are reused on the next lap
+    REQUIRE(ring.try_pop().value() == 0);
+    REQUIRE(ring.try_push(4));
+
+    for (int i = 1; i < 5; ++i)
+        REQUIRE(ring.try_pop().value() == i);
+
+    REQUIRE(ring.empty());
+}
+
+
+TEST_CASE("kvstor::delegated_storage_t")
+{
+    kvstor::delegated_storage_t<stor_t<int, std::string>> stor{ 3, 16 };
+
+    std::vector<int> evicted;
+    stor.storage().on_evict([&evicted](int && key, std::string &&) { evicted.push_back(key); });
+
+    stor.push(1, "10");
+    stor.push(2, "20");
+    stor.push(3, "30");
+    stor.erase(2);
+    stor.push(4, "40");
+    stor.push(5, "50");
+
+    stor.flush();
+    REQUIRE(stor.pending() == 0);
+    REQUIRE(stor.apply_errors() == 0);
+
+    // applied in the order of the queue
+    REQUIRE(stor.storage().size() == 3);
+    REQUIRE(evicted == std::vector<int>{ 1 });
+    REQUIRE(!stor.contains(2));
+    REQUIRE(stor.find(3).value() == "30");
+    REQUIRE(stor.find(5).value() == "50");
+
+    std::string value = "60";
+    REQUIRE(stor.try_push(6, std::move(value)));
+    REQUIRE(stor.try_erase(3));
+    stor.flush();
+
+    REQUIRE(stor.find(6).value() == "60");
+    REQUIRE(!stor.contains(3));
+}
+
+
+TEST_CASE("kvstor::delegated_storage_t failed batch")
+{
+    using throwing_stor_t = kvstor::storage_t<int, int, throwing_traits_t<int, int>>;
+    kvstor::delegated_storage_t<throwing_stor_t> stor{ 2, 16 };
+
+    stor.storage().push(1, 10);
+    stor.storage().push(2, 20);
+
+    // the updates before the failing new key stay applied and are not counted
+    stor.push(1, 11);
+    stor.push(2, 21);
+    stor.push(3, 30);
+    stor.flush();
+
+    REQUIRE(stor.apply_errors() == 1);
+    REQUIRE(stor.find(2).value() == 21);
+    REQUIRE(!stor.contains(3));
+}
+
+
+TEST_CASE("kvstor::delegated_storage_t destructor applies the queue")
+{
+    std::atomic<size_t> evicted{ 0 };
+
+    {
+        kvstor::delegated_storage_t<stor_t<int, int>> stor{ 10, 1024 };
+        stor.storage().on_evict([&evicted](int &&, int &&) { ++evicted; });
+
+        for (int i = 0; i < 1000; ++i)
+            stor.push(i, i);
+    }
+
+    REQUIRE(evicted == 990);
+}
+
+
+TEST_CASE("kvstor::delegated_storage_t thread-safe")
+{
+    constexpr size_t threads = 4;
+    constexpr size_t keys = 2000;
+
+    // a small queue makes the producers wait for the owner
+    kvstor::delegated_storage_t<stor_t<size_t, size_t>> stor{ keys, 64, 16 };
+
+    std::atomic<size_t> wrong{ 0 };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&stor, &wrong, t]
+        {
+            for (size_t i = 0; i < keys / threads; ++i)
+            {
+                const size_t key = i * threads + t;
+                stor.push(key, key * 2);
+
+                if (i % 8 == 0)
+                    stor.erase(key);
+
+                const auto found = stor.find((i / 2) * threads + t);
+                if (found && found.value() != (i / 2) * threads * 2 + t * 2)
+                    ++wrong;
+            }
+
+            stor.flush();
+        });
+    }
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    REQUIRE(wrong == 0);
+    REQUIRE(stor.pending() == 0);
+
+    size_t stored = 0;
+    for (size_t key = 0; key < keys; ++key)
+    {
+        if ((key / threads) % 8 == 0)
+        {
+            REQUIRE(!stor.contains(key));
+        }
+        else
+        {
+            REQUIRE(stor.find(key).value() == key * 2);
+            ++stored;
+        }
+    }
+
+    REQUIRE(stor.storage().size() == stored);
+}
@@ -0,0 +1,162 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor_front_cache.h"
+#include "doctest.h"
+
+#include <atomic>
+#include <future>
+#include <string>
+#include <vector>
+
+
+template <class key_type, class value_type>
+struct versioned_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    static constexpr size_t version_stripes = 64;
+};
+
+
+TEST_CASE("kvstor::storage_t::version()")
+{
+    using stor_t = kvstor::storage_t<int, std::string, versioned_traits_t<int, std::string>>;
+    stor_t stor{ 2 };
+
+    const uint64_t v0 = stor.version(1);
+
+    stor.push(1, "10");
+    const uint64_t v1 = stor.version(1);
+    REQUIRE(v1 != v0);
+
+    std::optional<std::string> expected = std::string("10");
+    REQUIRE(stor.compare_exchange(1, "11", expected));
+    const uint64_t v2 = stor.version(1);
+    REQUIRE(v2 != v1);
+
+    // eviction changes the version of the evicted key
+    stor.push(2, "20");
+    stor.push(3, "30");
+    const uint64_t v3 = stor.version(1);
+    REQUIRE(v3 != v2);
+
+    stor.erase(2);
+    REQUIRE(stor.version(1) == v3);
+
+    stor.clear();
+    REQUIRE(stor.version(1) != v3);
+}
+
+
+TEST_CASE("kvstor::front_cache_t")
+{
+    using stor_t = kvstor::storage_t<int, std::string, versioned_traits_t<int, std::string>>;
+    stor_t stor{ 3 };
+    kvstor::front_cache_t<stor_t> cache{ stor, 16 };
+    REQUIRE(cache.slots() == 16);
+    REQUIRE(&cache.storage() == &stor);
+
+    REQUIRE(!cache.find(1));
+
+    stor.push(1, "10");
+    REQUIRE(cache.find(1).value() == "10");
+    REQUIRE(cache.find(1).value() == "10");
+
+    stor.push(1, "11");
+    REQUIRE(cache.find(1).value() == "11");
+
+    std::optional<std::string> expected = std::string("11");
+    REQUIRE(stor.compare_exchange(1, "12", expected));
+    REQUIRE(cache.find(1).value() == "12");
+
+    stor.erase(1);
+    REQUIRE(!cache.find(1));
+
+    // evicted entries are not served from the cache
+    stor.push(1, "13");
+    REQUIRE(cache.find(1).value() == "13");
+    stor.push(2, "20");
+    stor.push(3, "30");
+    stor.push(4, "40");
+    REQUIRE(!cache.find(1));
+
+    REQUIRE(cache.find(4).value() == "40");
+    stor.clear();
+    REQUIRE(!cache.find(4));
+
+    // slots of one thread are not visible to another one
+    stor.push(5, "50");
+    REQUIRE(cache.find(5).value() == "50");
+    cache.reset_local();
+    REQUIRE(cache.find(5).value() == "50");
+
+    auto other = std::async(std::launch::async, [&cache]() { return cache.find(5); });
+    REQUIRE(other.get().value() == "50");
+}
+
+
+TEST_CASE("kvstor::front_cache_t several caches per thread")
+{
+    using stor_t = kvstor::storage_t<int, int, versioned_traits_t<int, int>>;
+    stor_t stor{ 100 };
+    stor.push(1, 1);
+
+    std::vector<std::unique_ptr<kvstor::front_cache_t<stor_t>>> caches;
+    for (size_t i = 0; i < 20; ++i)
+        caches.push_back(std::make_unique<kvstor::front_cache_t<stor_t>>(stor, 4));
+
+    for (size_t round = 0; round < 3; ++round)
+    {
+        for (auto & cache : caches)
+            REQUIRE(cache->find(1).value() == 1);
+    }
+
+    stor.push(1, 2);
+    for (auto & cache : caches)
+        REQUIRE(cache->find(1).value() == 2);
+}
+
+
+TEST_CASE("kvstor::front_cache_t thread-safe")
+{
+    constexpr int keys = 100;
+    constexpr int rounds = 200;
+
+    using stor_t = kvstor::storage_t<int, int, versioned_traits_t<int, int>>;
+    stor_t stor{ keys };
+    kvstor::front_cache_t<stor_t> cache{ stor, 32 };
+
+    for (int key = 0; key < keys; ++key)
+        stor.push(key, 0);
+
+    std::atomic<int> round_done{ -1 };
+    std::atomic<size_t> errors{ 0 };
+
+    // once a round is completed a reader never sees a value from an older round
+    auto read = [&cache, &round_done, &errors]()
+    {
+        while (round_done < rounds - 1)
+        {
+            const int done = round_done;
+            for (int key = 0; key < keys; ++key)
+            {
+                const auto found = cache.find(key);
+                if (!found || *found < done)
+                    ++errors;
+            }
+        }
+    };
+
+    auto r1 = std::async(std::launch::async, read);
+    auto r2 = std::async(std::launch::async, read);
+
+    for (int round = 0; round < rounds; ++round)
+    {
+        for (int key = 0; key < keys; ++key)
+            stor.push(key, round);
+
+        round_done = round;
+    }
+
+    r1.wait();
+    r2.wait();
+    REQUIRE(errors == 0);
+}
@@ -0,0 +1,81 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "../bench/kvstor_histogram.h"
+#include "doctest.h"
+
+#include <cstdint>
+
+
+TEST_CASE("kvstor_bench::histogram_t percentiles")
+{
+    kvstor_bench::histogram_t histogram{ 3600ull * 1000 * 1000, 3 };
+
+    REQUIRE(histogram.count() == 0);
+    REQUIRE(histogram.percentile(99) == 0);
+
+    for (uint64_t value = 1; value <= 10000; ++value)
+        histogram.record(value);
+
+    REQUIRE(histogram.count() == 10000);
+    REQUIRE(histogram.min() == 1);
+    REQUIRE(histogram.max() == 10000);
+    REQUIRE(histogram.mean() == doctest::Approx(5000.5).epsilon(0.001));
+
+    // small values are exact, larger ones keep three significant digits
+    REQUIRE(histogram.percentile(0) == 1);
+    REQUIRE(histogram.percentile(1) == 100);
+    REQUIRE(histogram.percentile(50) == doctest::Approx(5000).epsilon(0.001));
+    REQUIRE(histogram.percentile(99) == doctest::Approx(9900).epsilon(0.001));
+    REQUIRE(histogram.percentile(99.9) == doctest::Approx(9990).epsilon(0.001));
+    REQUIRE(histogram.percentile(100) == 10000);
+
+    // wide range
+    histogram.reset();
+    histogram.record(1000000000, 3);
+    histogram.record(50);
+
+    REQUIRE(histogram.count() == 4);
+    REQUIRE(histogram.percentile(25) == 50);
+    REQUIRE(histogram.percentile(50) == doctest::Approx(1000000000).epsilon(0.001));
+    REQUIRE(histogram.max() == 1000000000);
+
+    // values above the highest trackable one are clamped
+    histogram.record(UINT64_MAX);
+    REQUIRE(histogram.max() == 3600ull * 1000 * 1000);
+
+    REQUIRE_THROWS(kvstor_bench::histogram_t{ 1000, 0 });
+    REQUIRE_THROWS(kvstor_bench::histogram_t{ 1, 3 });
+}
+
+
+TEST_CASE("kvstor_bench::histogram_t coordinated omission correction")
+{
+    // a closed-loop caller expecting a request every 100 ns sees 99 fast requests and one 10 us stall
+    kvstor_bench::histogram_t raw;
+    kvstor_bench::histogram_t corrected;
+
+    for (int i = 0; i < 99; ++i)
+    {
+        raw.record(10);
+        corrected.record_corrected(10, 100);
+    }
+
+    raw.record(10000);
+    corrected.record_corrected(10000, 100);
+
+    REQUIRE(raw.count() == 100);
+    REQUIRE(raw.percentile(99) == 10);
+
+    // the stall hides 99 requests that would have waited 9900, 9800, ... 100 ns
+    REQUIRE(corrected.count() == 199);
+    REQUIRE(corrected.percentile(50) == doctest::Approx(100).epsilon(0.01));
+    REQUIRE(corrected.percentile(99) == doctest::Approx(9900).epsilon(0.01));
+    REQUIRE(corrected.max() == 10000);
+
+    kvstor_bench::histogram_t total;
+    total.add(raw);
+    total.add(corrected);
+    REQUIRE(total.count() == 299);
+    REQUIRE(total.min() == 10);
+    REQUIRE_THROWS(total.add(kvstor_bench::histogram_t{ 1000, 2 }));
+}
@@ -0,0 +1,148 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor_maintenance.h"
+#include "doctest.h"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct watermark_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        static constexpr size_t low_watermark = 50;
+    };
+
+
+    template <class key_type, class value_type>
+    struct tinylfu_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        using admission_t = kvstor::tinylfu_admission_t;
+    };
+
+}   // namespace
+
+
+TEST_CASE("kvstor::maintenance_t expires entries by manual ticks")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    using maintenance_t = kvstor::maintenance_t<stor_t>;
+
+    stor_t stor{ 10 };
+    std::vector<int> expired;
+    stor.on_evict([&expired](int && key, int &&) { expired.push_back(key); });
+
+    maintenance_t maintenance{ stor, stor_t::duration_t::zero(), std::chrono::milliseconds(50), 2 };
+
+    for (int i = 1; i <= 5; ++i)
+        stor.push(i, i);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    stor.push(6, 6);
+
+    // at most batch entries per tick, oldest first
+    maintenance.tick();
+    REQUIRE(expired == std::vector<int>{ 1, 2 });
+
+    maintenance.tick();
+    maintenance.tick();
+    REQUIRE(expired == std::vector<int>{ 1, 2, 3, 4, 5 });
+    REQUIRE(stor.size() == 1);
+    REQUIRE(stor.find(6).value() == 6);
+
+    const maintenance_t::stats_t stats = maintenance.stats();
+    REQUIRE(stats.ticks == 3);
+    REQUIRE(stats.expired == 5);
+    REQUIRE(stats.trimmed == 0);
+    REQUIRE(stats.size == 1);
+    REQUIRE(stats.weight == 1);
+}
+
+
+TEST_CASE("kvstor::maintenance_t trims to the low watermark")
+{
+    using stor_t = kvstor::storage_t<int, int, watermark_traits_t<int, int>>;
+
+    stor_t stor{ 10 };
+    kvstor::maintenance_t<stor_t> maintenance{ stor, stor_t::duration_t::zero() };
+
+    for (int i = 0; i < 8; ++i)
+        stor.push(i, i);
+
+    maintenance.tick();
+    REQUIRE(stor.size() == 5);
+    REQUIRE(!stor.contains(2));
+    REQUIRE(stor.contains(3));
+    REQUIRE(maintenance.stats().trimmed == 3);
+
+    maintenance.tick();
+    REQUIRE(maintenance.stats().trimmed == 3);
+}
+
+
+TEST_CASE("kvstor::maintenance_t ages the admission sketch")
+{
+    using stor_t = kvstor::storage_t<int, int, tinylfu_traits_t<int, int>>;
+
+    stor_t stor{ 64 };
+    const size_t hash = stor_t::hash_t{}(1);
+
+    {
+        kvstor::maintenance_t<stor_t> maintenance{ stor, stor_t::duration_t::zero() };
+
+        // 10 * max_size accesses would age the sketch inside push()
+        for (int i = 0; i < 700; ++i)
+            stor.push(1, i);
+
+        REQUIRE(stor.admission().estimate(hash) == 16);
+
+        maintenance.tick();
+        REQUIRE(maintenance.stats().agings == 1);
+        REQUIRE(stor.admission().estimate(hash) == 7);
+
+        maintenance.tick();
+        REQUIRE(maintenance.stats().agings == 1);
+    }
+
+    // without maintenance the 640th push ages the sketch again
+    for (int i = 0; i < 640; ++i)
+        stor.push(1, i);
+
+    REQUIRE(stor.admission().estimate(hash) == 7);
+}
+
+
+TEST_CASE("kvstor::maintenance_t background thread")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    using maintenance_t = kvstor::maintenance_t<stor_t>;
+
+    stor_t stor{ 100 };
+    maintenance_t maintenance{ stor, std::chrono::milliseconds(1), std::chrono::milliseconds(20) };
+
+    for (int i = 0; i < 100; ++i)
+        stor.push(i, i);
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!stor.empty() && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    REQUIRE(stor.empty());
+
+    // the thread is stopped deterministically
+    maintenance.stop();
+    const maintenance_t::stats_t stats = maintenance.stats();
+    REQUIRE(stats.ticks > 0);
+    REQUIRE(stats.expired == 100);
+
+    stor.push(1, 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    REQUIRE(maintenance.stats().ticks == stats.ticks);
+    REQUIRE(stor.contains(1));
+
+    maintenance.stop();
+}
@@ -0,0 +1,313 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor_numa.h"
+#include "doctest.h"
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if KVSTOR_NUMA_ENABLED
+#include <numaif.h>
+#endif
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_numa_traits_t : kvstor::numa_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+        static constexpr bool presize_index = true;
+    };
+
+
+#if KVSTOR_NUMA_ENABLED
+    // the node of the page holding the address, the page must have been touched
+    int node_of(const void * ptr)
+    {
+        int node = -1;
+        REQUIRE(get_mempolicy(&node, nullptr, 0, const_cast<void *>(ptr), MPOL_F_NODE | MPOL_F_ADDR) == 0);
+        return node;
+    }
+
+
+    // MPOL_DEFAULT for memory placed by the first touch
+    int policy_of(const void * ptr)
+    {
+        int policy = -1;
+        REQUIRE(get_mempolicy(&policy, nullptr, 0, const_cast<void *>(ptr), MPOL_F_ADDR) == 0);
+        return policy;
+    }
+#endif
+
+}   // namespace
+
+
+TEST_CASE("kvstor::numa_t")
+{
+    REQUIRE(kvstor::numa_t::nodes() >= 1);
+    REQUIRE(kvstor::numa_t::current_node() < kvstor::numa_t::nodes());
+    REQUIRE(kvstor::numa_t::bind_thread(0));
+
+    {
+        const kvstor::numa_scope_t outer{ 3 };
+        REQUIRE(kvstor::numa_t::current_node() == 3);
+
+        {
+            const kvstor::numa_scope_t inner{ 5 };
+            REQUIRE(kvstor::numa_t::current_node() == 5);
+        }
+
+        REQUIRE(kvstor::numa_t::current_node() == 3);
+    }
+
+    REQUIRE(kvstor::numa_t::current_node() < kvstor::numa_t::nodes());
+}
+
+
+TEST_CASE("kvstor::numa_alloc_t")
+{
+    const kvstor::numa_scope_t scope{ 0 };
+
+    // small and bound allocations
+    std::list<std::string, kvstor::numa_alloc_t<std::string>> small;
+    std::vector<size_t, kvstor::numa_alloc_t<size_t>> large;
+
+    for (size_t i = 0; i < 10000; ++i)
+    {
+        small.push_back(std::to_string(i));
+        large.push_back(i);
+    }
+
+    REQUIRE(small.size() == 10000);
+    REQUIRE(small.back() == "9999");
+    REQUIRE(large[9999] == 9999);
+
+    struct alignas(128) aligned_t
+    {
+        char data[8];
+    };
+
+    std::vector<aligned_t, kvstor::numa_alloc_t<aligned_t>> aligned(3);
+    REQUIRE(reinterpret_cast<uintptr_t>(aligned.data()) % 128 == 0);
+}
+
+
+#if KVSTOR_NUMA_ENABLED
+TEST_CASE("kvstor::numa_alloc_t page placement")
+{
+    if (!kvstor::numa_t::available())
+        return;
+
+    for (size_t node = 0; node < kvstor::numa_t::nodes(); ++node)
+    {
+        // a node without memory
+        if (!numa_bitmask_isbitset(numa_all_nodes_ptr, static_cast<unsigned>(node)))
+            continue;
+
+        CAPTURE(node);
+        const kvstor::numa_scope_t scope{ node };
+
+        std::list<size_t, kvstor::numa_alloc_t<size_t>> small;
+        std::vector<size_t, kvstor::numa_alloc_t<size_t>> large(10000, node);
+
+        for (size_t i = 0; i < 1000; ++i)
+            small.push_back(i);
+
+        // list nodes as well as whole pages are bound to the node of the scope
+        for (const size_t & item : small)
+        {
+            REQUIRE(node_of(&item) == static_cast<int>(node));
+            REQUIRE(policy_of(&item) != MPOL_DEFAULT);
+        }
+
+        REQUIRE(node_of(large.data()) == static_cast<int>(node));
+        REQUIRE(policy_of(large.data()) != MPOL_DEFAULT);
+    }
+
+    // a freed block is reused by its node and size
+    std::vector<const size_t *> freed;
+    {
+        const kvstor::numa_scope_t scope{ 0 };
+        std::list<size_t, kvstor::numa_alloc_t<size_t>> first(1);
+        freed.push_back(&first.front());
+    }
+
+    {
+        const kvstor::numa_scope_t scope{ 0 };
+        std::list<size_t, kvstor::numa_alloc_t<size_t>> second(1);
+        REQUIRE(&second.front() == freed.front());
+    }
+}
+#endif
+
+
+TEST_CASE("kvstor::storage_t with numa_traits_t")
+{
+    kvstor::storage_t<int, std::string, kvstor::numa_traits_t<int, std::string>> stor{ 1000 };
+
+    for (int i = 0; i < 2000; ++i)
+        stor.push(i, std::to_string(i));
+
+    REQUIRE(stor.size() == 1000);
+    REQUIRE(!stor.contains(999));
+    REQUIRE(stor.find(1999).value() == "1999");
+}
+
+
+TEST_CASE_TEMPLATE("kvstor::sharded_storage_t hash route", stor_t,
+    kvstor::storage_t<int, std::string>, kvstor::storage_t<int, std::string, lock_free_numa_traits_t<int, std::string>>)
+{
+    kvstor::sharded_storage_t<stor_t> stor{ 1000, kvstor::numa_route_t::hash, 4, 2 };
+
+    REQUIRE(stor.nodes() == 2);
+    REQUIRE(stor.shards() == 8);
+    REQUIRE(stor.max_size() == 8 * 125);
+    REQUIRE(stor.node_of(3) == 0);
+    REQUIRE(stor.node_of(4) == 1);
+
+    for (int i = 0; i < 800; ++i)
+        stor.push(i, std::to_string(i));
+
+    REQUIRE(stor.size() <= 800);
+    REQUIRE(stor.find(799).value() == "799");
+
+    // keys are spread over every shard
+    for (size_t i = 0; i < stor.shards(); ++i)
+        REQUIRE(stor.shard(i).size() > 0);
+
+    // the node of the writer does not matter
+    {
+        const kvstor::numa_scope_t scope{ 1 };
+        stor.push(799, "new");
+    }
+
+    REQUIRE(stor.find(799).value() == "new");
+
+    stor.erase(799);
+    REQUIRE(!stor.contains(799));
+}
+
+
+TEST_CASE("kvstor::sharded_storage_t local route")
+{
+    using stor_t = kvstor::storage_t<int, std::string, lock_free_numa_traits_t<int, std::string>>;
+    kvstor::sharded_storage_t<stor_t> stor{ 1000, kvstor::numa_route_t::local, 2, 2 };
+
+    auto size_of_node = [&stor](size_t node)
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < stor.shards(); ++i)
+        {
+            if (stor.node_of(i) == node)
+                size += stor.shard(i).size();
+        }
+
+        return size;
+    };
+
+    {
+        const kvstor::numa_scope_t scope{ 1 };
+        for (int i = 0; i < 100; ++i)
+            stor.push(i, "node 1");
+    }
+
+    // written to the local shards, found from the other node
+    REQUIRE(size_of_node(1) == 100);
+    REQUIRE(size_of_node(0) == 0);
+
+    {
+        const kvstor::numa_scope_t scope{ 0 };
+        REQUIRE(stor.find(5).value() == "node 1");
+        REQUIRE(stor.contains(5));
+
+        // rewriting moves the key to the local node
+        stor.push(5, "node 0");
+    }
+
+    REQUIRE(size_of_node(1) == 99);
+    REQUIRE(size_of_node(0) == 1);
+    REQUIRE(stor.size() == 100);
+
+    {
+        const kvstor::numa_scope_t scope{ 1 };
+        REQUIRE(stor.find(5).value() == "node 0");
+
+        stor.erase(5);
+        REQUIRE(!stor.contains(5));
+    }
+}
+
+
+TEST_CASE("kvstor::sharded_storage_t thread-safe")
+{
+    using stor_t = kvstor::storage_t<size_t, size_t, lock_free_numa_traits_t<size_t, size_t>>;
+    kvstor::sharded_storage_t<stor_t> stor{ 16000, kvstor::numa_route_t::local, 2, 2 };
+
+    constexpr size_t threads = 4;
+    constexpr size_t keys = 1000;
+    std::atomic<size_t> errors{ 0 };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&stor, &errors, t]
+        {
+            const kvstor::numa_scope_t scope{ t % 2 };
+
+            for (size_t round = 0; round < 5; ++round)
+            {
+                for (size_t key = t * keys; key < (t + 1) * keys; ++key)
+                {
+                    stor.push(key, key);
+
+                    const auto found = stor.find(key);
+                    if (!found || found.value() != key)
+                        ++errors;
+                }
+            }
+        });
+    }
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    REQUIRE(errors == 0);
+    REQUIRE(stor.size() == threads * keys);
+}
+
+
+TEST_CASE("kvstor::sharded_storage_t local route writes of one key from two nodes")
+{
+    using stor_t = kvstor::storage_t<size_t, size_t, lock_free_numa_traits_t<size_t, size_t>>;
+    kvstor::sharded_storage_t<stor_t> stor{ 16000, kvstor::numa_route_t::local, 2, 2 };
+
+    constexpr size_t keys = 200;
+
+    std::vector<std::thread> workers;
+    for (size_t node = 0; node < 2; ++node)
+    {
+        workers.emplace_back([&stor, node]
+        {
+            const kvstor::numa_scope_t scope{ node };
+
+            for (size_t round = 0; round < 20; ++round)
+            {
+                for (size_t key = 0; key < keys; ++key)
+                    stor.push(key, node);
+            }
+        });
+    }
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    // every key is kept by exactly one node
+    REQUIRE(stor.size() == keys);
+    for (size_t key = 0; key < keys; ++key)
+        REQUIRE(stor.contains(key));
+}
@@ -0,0 +1,247 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor_refresh.h"
+#include "doctest.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+
+TEST_CASE("kvstor::thread_pool_t")
+{
+    std::atomic<size_t> count{ 0 };
+
+    kvstor::thread_pool_t pool{ 4, 100 };
+
+    for (size_t i = 0; i < 100; ++i)
+        REQUIRE(pool.try_post([&count] { ++count; }));
+
+    pool.wait_idle();
+    REQUIRE(count == 100);
+}
+
+
+TEST_CASE("kvstor::thread_pool_t bounded queue")
+{
+    std::mutex gate;
+    std::unique_lock hold{ gate };
+    std::atomic<bool> started{ false };
+
+    kvstor::thread_pool_t pool{ 1, 1 };
+
+    // occupy the single worker
+    REQUIRE(pool.try_post([&gate, &started] { started = true; const std::lock_guard guard{ gate }; }));
+    while (!started)
+        std::this_thread::yield();
+
+    REQUIRE(pool.try_post([] {}));
+    REQUIRE(!pool.try_post([] {}));
+
+    hold.unlock();
+    pool.wait_idle();
+    REQUIRE(pool.try_post([] {}));
+}
+
+
+TEST_CASE("kvstor::thread_pool_t without threads")
+{
+    REQUIRE_THROWS_AS(kvstor::thread_pool_t(0, 1), std::invalid_argument);
+}
+
+
+TEST_CASE("kvstor::refresh_ahead_t refreshes old entries")
+{
+    using stor_t = kvstor::storage_t<int, std::string>;
+    stor_t stor{ 10 };
+
+    std::atomic<size_t> loads{ 0 };
+    auto loader = [&loads](int key) -> std::optional<std::string>
+    {
+        ++loads;
+        return std::to_string(key * 10);
+    };
+
+    kvstor::refresh_ahead_t<stor_t> refresh{ stor, loader, std::chrono::hours(1) };
+
+    stor.push(1, "old");
+
+    // the entry is younger than the threshold
+    REQUIRE(refresh.find(1).value() == "old");
+    refresh.wait_idle();
+    REQUIRE(loads == 0);
+
+    // the key does not exist: nothing to refresh
+    REQUIRE(!refresh.find(2));
+    refresh.wait_idle();
+    REQUIRE(loads == 0);
+
+    kvstor::refresh_ahead_t<stor_t> eager{ stor, loader, stor_t::duration_t::zero() };
+
+    // the current value is returned and reloaded in the background
+    REQUIRE(eager.find(1).value() == "old");
+    eager.wait_idle();
+    REQUIRE(loads == 1);
+    REQUIRE(eager.pending() == 0);
+    REQUIRE(stor.find(1).value() == "10");
+}
+
+
+TEST_CASE("kvstor::refresh_ahead_t deduplicates refreshes")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    stor_t stor{ 10 };
+    stor.push(1, 1);
+
+    std::mutex gate;
+    std::unique_lock hold{ gate };
+    std::atomic<size_t> loads{ 0 };
+
+    auto loader = [&gate, &loads](int key) -> std::optional<int>
+    {
+        const std::lock_guard guard{ gate };
+        ++loads;
+        return key + 100;
+    };
+
+    kvstor::refresh_ahead_t<stor_t> refresh{ stor, loader, stor_t::duration_t::zero(), 2 };
+
+    for (size_t i = 0; i < 10; ++i)
+        REQUIRE(refresh.find(1).value() == 1);
+
+    REQUIRE(refresh.pending() == 1);
+
+    hold.unlock();
+    refresh.wait_idle();
+    REQUIRE(loads == 1);
+    REQUIRE(stor.find(1).value() == 101);
+}
+
+
+TEST_CASE("kvstor::refresh_ahead_t keeps value on loader failure")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    stor_t stor{ 10 };
+    stor.push(1, 1);
+    stor.push(2, 2);
+
+    auto loader = [](int key) -> std::optional<int>
+    {
+        if (key == 1)
+            throw std::runtime_error("loader failed");
+
+        return std::optional<int>{};
+    };
+
+    kvstor::refresh_ahead_t<stor_t> refresh{ stor, loader, stor_t::duration_t::zero() };
+
+    REQUIRE(refresh.find(1).value() == 1);
+    REQUIRE(refresh.find(2).value() == 2);
+    refresh.wait_idle();
+
+    REQUIRE(refresh.pending() == 0);
+    REQUIRE(stor.find(1).value() == 1);
+    REQUIRE(stor.find(2).value() == 2);
+}
+
+
+TEST_CASE("kvstor::refresh_ahead_t does not resurrect changed keys")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    stor_t stor{ 10 };
+    stor.push(1, 1);
+    stor.push(2, 2);
+    stor.push(3, 3);
+
+    std::mutex gate;
+    std::unique_lock hold{ gate };
+
+    auto loader = [&gate](int key) -> std::optional<int>
+    {
+        const std::lock_guard guard{ gate };
+        return key + 100;
+    };
+
+    kvstor::refresh_ahead_t<stor_t> refresh{ stor, loader, stor_t::duration_t::zero() };
+
+    REQUIRE(refresh.find(1).value() == 1);
+    REQUIRE(refresh.find(2).value() == 2);
+    REQUIRE(refresh.find(3).value() == 3);
+    REQUIRE(refresh.pending() == 3);
+
+    // changed while the refreshes are queued
+    stor.erase(1);
+    stor.push(2, 20);
+
+    hold.unlock();
+    refresh.wait_idle();
+
+    REQUIRE(!stor.find(1));
+    REQUIRE(stor.find(2).value() == 20);
+    REQUIRE(stor.find(3).value() == 103);
+}
+
+
+namespace
+{
+
+    // throws from the copy made after copies_left other copies
+    struct fragile_t
+    {
+        static inline int copies_left = -1;
+
+        explicit fragile_t(int value_) : value(value_) {}
+
+        fragile_t(const fragile_t & other)
+        :   value(other.value)
+        {
+            if (copies_left == 0)
+            {
+                copies_left = -1;
+                throw std::runtime_error("copy failed");
+            }
+
+            if (copies_left > 0)
+                --copies_left;
+        }
+
+        fragile_t(fragile_t &&) noexcept = default;
+        fragile_t & operator=(const fragile_t &) = default;
+        fragile_t & operator=(fragile_t &&) noexcept = default;
+
+        bool operator==(const fragile_t & other) const noexcept { return value == other.value; }
+
+        int value;
+    };
+
+}   // namespace
+
+
+TEST_CASE("kvstor::refresh_ahead_t failed schedule")
+{
+    using stor_t = kvstor::storage_t<int, fragile_t>;
+    stor_t stor{ 10 };
+    stor.push(1, fragile_t{ 1 });
+
+    std::atomic<size_t> loads{ 0 };
+    auto loader = [&loads](int key) -> std::optional<fragile_t>
+    {
+        ++loads;
+        return fragile_t{ key + 100 };
+    };
+
+    kvstor::refresh_ahead_t<stor_t> refresh{ stor, loader, stor_t::duration_t::zero() };
+
+    // the value is found, copying it into the refresh task throws
+    fragile_t::copies_left = 1;
+    REQUIRE_THROWS_AS(refresh.find(1), std::runtime_error);
+    REQUIRE(refresh.pending() == 0);
+
+    // the key is not left pending, the next hit refreshes it
+    REQUIRE(refresh.find(1).value().value == 1);
+    refresh.wait_idle();
+    REQUIRE(loads == 1);
+    REQUIRE(stor.find(1).value().value == 101);
+}
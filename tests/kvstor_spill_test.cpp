@@ -0,0 +1,359 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor_spill.h"
+#include "doctest.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+TEST_CASE("kvstor::serializer_t")
+{
+    std::string out;
+    kvstor::serializer_t<int>::write(out, 42);
+    REQUIRE(out.size() == sizeof(int));
+    REQUIRE(kvstor::serializer_t<int>::read(out.data(), out.size()) == 42);
+    REQUIRE_THROWS(kvstor::serializer_t<int>::read(out.data(), 1));
+
+    out.clear();
+    kvstor::serializer_t<std::string>::write(out, "value");
+    REQUIRE(kvstor::serializer_t<std::string>::read(out.data(), out.size()) == "value");
+}
+
+
+TEST_CASE("kvstor::disk_tier_t")
+{
+    kvstor::disk_tier_t<int, std::string> disk{ "kvstor_spill_test_disk.dat" };
+
+    REQUIRE(disk.size() == 0);
+    REQUIRE(!disk.find(1));
+
+    disk.put(1, "one");
+    disk.put(2, "two");
+    disk.put(3, "");
+    REQUIRE(disk.size() == 3);
+    REQUIRE(disk.dead_bytes() == 0);
+    REQUIRE(disk.find(1).value() == "one");
+    REQUIRE(disk.find(3).value() == "");
+
+    // replacing leaves the old record dead
+    disk.put(1, "uno");
+    REQUIRE(disk.size() == 3);
+    REQUIRE(disk.dead_bytes() > 0);
+    REQUIRE(disk.find(1).value() == "uno");
+
+    REQUIRE(disk.take(2).value() == "two");
+    REQUIRE(!disk.take(2));
+    REQUIRE(disk.erase(3));
+    REQUIRE(!disk.erase(3));
+    REQUIRE(disk.size() == 1);
+
+    const uint64_t before = disk.file_size();
+    REQUIRE(disk.compact_if_needed());
+    REQUIRE(disk.dead_bytes() == 0);
+    REQUIRE(disk.file_size() < before);
+    REQUIRE(!disk.compact_if_needed());
+    REQUIRE(disk.find(1).value() == "uno");
+
+    disk.put(4, "four");
+    REQUIRE(disk.find(4).value() == "four");
+
+    disk.clear();
+    REQUIRE(disk.size() == 0);
+    REQUIRE(disk.file_size() == 0);
+    REQUIRE(!disk.find(1));
+}
+
+
+TEST_CASE("kvstor::disk_tier_t recovers after an i/o error")
+{
+    const std::string path = "kvstor_spill_test_error.dat";
+    kvstor::disk_tier_t<int, std::string> disk{ path };
+
+    disk.put(1, "one");
+    REQUIRE(disk.find(1).value() == "one");
+
+    // the record is cut off behind the tier's back, reading it fails
+    std::filesystem::resize_file(path, 2);
+    REQUIRE_THROWS(disk.find(1));
+
+    // the failed read leaves no error state behind
+    disk.put(2, "two");
+    REQUIRE(disk.find(2).value() == "two");
+
+    disk.clear();
+    disk.put(3, "three");
+    REQUIRE(disk.find(3).value() == "three");
+}
+
+
+TEST_CASE("kvstor::disk_tier_t put does not read the file")
+{
+    const std::string path = "kvstor_spill_test_put.dat";
+    kvstor::disk_tier_t<int, std::string> disk{ path };
+
+    disk.put(1, "one");
+    REQUIRE(disk.find(1).value() == "one");
+    std::filesystem::resize_file(path, 0);
+
+    // the replaced record is not read back, it is only counted as dead
+    disk.put(1, "uno");
+    disk.put(2, "two");
+    REQUIRE(disk.find(1).value() == "uno");
+    REQUIRE(disk.find(2).value() == "two");
+    REQUIRE(disk.erase(2));
+    REQUIRE(disk.size() == 1);
+}
+
+
+TEST_CASE("kvstor::disk_tier_t compacts while in use")
+{
+    kvstor::disk_tier_t<int, int> disk{ "kvstor_spill_test_compact_race.dat" };
+
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> compactions{ 0 };
+
+    std::thread compactor([&disk, &stop, &compactions]
+    {
+        while (!stop)
+        {
+            disk.compact();
+            ++compactions;
+        }
+    });
+
+    // the reference copy of the tier
+    std::vector<int> values(100, -1);
+
+    for (int i = 0; i < 20000 || compactions < 10; ++i)
+    {
+        const int key = (i * 7) % 100;
+
+        if (i % 5000 == 4999)
+        {
+            disk.clear();
+            values.assign(100, -1);
+        }
+        else if (i % 3 == 0)
+        {
+            REQUIRE(disk.erase(key) == (values[key] >= 0));
+            values[key] = -1;
+        }
+        else
+        {
+            disk.put(key, i);
+            values[key] = i;
+        }
+
+        const auto found = disk.find((key + 50) % 100);
+        REQUIRE(found.value_or(-1) == values[(key + 50) % 100]);
+    }
+
+    stop = true;
+    compactor.join();
+
+    for (int key = 0; key < 100; ++key)
+        REQUIRE(disk.find(key).value_or(-1) == values[key]);
+}
+
+
+TEST_CASE("kvstor::disk_tier_t hash collisions")
+{
+    struct collide_t
+    {
+        size_t operator()(int) const noexcept { return 0; }
+    };
+
+    kvstor::disk_tier_t<int, int, collide_t> disk{ "kvstor_spill_test_collide.dat" };
+
+    for (int key = 0; key < 10; ++key)
+        disk.put(key, key * 10);
+
+    for (int key = 0; key < 10; ++key)
+        REQUIRE(disk.find(key).value() == key * 10);
+
+    REQUIRE(disk.take(5).value() == 50);
+    REQUIRE(!disk.find(5));
+    REQUIRE(disk.find(6).value() == 60);
+}
+
+
+TEST_CASE("kvstor::tiered_storage_t spills and promotes")
+{
+    using stor_t = kvstor::storage_t<int, std::string>;
+    kvstor::tiered_storage_t<stor_t> stor{ 3, "kvstor_spill_test_tiered.dat", std::chrono::milliseconds(0) };
+
+    for (int key = 0; key < 10; ++key)
+        stor.push(key, std::to_string(key));
+
+    REQUIRE(stor.memory().size() == 3);
+    REQUIRE(stor.disk().size() == 7);
+
+    // every entry is still reachable
+    for (int key = 0; key < 10; ++key)
+        REQUIRE(stor.find(key).value() == std::to_string(key));
+
+    REQUIRE(stor.memory().size() == 3);
+    REQUIRE(stor.disk().size() == 7);
+    REQUIRE(stor.spill_errors() == 0);
+
+    // a promoted entry is the most recent one
+    REQUIRE(stor.find(0).value() == "0");
+    REQUIRE(stor.memory().first().value() == "0");
+
+    stor.erase(0);
+    stor.erase(1);
+    REQUIRE(!stor.find(0));
+    REQUIRE(!stor.find(1));
+
+    stor.clear();
+    REQUIRE(stor.memory().empty());
+    REQUIRE(stor.disk().size() == 0);
+    REQUIRE(!stor.find(5));
+}
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct tinylfu_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        using admission_t = kvstor::tinylfu_admission_t;
+    };
+
+}   // namespace
+
+
+TEST_CASE("kvstor::tiered_storage_t with an admission filter")
+{
+    using stor_t = kvstor::storage_t<int, std::string, tinylfu_traits_t<int, std::string>>;
+    kvstor::tiered_storage_t<stor_t> stor{ 2, "kvstor_spill_test_admission.dat", std::chrono::milliseconds(0) };
+
+    stor.push(1, "old");
+
+    // frequent keys push key 1 out to the disk
+    for (int round = 0; round < 10; ++round)
+    {
+        stor.push(2, "2");
+        stor.push(3, "3");
+        REQUIRE(stor.find(2).value() == "2");
+        REQUIRE(stor.find(3).value() == "3");
+    }
+
+    REQUIRE(stor.disk().size() == 1);
+
+    // the new value is turned down by the memory tier and replaces the spilled one
+    stor.push(1, "new");
+    REQUIRE(stor.memory().rejected() > 0);
+    REQUIRE(stor.find(1).value() == "new");
+}
+
+
+TEST_CASE("kvstor::tiered_storage_t background compaction")
+{
+    using stor_t = kvstor::storage_t<int, std::string>;
+    kvstor::tiered_storage_t<stor_t> stor{ 1, "kvstor_spill_test_compact.dat", std::chrono::milliseconds(1), 0.1 };
+
+    for (int i = 0; i < 100; ++i)
+    {
+        stor.push(0, std::string(100, 'a'));
+        stor.push(1, std::string(100, 'b'));
+    }
+
+    // the memory copy shadows the spilled one until it is spilled again
+    REQUIRE(stor.disk().size() == 2);
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (stor.disk().dead_bytes() > 0 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    REQUIRE(stor.disk().dead_bytes() == 0);
+    REQUIRE(stor.find(0).value() == std::string(100, 'a'));
+    REQUIRE(stor.find(1).value() == std::string(100, 'b'));
+}
+
+
+TEST_CASE("kvstor::tiered_storage_t concurrent access")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    kvstor::tiered_storage_t<stor_t> stor{ 16, "kvstor_spill_test_concurrent.dat", std::chrono::milliseconds(1) };
+
+    constexpr int keys = 200;
+    for (int key = 0; key < keys; ++key)
+        stor.push(key, key);
+
+    std::atomic<size_t> corrupted{ 0 };
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t)
+    {
+        workers.emplace_back([&stor, &corrupted, t]
+        {
+            for (int i = 0; i < 2000; ++i)
+            {
+                const int key = (i * 7 + t) % keys;
+                const auto found = stor.find(key);
+
+                // a spill in progress may hide the entry but never corrupt it
+                if (found && *found != key)
+                    ++corrupted;
+            }
+        });
+    }
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    REQUIRE(corrupted == 0);
+    REQUIRE(stor.spill_errors() == 0);
+    REQUIRE(stor.memory().size() + stor.disk().size() == keys);
+}
+
+
+TEST_CASE("kvstor::tiered_storage_t erase races with spills and promotions")
+{
+    using stor_t = kvstor::storage_t<int, int>;
+    kvstor::tiered_storage_t<stor_t> stor{ 2, "kvstor_spill_test_erase.dat", std::chrono::milliseconds(0) };
+
+    size_t resurrected = 0;
+
+    for (int round = 0; round < 500; ++round)
+    {
+        const int key = -1 - round;
+        stor.push(key, round);
+
+        // the fillers evict the key while it is erased
+        std::thread spiller([&stor, round]
+        {
+            for (int i = 0; i < 4; ++i)
+                stor.push(round * 4 + i, i);
+        });
+
+        stor.erase(key);
+        spiller.join();
+
+        if (stor.find(key))
+            ++resurrected;
+
+        // the key is on the disk now and is promoted while it is erased
+        stor.push(key, round);
+        for (int i = 0; i < 2; ++i)
+            stor.push(round * 4 + i, i);
+
+        std::thread promoter([&stor, key] { stor.find(key); });
+
+        stor.erase(key);
+        promoter.join();
+
+        if (stor.find(key))
+            ++resurrected;
+    }
+
+    REQUIRE(resurrected == 0);
+    REQUIRE(stor.spill_errors() == 0);
+}
@@ -3,9 +3,105 @@
 #include "kvstor.h"
 #include "doctest.h"
 
+#include <atomic>
+#include <functional>
 #include <future>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+template <class key_type, class value_type>
+struct lock_free_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    static constexpr bool lock_free_find = true;
+};
+
+
+template <class key_type, class value_type, bool lock_free = false>
+struct tinylfu_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    static constexpr bool lock_free_find = lock_free;
+    using admission_t = kvstor::tinylfu_admission_t;
+};
+
+
+template <class key_type, class value_type, bool lock_free = false>
+struct combining_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    static constexpr bool lock_free_find = lock_free;
+    static constexpr bool flat_combining = true;
+};
+
+
+template <class key_type, class value_type, bool lock_free = false>
+struct watermark_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    static constexpr bool lock_free_find = lock_free;
+    static constexpr size_t low_watermark = 75;
+};
+
+
+template <class key_type, bool lock_free>
+struct compressed_traits_t : kvstor::traits_t<key_type, std::string>
+{
+    static constexpr bool lock_free_find = lock_free;
+    using codec_t = kvstor::lz_codec_t;
+};
+
+
+std::atomic<size_t> counted_allocations{ 0 };
+
+
+template <class item_type>
+struct counting_alloc_t : std::allocator<item_type>
+{
+    template <class other_type>
+    struct rebind
+    {
+        using other = counting_alloc_t<other_type>;
+    };
+
+    counting_alloc_t() noexcept = default;
+
+    template <class other_type>
+    counting_alloc_t(const counting_alloc_t<other_type> &) noexcept {}
+
+    item_type * allocate(size_t count)
+    {
+        ++counted_allocations;
+        return std::allocator<item_type>::allocate(count);
+    }
+};
+
+
+template <class key_type, class value_type>
+struct versioned_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    static constexpr bool lock_free_find = true;
+    static constexpr size_t version_stripes = 16;
+};
+
+
+template <class key_type, class value_type>
+struct counting_alloc_traits_t : kvstor::traits_t<key_type, value_type>
+{
+    template <class item_type>
+    using alloc_t = counting_alloc_t<item_type>;
+};
+
+
+std::string json_value(int id)
+{
+    std::string value = "{\"id\": " + std::to_string(id) + ", \"items\": [";
+    for (int i = 0; i < 20; ++i)
+        value += "{\"name\": \"item\", \"price\": " + std::to_string(i % 3) + ", \"tags\": [\"a\", \"b\"]}, ";
+
+    return value + "]}";
+}
 
 
 TEST_CASE("kvstor zero size")
@@ -30,6 +126,20 @@ TEST_CASE("kvstor zero size")
 }
 
 
+TEST_CASE("kvstor custom allocator")
+{
+    kvstor::storage_t<int, std::string, counting_alloc_traits_t<int, std::string>> stor{ 4 };
+
+    const size_t before = counted_allocations;
+    stor.push(1, "10");
+    stor.push(2, "20");
+
+    // a list node and an index node per entry
+    REQUIRE(counted_allocations >= before + 4);
+    REQUIRE(stor.find(2).value() == "20");
+}
+
+
 TEST_CASE("kvstor::push()")
 {
     kvstor::storage_t<int, std::string> stor{ 4 };
@@ -67,6 +177,78 @@ TEST_CASE("kvstor::push()")
 }
 
 
+struct counted_key_t
+{
+    explicit counted_key_t(int value_) : value(value_) {}
+    counted_key_t(const counted_key_t & other) : value(other.value) { ++copies; }
+
+    bool operator==(const counted_key_t & other) const { mismatches += value != other.value; return value == other.value; }
+
+    int value;
+    static inline size_t copies = 0;
+    static inline size_t hashes = 0;
+    static inline size_t mismatches = 0;
+};
+
+
+template <bool lock_free = false>
+struct counted_key_traits_t : kvstor::traits_t<counted_key_t, int>
+{
+    struct hash_t
+    {
+        size_t operator()(const counted_key_t & key) const { ++counted_key_t::hashes; return std::hash<int>{}(key.value); }
+    };
+
+    static constexpr bool lock_free_find = lock_free;
+};
+
+
+TEST_CASE("kvstor stores every key once")
+{
+    using key_t = counted_key_t;
+    using stor_t = kvstor::storage_t<key_t, int, counted_key_traits_t<>>;
+    stor_t stor{ 2 };
+
+    stor.push(key_t{ 1 }, 10);
+    stor.push(key_t{ 2 }, 20);
+    REQUIRE(key_t::copies == 2);
+
+    // updates reuse the entry and its key
+    stor.push(key_t{ 1 }, 11);
+    REQUIRE(key_t::copies == 2);
+    REQUIRE(stor.first().value() == 11);
+    REQUIRE(stor.last().value() == 20);
+
+    stor.push(key_t{ 3 }, 30);
+    REQUIRE(key_t::copies == 3);
+    REQUIRE(!stor.contains(key_t{ 2 }));
+    REQUIRE(stor.find(key_t{ 1 }).value() == 11);
+}
+
+
+TEST_CASE_TEMPLATE("kvstor hashes every key once", traits_type, counted_key_traits_t<false>, counted_key_traits_t<true>)
+{
+    using stor_t = kvstor::storage_t<counted_key_t, int, traits_type>;
+    stor_t stor{ 100 };
+
+    counted_key_t::hashes = 0;
+    counted_key_t::mismatches = 0;
+
+    // index growth and evictions reuse the cached hashes, different hashes are never compared by keys
+    for (int key = 0; key < 1000; ++key)
+        stor.push(counted_key_t{ key }, key);
+
+    REQUIRE(counted_key_t::hashes == 1000);
+    REQUIRE(stor.size() == 100);
+
+    stor.erase(counted_key_t{ 999 });
+    REQUIRE(!stor.find(counted_key_t{ 999 }));
+    REQUIRE(stor.find(counted_key_t{ 998 }).value() == 998);
+    REQUIRE(counted_key_t::hashes == 1003);
+    REQUIRE(counted_key_t::mismatches == 0);
+}
+
+
 TEST_CASE("kvstor::compare_exchange()")
 {
     kvstor::storage_t<int, std::string> stor{ 4 };
@@ -133,6 +315,231 @@ TEST_CASE("kvstor::erase()")
 }
 
 
+TEST_CASE("kvstor::find() with age")
+{
+    using stor_t = kvstor::storage_t<int, std::string>;
+    stor_t stor{ 4 };
+
+    stor_t::duration_t age = stor_t::duration_t::max();
+    REQUIRE(!stor.find(1, age));
+    REQUIRE(age == stor_t::duration_t::max());
+
+    stor.push(1, "10");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    REQUIRE(stor.find(1, age).value() == "10");
+    REQUIRE(age >= std::chrono::milliseconds(20));
+
+    // update resets the age
+    stor.push(1, "11");
+
+    stor_t::duration_t new_age{};
+    REQUIRE(stor.find(1, new_age).value() == "11");
+    REQUIRE(new_age < age);
+}
+
+
+TEST_CASE("kvstor::newest() / oldest() / pop_oldest()")
+{
+    using arr_t = std::vector<std::pair<int, std::string>>;
+    using stor_t = kvstor::storage_t<int, std::string>;
+
+    stor_t stor{ 10 };
+    REQUIRE(stor.newest(3).empty());
+    REQUIRE(stor.oldest(3).empty());
+    REQUIRE(stor.pop_oldest(3).empty());
+
+    for (int key = 1; key <= 5; ++key)
+        stor.push(key, std::to_string(10 * key));
+
+    REQUIRE(stor.newest(2) == arr_t{ {5, "50"}, {4, "40"}, });
+    REQUIRE(stor.oldest(2) == arr_t{ {1, "10"}, {2, "20"}, });
+    REQUIRE(stor.newest(0).empty());
+    REQUIRE(stor.oldest(10).size() == 5);
+    REQUIRE(stor.size() == 5);
+
+    REQUIRE(stor.pop_oldest(2) == arr_t{ {1, "10"}, {2, "20"}, });
+    REQUIRE(stor.size() == 3);
+    REQUIRE(!stor.contains(1));
+    REQUIRE(!stor.contains(2));
+    REQUIRE(stor.last().value() == "30");
+
+    REQUIRE(stor.pop_oldest(10) == arr_t{ {3, "30"}, {4, "40"}, {5, "50"}, });
+    REQUIRE(stor.empty());
+    REQUIRE(!stor.first());
+}
+
+
+TEST_CASE("kvstor lock-free pop_oldest()")
+{
+    using stor_t = kvstor::storage_t<int, int, lock_free_traits_t<int, int>>;
+    stor_t stor{ 10 };
+
+    for (int key = 1; key <= 5; ++key)
+        stor.push(key, key);
+
+    REQUIRE(stor.pop_oldest(3).size() == 3);
+    REQUIRE(!stor.find(1));
+    REQUIRE(!stor.find(3));
+    REQUIRE(stor.find(4).value() == 4);
+}
+
+
+TEST_CASE("kvstor::on_evict()")
+{
+    using arr_t = std::vector<std::pair<int, std::string>>;
+    using stor_t = kvstor::storage_t<int, std::string>;
+
+    stor_t stor{ 2 };
+    arr_t evicted;
+
+    stor.on_evict([&evicted, &stor](int && key, std::string && value)
+    {
+        // the handler runs outside the storage lock
+        REQUIRE(stor.size() == 2);
+        evicted.emplace_back(key, std::move(value));
+    });
+
+    stor.push(1, "10");
+    stor.push(2, "20");
+    REQUIRE(evicted.empty());
+
+    stor.push(3, "30");
+    REQUIRE(evicted == arr_t{ {1, "10"}, });
+
+    std::optional<std::string> expected;
+    REQUIRE(stor.compare_exchange(4, "40", expected));
+    REQUIRE(evicted == arr_t{ {1, "10"}, {2, "20"}, });
+
+    // replacement and erase are not evictions
+    stor.push(4, "41");
+    stor.erase(3);
+    REQUIRE(evicted.size() == 2);
+
+    stor.on_evict(nullptr);
+    stor.push(5, "50");
+    stor.push(6, "60");
+    REQUIRE(evicted.size() == 2);
+}
+
+
+TEST_CASE("kvstor::tinylfu_admission_t")
+{
+    kvstor::tinylfu_admission_t admission{ 64 };
+    REQUIRE(admission.estimate(1) == 0);
+
+    // the first access only passes the doorkeeper
+    admission.record(1);
+    REQUIRE(admission.estimate(1) == 1);
+
+    for (size_t i = 0; i < 10; ++i)
+        admission.record(1);
+
+    REQUIRE(admission.estimate(1) == 11);
+    REQUIRE(admission.admit(1, 2));
+    REQUIRE(!admission.admit(2, 1));
+    REQUIRE(!admission.admit(2, 3));
+
+    admission.age();
+    REQUIRE(admission.estimate(1) == 5);
+
+    // counters saturate and are halved after 10 * max_size accesses
+    kvstor::tinylfu_admission_t aging{ 64 };
+    for (size_t i = 0; i < 640; ++i)
+        aging.record(5);
+
+    REQUIRE(aging.estimate(5) == 7);
+}
+
+
+TEST_CASE_TEMPLATE("kvstor admission protects frequent entries", traits_type,
+    tinylfu_traits_t<int, int>, tinylfu_traits_t<int, int, true>)
+{
+    using stor_t = kvstor::storage_t<int, int, traits_type>;
+    stor_t stor{ 10 };
+
+    std::vector<int> evicted;
+    stor.on_evict([&evicted](int && key, int &&) { evicted.push_back(key); });
+
+    std::vector<int> rejected;
+    stor.on_reject([&rejected](int && key, int &&) { rejected.push_back(key); });
+
+    for (int round = 0; round < 5; ++round)
+    {
+        for (int key = 0; key < 10; ++key)
+        {
+            stor.push(key, key);
+            REQUIRE(stor.find(key).value() == key);
+        }
+    }
+
+    // one-hit wonders are rejected, they were never stored and are not reported as evicted
+    for (int key = 100; key < 200; ++key)
+        stor.push(key, key);
+
+    REQUIRE(stor.size() == 10);
+    REQUIRE(evicted.empty());
+    REQUIRE(rejected.size() == 100);
+    REQUIRE(rejected.front() == 100);
+    REQUIRE(stor.rejected() == 100);
+
+    for (int key = 0; key < 10; ++key)
+        REQUIRE(stor.find(key).value() == key);
+
+    // a key requested more often than the working set is admitted
+    for (int i = 0; i < 30; ++i)
+        REQUIRE(!stor.find(500));
+
+    stor.push(500, 500);
+    REQUIRE(stor.find(500).value() == 500);
+    REQUIRE(evicted == std::vector<int>{ 0 });
+    REQUIRE(stor.rejected() == 100);
+    REQUIRE(stor.size() == 10);
+
+    // updates of present keys are never rejected
+    stor.push(1, 11);
+    REQUIRE(stor.find(1).value() == 11);
+}
+
+
+TEST_CASE("kvstor::contains() / count() / age() / peek()")
+{
+    using stor_t = kvstor::storage_t<int, std::string>;
+    stor_t stor{ 3 };
+
+    REQUIRE(!stor.contains(1));
+    REQUIRE(stor.count(1) == 0);
+    REQUIRE(!stor.age(1));
+    REQUIRE(!stor.peek(1, [](const std::string &) { FAIL("unexpected call"); }));
+
+    stor.push(1, "10");
+    stor.push(2, "20");
+    stor.push(3, "30");
+    REQUIRE(stor.contains(1));
+    REQUIRE(stor.count(2) == 1);
+    REQUIRE(stor.age(3).value() >= stor_t::duration_t::zero());
+
+    size_t length = 0;
+    REQUIRE(stor.peek(2, [&length](const std::string & value) { length = value.size(); }));
+    REQUIRE(length == 2);
+
+    // probes do not change the order of entries
+    stor.push(4, "40");
+    REQUIRE(!stor.contains(1));
+    REQUIRE(stor.last().value() == "20");
+
+    const std::vector<int> keys = { 1, 2, 3, 4, 5 };
+    REQUIRE(stor.contains(keys) == std::vector<bool>{ false, true, true, true, false });
+    REQUIRE(stor.count(keys) == 3);
+
+    const auto ages = stor.age(keys);
+    REQUIRE(ages.size() == keys.size());
+    REQUIRE(!ages[0]);
+    REQUIRE(ages[1].value() >= ages[3].value());
+    REQUIRE(!ages[4]);
+}
+
+
 TEST_CASE("kvstor::first()")
 {
     kvstor::storage_t<size_t, std::string> stor{ 10 };
@@ -254,6 +661,183 @@ TEST_CASE("kvstor::map()")
 }
 
 
+TEST_CASE("kvstor::for_each() / for_each_while()")
+{
+    using list_t = std::list<std::pair<int, int>>;
+    using stor_t = kvstor::storage_t<int, int>;
+
+    stor_t stor{ 10 };
+    stor.push(1, 10);
+    stor.push(2, 20);
+    stor.push(3, 30);
+    stor.push(4, 40);
+
+    list_t data;
+    const stor_t & const_stor = stor;
+    const_stor.for_each([&data](int key, const int & value) { data.emplace_back(key, value); });
+    REQUIRE(data == list_t{ {4, 40}, {3, 30}, {2, 20}, {1, 10}, });
+
+    stor.for_each([](int, int & value) { value += 1; });
+    REQUIRE(stor.find(1).value() == 11);
+    REQUIRE(stor.find(4).value() == 41);
+
+    // early exit after the second entry
+    size_t visited = 0;
+    const bool completed = const_stor.for_each_while([&visited](int key, const int &)
+    {
+        ++visited;
+        return key != 3;
+    });
+    REQUIRE(!completed);
+    REQUIRE(visited == 2);
+
+    visited = 0;
+    REQUIRE(stor.for_each_while([&visited](int, int & value) { ++visited; value = 0; return visited < 3; }) == false);
+    REQUIRE(stor.find(4).value() == 0);
+    REQUIRE(stor.find(2).value() == 0);
+    REQUIRE(stor.find(1).value() == 11);
+
+    REQUIRE(stor.for_each_while([](int, int &) { return true; }));
+}
+
+
+TEST_CASE("kvstor read-only traversals of a mutable storage")
+{
+    using stor_t = kvstor::storage_t<int, int, versioned_traits_t<int, int>>;
+
+    auto read = [](int, const int &) {};
+    auto read_while = [](int, const int &) { return true; };
+    auto write = [](int, int & value) { ++value; };
+
+    static_assert(kvstor::read_only_visitor_t<decltype(read), int, int>::value);
+    static_assert(kvstor::read_only_visitor_t<std::function<void (const int &, const int &)>, int, int>::value);
+    static_assert(!kvstor::read_only_visitor_t<decltype(write), int, int>::value);
+    static_assert(!kvstor::read_only_visitor_t<std::function<void (const int &, int &)>, int, int>::value);
+
+    stor_t stor{ 10 };
+    stor.push(1, 10);
+    stor.push(2, 20);
+
+    // read-only visitors neither encode the values back nor republish them
+    const uint64_t version = stor.version(1);
+    stor.map(read);
+    stor.for_each(read);
+    REQUIRE(stor.for_each_while(read_while));
+    stor.parallel_for_each(read, 2);
+    REQUIRE(stor.version(1) == version);
+
+    stor.for_each(write);
+    REQUIRE(stor.version(1) != version);
+    REQUIRE(stor.find(1).value() == 11);
+}
+
+
+TEST_CASE("kvstor::parallel_for_each()")
+{
+    constexpr size_t count = 10001;
+    using stor_t = kvstor::storage_t<size_t, size_t>;
+
+    stor_t stor{ count };
+    for (size_t key = 0; key < count; ++key)
+        stor.push(key, key);
+
+    for (size_t threads : { 0, 1, 3, 8 })
+    {
+        std::atomic<size_t> sum{ 0 };
+        std::atomic<size_t> visited{ 0 };
+
+        const stor_t & const_stor = stor;
+        const_stor.parallel_for_each([&sum, &visited](size_t, const size_t & value)
+        {
+            sum += value;
+            ++visited;
+        }, threads);
+
+        REQUIRE(visited == count);
+        REQUIRE(sum == count * (count - 1) / 2);
+    }
+
+    stor.parallel_for_each([](size_t, size_t & value) { value *= 2; }, 4);
+    REQUIRE(stor.find(0).value() == 0);
+    REQUIRE(stor.find(count - 1).value() == 2 * (count - 1));
+
+    auto fail = [](size_t key, size_t &)
+    {
+        if (key == count / 2)
+            throw std::runtime_error("visitor failed");
+    };
+    REQUIRE_THROWS_AS(stor.parallel_for_each(fail, 4), std::runtime_error);
+
+    stor_t empty{ 10 };
+    empty.parallel_for_each([](size_t, size_t &) { FAIL("unexpected call"); });
+}
+
+
+TEST_CASE("kvstor::next() with cursor")
+{
+    using arr_t = std::vector<std::pair<int, int>>;
+    using stor_t = kvstor::storage_t<int, int>;
+
+    stor_t stor{ 10 };
+
+    stor_t::cursor_t empty_cursor;
+    REQUIRE(stor.next(empty_cursor, 10).empty());
+    REQUIRE(empty_cursor.done());
+
+    for (int key = 1; key <= 7; ++key)
+        stor.push(key, 10 * key);
+
+    stor_t::cursor_t cursor;
+    REQUIRE(!cursor.done());
+    REQUIRE(stor.next(cursor, 0).empty());
+
+    REQUIRE(stor.next(cursor, 3) == arr_t{ {7, 70}, {6, 60}, {5, 50}, });
+    REQUIRE(!cursor.done());
+
+    REQUIRE(stor.next(cursor, 3) == arr_t{ {4, 40}, {3, 30}, {2, 20}, });
+    REQUIRE(!cursor.done());
+
+    REQUIRE(stor.next(cursor, 3) == arr_t{ {1, 10}, });
+    REQUIRE(cursor.done());
+    REQUIRE(stor.next(cursor, 3).empty());
+
+    // the whole storage in one batch
+    stor_t::cursor_t all;
+    REQUIRE(stor.next(all, 7) == stor.dump());
+    REQUIRE(all.done());
+}
+
+
+TEST_CASE("kvstor::next() with concurrent modifications")
+{
+    using arr_t = std::vector<std::pair<int, int>>;
+    using stor_t = kvstor::storage_t<int, int>;
+
+    stor_t stor{ 20 };
+    for (int key = 1; key <= 10; ++key)
+        stor.push(key, 10 * key);
+
+    stor_t::cursor_t cursor;
+    REQUIRE(stor.next(cursor, 3) == arr_t{ {10, 100}, {9, 90}, {8, 80}, });
+
+    // the last returned entry is erased, new and already returned entries move to the front
+    stor.erase(8);
+    stor.push(11, 110);
+    stor.push(10, 101);
+    REQUIRE(stor.next(cursor, 2) == arr_t{ {7, 70}, {6, 60}, });
+
+    // all anchors are gone
+    stor.erase(7);
+    stor.erase(6);
+    REQUIRE(stor.next(cursor, 2) == arr_t{ {5, 50}, {4, 40}, });
+
+    // an entry changed ahead of the cursor moves behind it
+    stor.push(2, 21);
+    REQUIRE(stor.next(cursor, 10) == arr_t{ {3, 30}, {1, 10}, });
+    REQUIRE(cursor.done());
+}
+
+
 TEST_CASE("kvstor::dump()")
 {
     using arr_t = std::vector<std::pair<int, int>>;
@@ -346,39 +930,232 @@ TEST_CASE("kvstor::build_from_dump()")
 }
 
 
-TEST_CASE("kvstor thread-safe")
+TEST_CASE("kvstor::fast_hash_t")
 {
-    constexpr size_t max_count = 20000;
-    constexpr size_t count_25_percent = max_count / 4;
-    constexpr size_t count_50_percent = max_count / 2;
-    constexpr size_t count_75_percent = 3 * max_count / 4;
-    constexpr size_t value_factor = 100;
+    const kvstor::fast_hash_t hash;
 
-    using stor_t = kvstor::storage_t<size_t, size_t>;
-    stor_t stor{ max_count };
+    REQUIRE(hash(42) == hash(42ull));
+    REQUIRE(hash(42) != hash(43));
+    REQUIRE(hash(std::string("key")) == hash(std::string_view("key")));
+    REQUIRE(hash(std::string("key")) == hash("key"));
+    REQUIRE(hash(std::string("")) != hash(std::string(1, '\0')));
 
-    auto fill_storage = [](stor_t & stor, size_t first, size_t last, size_t value_factor)
+    // every length path and every byte of the input changes the result
+    std::string bytes(200, 'x');
+    for (size_t size = 0; size <= bytes.size(); ++size)
     {
-        for (size_t key = first; key < last; ++key)
+        const std::string_view prefix{ bytes.data(), size };
+        const size_t base = hash(prefix);
+        REQUIRE(base != hash(std::string_view{ bytes.data(), size + 1 }));
+
+        for (size_t i = 0; i < size; ++i)
         {
-            const size_t value = value_factor * key;
-            stor.push(key, value);
+            std::string changed{ prefix };
+            changed[i] = 'y';
+            REQUIRE(hash(changed) != base);
         }
-    };
+    }
 
-    auto f1 = std::async(std::launch::async, fill_storage, std::ref(stor), 0, count_25_percent, value_factor);
-    auto f2 = std::async(std::launch::async, fill_storage, std::ref(stor), count_25_percent, count_50_percent, value_factor);
-    auto f3 = std::async(std::launch::async, fill_storage, std::ref(stor), count_50_percent, count_75_percent, value_factor);
-    auto f4 = std::async(std::launch::async, fill_storage, std::ref(stor), count_75_percent, max_count, value_factor);
+    // strided integers spread over the low bits used by power-of-two tables
+    constexpr size_t buckets = 1024;
+    std::vector<size_t> load(buckets);
+    for (uint64_t key = 0; key < buckets * 8; ++key)
+        ++load[hash(key * buckets) & (buckets - 1)];
 
-    f1.wait();
-    f2.wait();
-    f3.wait();
-    f4.wait();
+    REQUIRE(*std::max_element(load.begin(), load.end()) < 32);
+}
 
-    REQUIRE(stor.size() == max_count);
 
-    for (size_t key = 0; key < max_count; ++key)
+template <class key_type, class value_type>
+struct fast_lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+{
+    static constexpr bool lock_free_find = true;
+};
+
+
+TEST_CASE_TEMPLATE("kvstor fast hash traits", traits_type,
+    kvstor::fast_hash_traits_t<std::string, int>, fast_lock_free_traits_t<std::string, int>)
+{
+    kvstor::storage_t<std::string, int, traits_type> stor{ 100 };
+
+    for (int i = 0; i < 1000; ++i)
+        stor.push("key" + std::to_string(i), i);
+
+    REQUIRE(stor.size() == 100);
+    REQUIRE(!stor.find("key0"));
+    REQUIRE(stor.find("key999").value() == 999);
+    REQUIRE(stor.contains("key900"));
+}
+
+
+TEST_CASE("kvstor::lz_codec_t")
+{
+    using codec_t = kvstor::lz_codec_t;
+
+    std::string random(1000, '\0');
+    uint32_t seed = 1;
+    for (char & c : random)
+    {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<char>(seed >> 24);
+    }
+
+    const std::vector<std::string> values
+    {
+        "",
+        "a",
+        "short value",
+        std::string(100000, 'x'),
+        std::string(300, '\0'),
+        json_value(1),
+        random,
+        random + random,
+    };
+
+    for (const std::string & value : values)
+    {
+        const std::string stored = codec_t::encode(std::string(value));
+        REQUIRE(codec_t::decode(stored) == value);
+        REQUIRE(codec_t::weight(stored) == stored.size());
+        REQUIRE(stored.size() <= value.size() + 1);
+    }
+
+    REQUIRE(codec_t::encode(std::string(100000, 'x')).size() < 1000);
+    REQUIRE(codec_t::encode(json_value(1)).size() * 4 < json_value(1).size());
+
+    // truncated or damaged values are rejected
+    const std::string stored = codec_t::encode(json_value(2));
+    REQUIRE_THROWS(codec_t::decode(""));
+    REQUIRE_THROWS(codec_t::decode("\x7F"));
+    REQUIRE_THROWS(codec_t::decode("\x01\xFF\xFF\xFF\xFF\x0F"));
+    REQUIRE_THROWS(codec_t::decode(stored.substr(0, stored.size() / 2)));
+    REQUIRE_THROWS(codec_t::decode(stored + "tail"));
+}
+
+
+TEST_CASE("kvstor compressed values")
+{
+    using stor_t = kvstor::storage_t<int, std::string, compressed_traits_t<int, false>>;
+
+    const size_t entry_weight = kvstor::lz_codec_t::encode(json_value(100)).size();
+    REQUIRE(entry_weight * 4 < json_value(100).size());
+
+    // max_size is a byte budget of compressed values
+    stor_t stor{ entry_weight * 10 + entry_weight / 2 };
+
+    for (int id = 100; id < 120; ++id)
+        stor.push(id, json_value(id));
+
+    REQUIRE(stor.size() == 10);
+    REQUIRE(stor.weight() <= stor.max_size());
+    REQUIRE(!stor.find(109));
+    REQUIRE(stor.find(110).value() == json_value(110));
+    REQUIRE(stor.first().value() == json_value(119));
+    REQUIRE(stor.last().value() == json_value(110));
+    REQUIRE(stor.newest(1).front().second == json_value(119));
+
+    bool peeked = false;
+    REQUIRE(stor.peek(115, [&peeked](const std::string & value) { peeked = value == json_value(115); }));
+    REQUIRE(peeked);
+
+    std::optional<std::string> expected = json_value(0);
+    REQUIRE(!stor.compare_exchange(115, "new", expected));
+    REQUIRE(expected.value() == json_value(115));
+    REQUIRE(stor.compare_exchange(115, "new", expected));
+    REQUIRE(stor.find(115).value() == "new");
+
+    // values changed in place are encoded back
+    stor.for_each([](const int &, std::string & value) { value += "!"; });
+    REQUIRE(stor.find(115).value() == "new!");
+    REQUIRE(stor.find(119).value() == json_value(119) + "!");
+
+    size_t weight = 0;
+    for (const auto & [key, value] : stor.dump())
+        weight += kvstor::lz_codec_t::encode(std::string(value)).size();
+    REQUIRE(stor.weight() == weight);
+
+    std::vector<std::string> evicted;
+    stor.on_evict([&evicted](int &&, std::string && value) { evicted.push_back(std::move(value)); });
+
+    // a single heavy entry evicts as many entries as needed
+    std::string heavy(entry_weight * 5, '\0');
+    uint32_t seed = 1;
+    for (char & c : heavy)
+    {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<char>(seed >> 24);
+    }
+
+    stor.push(200, heavy);
+    REQUIRE(evicted.size() > 1);
+    REQUIRE(evicted.front() == json_value(110) + "!");
+    REQUIRE(stor.find(200).value() == heavy);
+    REQUIRE(stor.weight() <= stor.max_size());
+
+    stor.erase(200);
+    REQUIRE(stor.weight() < entry_weight * 10);
+
+    stor.clear();
+    REQUIRE(stor.weight() == 0);
+}
+
+
+TEST_CASE("kvstor lock-free compressed values")
+{
+    using stor_t = kvstor::storage_t<int, std::string, compressed_traits_t<int, true>>;
+    stor_t stor{ 1 << 20 };
+
+    for (int id = 0; id < 100; ++id)
+        stor.push(id, json_value(id));
+
+    for (int id = 0; id < 100; ++id)
+        REQUIRE(stor.find(id).value() == json_value(id));
+
+    stor_t::duration_t age{};
+    REQUIRE(stor.find(5, age).value() == json_value(5));
+    REQUIRE(stor.contains(7));
+    REQUIRE(stor.peek(8, [](const std::string & value) { REQUIRE(value == json_value(8)); }));
+
+    // the weight of the default codec is the number of entries
+    kvstor::storage_t<int, std::string> plain{ 10 };
+    plain.push(1, json_value(1));
+    REQUIRE(plain.weight() == 1);
+}
+
+
+TEST_CASE("kvstor thread-safe")
+{
+    constexpr size_t max_count = 20000;
+    constexpr size_t count_25_percent = max_count / 4;
+    constexpr size_t count_50_percent = max_count / 2;
+    constexpr size_t count_75_percent = 3 * max_count / 4;
+    constexpr size_t value_factor = 100;
+
+    using stor_t = kvstor::storage_t<size_t, size_t>;
+    stor_t stor{ max_count };
+
+    auto fill_storage = [](stor_t & stor, size_t first, size_t last, size_t value_factor)
+    {
+        for (size_t key = first; key < last; ++key)
+        {
+            const size_t value = value_factor * key;
+            stor.push(key, value);
+        }
+    };
+
+    auto f1 = std::async(std::launch::async, fill_storage, std::ref(stor), 0, count_25_percent, value_factor);
+    auto f2 = std::async(std::launch::async, fill_storage, std::ref(stor), count_25_percent, count_50_percent, value_factor);
+    auto f3 = std::async(std::launch::async, fill_storage, std::ref(stor), count_50_percent, count_75_percent, value_factor);
+    auto f4 = std::async(std::launch::async, fill_storage, std::ref(stor), count_75_percent, max_count, value_factor);
+
+    f1.wait();
+    f2.wait();
+    f3.wait();
+    f4.wait();
+
+    REQUIRE(stor.size() == max_count);
+
+    for (size_t key = 0; key < max_count; ++key)
     {
         const size_t expected = value_factor * key;
         const auto found = stor.find(key);
@@ -392,3 +1169,722 @@ TEST_CASE("kvstor thread-safe")
     const auto not_found = stor.find(max_count);
     REQUIRE(!stor.find(max_count).has_value());
 }
+
+
+TEST_CASE("kvstor cache line alignment")
+{
+    using stor_t = kvstor::storage_t<size_t, size_t>;
+    using lock_free_stor_t = kvstor::storage_t<size_t, size_t, lock_free_traits_t<size_t, size_t>>;
+
+    static_assert(alignof(stor_t) == kvstor::cache_line_size);
+    static_assert(alignof(lock_free_stor_t) == kvstor::cache_line_size);
+
+    // adjacent and heap allocated storages do not share lines
+    const stor_t stors[2] = { stor_t{ 10 }, stor_t{ 10 } };
+    const auto allocated = std::make_unique<stor_t>(10);
+
+    REQUIRE(reinterpret_cast<uintptr_t>(&stors[1]) % kvstor::cache_line_size == 0);
+    REQUIRE(reinterpret_cast<uintptr_t>(allocated.get()) % kvstor::cache_line_size == 0);
+
+    // size() polled while the writers push
+    lock_free_stor_t stor{ 4000 };
+    std::atomic<bool> done{ false };
+    std::atomic<size_t> errors{ 0 };
+
+    auto poll = std::async(std::launch::async, [&stor, &done, &errors]
+    {
+        while (!done)
+        {
+            if (stor.size() > 4000)
+                ++errors;
+        }
+    });
+
+    auto fill = [&stor](size_t first)
+    {
+        for (size_t key = first; key < first + 2000; ++key)
+            stor.push(key, key);
+    };
+
+    auto f1 = std::async(std::launch::async, fill, 0);
+    auto f2 = std::async(std::launch::async, fill, 2000);
+    f1.wait();
+    f2.wait();
+
+    done = true;
+    poll.wait();
+
+    REQUIRE(errors == 0);
+    REQUIRE(stor.size() == 4000);
+}
+
+
+TEST_CASE("kvstor batch push()")
+{
+    kvstor::storage_t<int, std::string> stor{ 3 };
+    std::vector<int> evicted;
+    stor.on_evict([&evicted](int && key, std::string &&) { evicted.push_back(key); });
+
+    stor.push(1, "10");
+
+    // applied in order, a repeated key keeps the last value; trimmed once at the end
+    stor.push({ { 2, "20" }, { 3, "30" }, { 2, "22" }, { 4, "40" }, { 5, "50" } });
+    REQUIRE(stor.size() == 3);
+    REQUIRE(evicted == std::vector<int>{ 1, 3 });
+    REQUIRE(stor.find(2).value() == "22");
+    REQUIRE(stor.find(4).value() == "40");
+    REQUIRE(stor.find(5).value() == "50");
+    REQUIRE(stor.first().value() == "50");
+
+    stor.push({});
+    REQUIRE(stor.size() == 3);
+}
+
+
+TEST_CASE_TEMPLATE("kvstor low watermark eviction", traits_type,
+    watermark_traits_t<int, int>, watermark_traits_t<int, int, true>)
+{
+    using stor_t = kvstor::storage_t<int, int, traits_type>;
+
+    stor_t stor{ 8 };
+    std::vector<int> evicted;
+    stor.on_evict([&evicted](int && key, int &&) { evicted.push_back(key); });
+
+    for (int i = 0; i < 8; ++i)
+        stor.push(i, i);
+
+    REQUIRE(stor.size() == 8);
+    REQUIRE(evicted.empty());
+
+    // exceeding max_size evicts down to 6 entries in one pass
+    stor.push(8, 8);
+    REQUIRE(stor.size() == 6);
+    REQUIRE(evicted == std::vector<int>{ 0, 1, 2 });
+    REQUIRE(!stor.contains(2));
+    REQUIRE(stor.find(3).value() == 3);
+    REQUIRE(stor.find(8).value() == 8);
+
+    // the next pushes fit without eviction
+    stor.push(9, 9);
+    stor.push(10, 10);
+    REQUIRE(stor.size() == 8);
+    REQUIRE(evicted.size() == 3);
+
+    // trim() does the same pass in advance
+    REQUIRE(stor.trim() == 2);
+    REQUIRE(stor.size() == 6);
+    REQUIRE(evicted == std::vector<int>{ 0, 1, 2, 3, 4 });
+    REQUIRE(stor.trim() == 0);
+
+    stor.push(11, 11);
+    stor.push(12, 12);
+    REQUIRE(stor.size() == 8);
+    REQUIRE(evicted.size() == 5);
+}
+
+
+TEST_CASE_TEMPLATE("kvstor expire()", traits_type, kvstor::traits_t<int, int>, lock_free_traits_t<int, int>)
+{
+    using stor_t = kvstor::storage_t<int, int, traits_type>;
+
+    stor_t stor{ 10 };
+    std::vector<int> expired;
+    stor.on_evict([&expired](int && key, int &&) { expired.push_back(key); });
+
+    stor.push(1, 1);
+    stor.push(2, 2);
+    stor.push(3, 3);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+
+    // an update renews the entry
+    stor.push(2, 22);
+
+    REQUIRE(stor.expire(std::chrono::milliseconds(20), 1) == 1);
+    REQUIRE(expired == std::vector<int>{ 1 });
+
+    REQUIRE(stor.expire(std::chrono::milliseconds(20)) == 1);
+    REQUIRE(expired == std::vector<int>{ 1, 3 });
+    REQUIRE(!stor.find(3));
+    REQUIRE(stor.find(2).value() == 22);
+    REQUIRE(stor.size() == 1);
+
+    REQUIRE(stor.expire(std::chrono::milliseconds(20)) == 0);
+}
+
+
+TEST_CASE("kvstor trim() without low watermark")
+{
+    kvstor::storage_t<int, int> stor{ 3 };
+    for (int i = 0; i < 5; ++i)
+        stor.push(i, i);
+
+    REQUIRE(stor.trim() == 0);
+    REQUIRE(stor.size() == 3);
+
+    // the newest entry is kept whatever the watermark
+    kvstor::storage_t<int, int, watermark_traits_t<int, int>> single{ 1 };
+    single.push(1, 1);
+    single.push(2, 2);
+    REQUIRE(single.size() == 1);
+    REQUIRE(single.find(2).value() == 2);
+    REQUIRE(single.trim() == 0);
+}
+
+
+TEST_CASE_TEMPLATE("kvstor flat combining", traits_type,
+    combining_traits_t<int, std::string>, combining_traits_t<int, std::string, true>)
+{
+    using stor_t = kvstor::storage_t<int, std::string, traits_type>;
+    static_assert(stor_t::flat_combining);
+
+    stor_t stor{ 3 };
+    std::vector<int> evicted;
+    stor.on_evict([&evicted](int && key, std::string &&) { evicted.push_back(key); });
+
+    stor.push(1, "10");
+    stor.push(2, "20");
+    stor.push(3, "30");
+    stor.push(4, "40");
+    REQUIRE(stor.size() == 3);
+    REQUIRE(!stor.find(1));
+    REQUIRE(evicted == std::vector<int>{ 1 });
+
+    std::optional<std::string> expected = std::string("20");
+    REQUIRE(stor.compare_exchange(2, "22", expected));
+    REQUIRE(stor.find(2).value() == "22");
+
+    expected = std::string("20");
+    REQUIRE(!stor.compare_exchange(2, "23", expected));
+    REQUIRE(expected.value() == "22");
+
+    stor.erase(3);
+    stor.erase(5);
+    REQUIRE(!stor.find(3));
+    REQUIRE(stor.size() == 2);
+    REQUIRE(stor.first().value() == "22");
+}
+
+
+TEST_CASE_TEMPLATE("kvstor flat combining thread-safe", traits_type,
+    combining_traits_t<size_t, size_t>, combining_traits_t<size_t, size_t, true>)
+{
+    using stor_t = kvstor::storage_t<size_t, size_t, traits_type>;
+
+    constexpr size_t threads = 8;
+    constexpr size_t keys = 1000;
+    constexpr size_t capacity = 500;
+
+    stor_t stor{ capacity };
+    std::atomic<size_t> evictions{ 0 };
+    stor.on_evict([&evictions](size_t &&, size_t &&) { ++evictions; });
+
+    // every thread owns the keys equal to its number modulo threads
+    auto writer = [&stor](size_t thread)
+    {
+        for (size_t round = 0; round < 3; ++round)
+        {
+            for (size_t key = thread; key < keys; key += threads)
+                stor.push(key, key * 10);
+        }
+
+        for (size_t key = thread; key < keys; key += 2 * threads)
+            stor.erase(key);
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t thread = 0; thread < threads; ++thread)
+        workers.emplace_back(writer, thread);
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    REQUIRE(stor.size() <= capacity);
+
+    size_t found = 0;
+    stor.for_each([&found](const size_t & key, const size_t & value)
+    {
+        REQUIRE(value == key * 10);
+        ++found;
+    });
+
+    REQUIRE(found == stor.size());
+
+    // a shared counter advanced by compare_exchange() loses no increments
+    stor.clear();
+    stor.push(0, 0);
+
+    workers.clear();
+    for (size_t thread = 0; thread < threads; ++thread)
+    {
+        workers.emplace_back([&stor]
+        {
+            for (size_t i = 0; i < 500; ++i)
+            {
+                std::optional<size_t> expected = stor.find(0);
+                while (!stor.compare_exchange(0, expected.value() + 1, expected))
+                    ;
+            }
+        });
+    }
+
+    for (std::thread & worker : workers)
+        worker.join();
+
+    REQUIRE(stor.find(0).value() == threads * 500);
+}
+
+
+TEST_CASE("kvstor lock-free find()")
+{
+    using stor_t = kvstor::storage_t<int, std::string, lock_free_traits_t<int, std::string>>;
+    static_assert(stor_t::lock_free_find);
+
+    stor_t stor{ 3 };
+    REQUIRE(!stor.find(1));
+
+    stor.push(1, "10");
+    stor.push(2, "20");
+    stor.push(3, "30");
+    REQUIRE(stor.find(1).value() == "10");
+    REQUIRE(stor.find(2).value() == "20");
+    REQUIRE(stor.find(3).value() == "30");
+
+    stor.push(2, "22");
+    REQUIRE(stor.find(2).value() == "22");
+
+    // evicts 1
+    stor.push(4, "40");
+    REQUIRE(!stor.find(1));
+    REQUIRE(stor.find(4).value() == "40");
+
+    stor_t::duration_t age{};
+    REQUIRE(stor.find(4, age).value() == "40");
+    REQUIRE(age >= stor_t::duration_t::zero());
+
+    std::optional<std::string> expected = std::string("40");
+    REQUIRE(stor.compare_exchange(4, "44", expected));
+    REQUIRE(stor.find(4).value() == "44");
+
+    stor.erase(3);
+    REQUIRE(!stor.find(3));
+
+    stor.map([](int, std::string & value) { value += "!"; });
+    REQUIRE(stor.find(2).value() == "22!");
+    REQUIRE(stor.find(4).value() == "44!");
+
+    stor.clear();
+    REQUIRE(!stor.find(2));
+    REQUIRE(!stor.find(4));
+
+    // the index grows past its initial size
+    stor_t big{ 100000 };
+    for (int key = 0; key < 100000; ++key)
+        big.push(key, std::to_string(key));
+
+    for (int key = 0; key < 100000; ++key)
+        REQUIRE(big.find(key).value() == std::to_string(key));
+}
+
+
+TEST_CASE("kvstor lock-free find() thread-safe")
+{
+    constexpr size_t max_count = 1000;
+    constexpr size_t rounds = 200;
+
+    using stor_t = kvstor::storage_t<size_t, std::string, lock_free_traits_t<size_t, std::string>>;
+    stor_t stor{ max_count / 2 };
+
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> errors{ 0 };
+
+    auto read = [&stor, &stop, &errors]()
+    {
+        while (!stop)
+        {
+            for (size_t key = 0; key < max_count; ++key)
+            {
+                const auto found = stor.find(key);
+                if (found && found->substr(0, found->find(':')) != std::to_string(key))
+                    ++errors;
+            }
+        }
+    };
+
+    auto r1 = std::async(std::launch::async, read);
+    auto r2 = std::async(std::launch::async, read);
+    auto r3 = std::async(std::launch::async, read);
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (size_t key = 0; key < max_count; ++key)
+        {
+            stor.push(key, std::to_string(key) + ":" + std::to_string(round));
+
+            if (key % 7 == 0)
+                stor.erase(key / 2);
+        }
+
+        if (round % 50 == 0)
+            stor.clear();
+    }
+
+    stop = true;
+    r1.wait();
+    r2.wait();
+    r3.wait();
+
+    REQUIRE(errors == 0);
+}
+
+
+TEST_CASE("kvstor::concurrent_index_t incremental growth")
+{
+    using index_t = kvstor::concurrent_index_t<size_t, size_t, std::hash<size_t>, std::equal_to<size_t>, std::chrono::steady_clock>;
+    const auto now = std::chrono::steady_clock::now();
+
+    index_t index{ 16 };
+    std::unordered_map<size_t, size_t> model;
+    bool migrating = false;
+
+    for (size_t key = 0; key < 5000; ++key)
+    {
+        index.publish(key, key, now);
+        model[key] = key;
+
+        // updates and removals while the previous table is copied
+        if (key % 3 == 0)
+        {
+            index.publish(key / 2, key, now);
+            model[key / 2] = key;
+        }
+
+        if (key % 5 == 0)
+        {
+            index.remove(key / 3);
+            model.erase(key / 3);
+        }
+
+        migrating = migrating || index.migrate(0) > 0;
+
+        if (key % 97 == 0)
+        {
+            for (size_t check = 0; check <= key; ++check)
+            {
+                const auto expected = model.find(check);
+                const auto found = index.find(check);
+
+                if (expected == model.end() ? found.has_value() : found != expected->second)
+                    FAIL("invalid value for key: ", check);
+            }
+        }
+    }
+
+    REQUIRE(migrating);
+    REQUIRE(index.migrate(SIZE_MAX) == 0);
+
+    for (size_t key = 0; key < 5000; ++key)
+    {
+        const auto expected = model.find(key);
+        REQUIRE(index.find(key) == (expected == model.end() ? std::nullopt : std::optional<size_t>{ expected->second }));
+    }
+
+    // a presized index does not grow up to max_size
+    index_t presized{ 5000, true };
+    for (size_t key = 0; key < 5000; ++key)
+    {
+        presized.publish(key, key, now);
+        REQUIRE(presized.migrate(0) == 0);
+    }
+}
+
+
+TEST_CASE("kvstor::concurrent_index_t growth with concurrent readers")
+{
+    using index_t = kvstor::concurrent_index_t<size_t, size_t, std::hash<size_t>, std::equal_to<size_t>, std::chrono::steady_clock>;
+    constexpr size_t stable_keys = 100;
+    const auto now = std::chrono::steady_clock::now();
+
+    index_t index{ 16 };
+    for (size_t key = 0; key < stable_keys; ++key)
+        index.publish(key, key, now);
+
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> errors{ 0 };
+
+    // the stable keys are present all the time, whatever table they are in
+    auto read = [&index, &stop, &errors]()
+    {
+        while (!stop)
+        {
+            for (size_t key = 0; key < stable_keys; ++key)
+            {
+                const auto found = index.find(key);
+                if (!found || found.value() != key)
+                    ++errors;
+            }
+        }
+    };
+
+    auto r1 = std::async(std::launch::async, read);
+    auto r2 = std::async(std::launch::async, read);
+
+    for (size_t round = 0; round < 5; ++round)
+    {
+        for (size_t key = stable_keys; key < 20000; ++key)
+        {
+            index.publish(key, key, now);
+
+            // rewrites of the stable keys keep their values
+            if (key % 10 == 0)
+                index.publish(key % stable_keys, key % stable_keys, now);
+        }
+
+        for (size_t key = stable_keys; key < 20000; ++key)
+            index.remove(key);
+    }
+
+    stop = true;
+    r1.wait();
+    r2.wait();
+
+    REQUIRE(errors == 0);
+}
+
+
+TEST_CASE("kvstor::concurrent_index_t readers during repeated growth")
+{
+    using index_t = kvstor::concurrent_index_t<size_t, size_t, std::hash<size_t>, std::equal_to<size_t>, std::chrono::steady_clock>;
+    constexpr size_t stable_keys = 64;
+    const auto now = std::chrono::steady_clock::now();
+
+    std::atomic<size_t> errors{ 0 };
+
+    // every round starts from the smallest table, so every copy of it completes while the readers look up
+    for (size_t round = 0; round < 50; ++round)
+    {
+        index_t index{ 16 };
+        for (size_t key = 0; key < stable_keys; ++key)
+            index.publish(key, key, now);
+
+        std::atomic<bool> stop{ false };
+
+        auto read = [&index, &stop, &errors]()
+        {
+            while (!stop)
+            {
+                for (size_t key = 0; key < stable_keys; ++key)
+                {
+                    const auto found = index.find(key);
+                    if (!found || found.value() != key)
+                        ++errors;
+                }
+            }
+        };
+
+        auto r1 = std::async(std::launch::async, read);
+        auto r2 = std::async(std::launch::async, read);
+
+        for (size_t key = stable_keys; key < 8192; ++key)
+        {
+            index.publish(key, key, now);
+
+            // completes some copies early, between the loads of the readers
+            if (key % 7 == 0)
+                index.migrate(key % 5);
+        }
+
+        stop = true;
+        r1.wait();
+        r2.wait();
+    }
+
+    REQUIRE(errors == 0);
+}
+
+
+namespace
+{
+    struct tracked_t
+    {
+        explicit tracked_t(std::atomic<size_t> & alive_, size_t value_)
+        :   alive(alive_)
+        ,   value(value_)
+        {
+            ++alive;
+        }
+
+        ~tracked_t()
+        {
+            value = 0;
+            --alive;
+        }
+
+        std::atomic<size_t> & alive;
+        size_t value;
+    };
+}
+
+
+TEST_CASE("kvstor::epoch_domain_t reclamation")
+{
+    std::atomic<size_t> alive{ 0 };
+
+    {
+        kvstor::epoch_domain_t domain;
+
+        tracked_t * item = new tracked_t(alive, 1);
+        domain.retire(item);
+        REQUIRE(domain.retired() == 1);
+        REQUIRE(alive == 1);
+
+        // the epoch advances twice before the item may be freed
+        domain.collect();
+        domain.collect();
+        domain.collect();
+        REQUIRE(domain.retired() == 0);
+        REQUIRE(alive == 0);
+
+        // a pinned reader on another thread holds back reclamation
+        std::promise<void> pinned;
+        std::promise<void> release;
+        auto reader = std::async(std::launch::async, [&domain, &pinned, &release]()
+        {
+            const auto guard = domain.pin();
+            pinned.set_value();
+            release.get_future().wait();
+        });
+
+        pinned.get_future().wait();
+        domain.retire(new tracked_t(alive, 2));
+
+        for (size_t i = 0; i < 10; ++i)
+            domain.collect();
+
+        REQUIRE(alive == 1);
+
+        release.set_value();
+        reader.wait();
+
+        domain.collect();
+        domain.collect();
+        domain.collect();
+        REQUIRE(alive == 0);
+
+        // the rest is freed with the domain
+        domain.retire(new tracked_t(alive, 3));
+        domain.retire(new tracked_t(alive, 4));
+        REQUIRE(alive == 2);
+    }
+
+    REQUIRE(alive == 0);
+}
+
+
+TEST_CASE("kvstor::epoch_domain_t nested pins and thread exit")
+{
+    std::atomic<size_t> alive{ 0 };
+    kvstor::epoch_domain_t domain;
+
+    {
+        const auto outer = domain.pin();
+        {
+            const auto inner = domain.pin();
+        }
+
+        // still pinned by the outer guard: the epoch moves at most once
+        const size_t epoch = domain.epoch();
+        domain.collect();
+        domain.collect();
+        REQUIRE(domain.epoch() <= epoch + 1);
+    }
+
+    // garbage of an exited thread is handed over with its record
+    std::async(std::launch::async, [&domain, &alive]()
+    {
+        domain.retire(new tracked_t(alive, 1));
+    }).wait();
+
+    REQUIRE(alive == 1);
+
+    std::async(std::launch::async, [&domain]()
+    {
+        for (size_t i = 0; i < 4; ++i)
+            domain.collect();
+    }).wait();
+
+    REQUIRE(alive == 0);
+}
+
+
+TEST_CASE("kvstor::epoch_domain_t stress")
+{
+    constexpr size_t readers = 4;
+    constexpr size_t writes = 20000;
+
+    std::atomic<size_t> alive{ 0 };
+    std::atomic<size_t> errors{ 0 };
+
+    {
+        kvstor::epoch_domain_t domain;
+        std::atomic<tracked_t *> shared{ new tracked_t(alive, 1) };
+        std::atomic<bool> stop{ false };
+
+        auto read = [&domain, &shared, &stop, &errors]()
+        {
+            while (!stop)
+            {
+                const auto guard = domain.pin();
+                const tracked_t * item = shared.load(std::memory_order_acquire);
+
+                // a freed item would have a zero value
+                if (item->value == 0)
+                    ++errors;
+            }
+        };
+
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < readers; ++i)
+            futures.push_back(std::async(std::launch::async, read));
+
+        for (size_t i = 2; i < writes; ++i)
+        {
+            tracked_t * old = shared.exchange(new tracked_t(alive, i), std::memory_order_acq_rel);
+            domain.retire(old);
+        }
+
+        stop = true;
+        for (auto & future : futures)
+            future.wait();
+
+        // without pinned readers everything but the current item is freed
+        for (size_t i = 0; i < 3; ++i)
+            domain.collect();
+
+        REQUIRE(alive == 1);
+        delete shared.load();
+    }
+
+    REQUIRE(errors == 0);
+    REQUIRE(alive == 0);
+}
+
+
+TEST_CASE("kvstor lock-free contains() / peek()")
+{
+    using stor_t = kvstor::storage_t<int, std::string, lock_free_traits_t<int, std::string>>;
+    stor_t stor{ 2 };
+
+    stor.push(1, "10");
+    stor.push(2, "20");
+    REQUIRE(stor.contains(1));
+    REQUIRE(stor.count(std::vector<int>{ 1, 2, 3 }) == 2);
+    REQUIRE(stor.age(2).value() >= stor_t::duration_t::zero());
+
+    std::string copy;
+    REQUIRE(stor.peek(2, [&copy](const std::string & value) { copy = value; }));
+    REQUIRE(copy == "20");
+
+    stor.push(3, "30");
+    REQUIRE(!stor.contains(1));
+    REQUIRE(stor.contains(std::vector<int>{ 1, 2, 3 }) == std::vector<bool>{ false, true, true });
+}
@@ -0,0 +1,113 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor.h"
+#include "../bench/kvstor_trace.h"
+#include "doctest.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+
+    const char * const fixed_trace =
+        "# fixed trace\n"
+        "set 1 100 10\n"
+        "set 2 200 20\n"
+        "get 1          # hit\n"
+        "set 3 300 30\n"
+        "get 1\n"
+        "get 3\n"
+        "DEL 3\n"
+        "get 3\n"
+        "get user:42 50\n";
+
+
+    template <class key_type, class value_type>
+    struct size_weight_traits_t : kvstor::traits_t<key_type, value_type>
+    {
+        using codec_t = kvstor_bench::trace_size_codec_t<value_type>;
+    };
+
+
+    std::vector<kvstor_bench::trace_record_t> read_fixed_trace()
+    {
+        std::istringstream input{ fixed_trace };
+        return kvstor_bench::read_text_trace(input);
+    }
+
+}   // namespace
+
+
+TEST_CASE("kvstor_bench::read_text_trace()")
+{
+    const std::vector<kvstor_bench::trace_record_t> records = read_fixed_trace();
+    REQUIRE(records.size() == 9);
+
+    REQUIRE(records[0].op == kvstor_bench::trace_op_t::set);
+    REQUIRE(records[0].key == 1);
+    REQUIRE(records[0].size == 100);
+    REQUIRE(records[0].timestamp == 10);
+
+    // without a timestamp the operation is numbered
+    REQUIRE(records[2].op == kvstor_bench::trace_op_t::get);
+    REQUIRE(records[2].size == 0);
+    REQUIRE(records[2].timestamp == 2);
+
+    REQUIRE(records[6].op == kvstor_bench::trace_op_t::del);
+    REQUIRE(records[8].key == kvstor_bench::parse_trace_key("user:42"));
+    REQUIRE(records[8].key == kvstor::fast_hash_t::hash_bytes("user:42", 7));
+    REQUIRE(records[8].size == 50);
+
+    std::istringstream invalid{ "put 1\n" };
+    REQUIRE_THROWS(kvstor_bench::read_text_trace(invalid));
+
+    std::istringstream no_key{ "get\n" };
+    REQUIRE_THROWS(kvstor_bench::read_text_trace(no_key));
+}
+
+
+TEST_CASE("kvstor_bench::write_binary_trace()")
+{
+    const std::vector<kvstor_bench::trace_record_t> records = read_fixed_trace();
+    const std::string path = "kvstor_trace_test.bin";
+
+    kvstor_bench::write_binary_trace(path, records);
+    const std::vector<kvstor_bench::trace_record_t> loaded = kvstor_bench::read_trace(path);
+    std::remove(path.c_str());
+
+    REQUIRE(loaded.size() == records.size());
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        REQUIRE(loaded[i].op == records[i].op);
+        REQUIRE(loaded[i].key == records[i].key);
+        REQUIRE(loaded[i].size == records[i].size);
+        REQUIRE(loaded[i].timestamp == records[i].timestamp);
+    }
+}
+
+
+TEST_CASE("kvstor_bench::replay_trace()")
+{
+    const std::vector<kvstor_bench::trace_record_t> records = read_fixed_trace();
+
+    // find() keeps the order: set 3 evicts key 1 although it was just read
+    using stor_t = kvstor::storage_t<uint64_t, uint32_t>;
+    const kvstor_bench::trace_result_t result = kvstor_bench::replay_trace<stor_t>(records, 2, 1);
+
+    REQUIRE(result.gets == 5);
+    REQUIRE(result.hits == 2);
+    REQUIRE(result.latencies.size() == records.size());
+    REQUIRE(result.percentile(0) <= result.percentile(1));
+
+    // 300 bytes: set 3 evicts keys 1 and 2
+    using sized_stor_t = kvstor::storage_t<uint64_t, uint32_t, size_weight_traits_t<uint64_t, uint32_t>>;
+    const kvstor_bench::trace_result_t sized = kvstor_bench::replay_trace<sized_stor_t>(records, 300, 1);
+
+    REQUIRE(sized.gets == 5);
+    REQUIRE(sized.hits == 1);
+}
@@ -0,0 +1,344 @@
+﻿#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+
+#include "kvstor.h"
+#include "../bench/kvstor_workload.h"
+#include "doctest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+    template <class key_type, class value_type>
+    struct lock_free_traits_t : kvstor::fast_hash_traits_t<key_type, value_type>
+    {
+        static constexpr bool lock_free_find = true;
+    };
+
+
+    std::vector<size_t> histogram(kvstor_bench::workload_t & workload, size_t samples)
+    {
+        std::vector<size_t> counts(workload.config().keys);
+        for (size_t i = 0; i < samples; ++i)
+            ++counts[workload.next_key()];
+
+        return counts;
+    }
+
+
+    // the value of a key is derived from it, so readers can detect torn or misplaced entries
+    std::string make_value(uint64_t key, size_t size)
+    {
+        std::string value = std::to_string(key) + ":";
+        value.resize(std::max(size, value.size()), static_cast<char>('a' + key % 26));
+        return value;
+    }
+
+
+    bool is_value_of(uint64_t key, const std::string & value)
+    {
+        return value == make_value(key, value.size());
+    }
+
+}   // namespace
+
+
+TEST_CASE("kvstor_bench::zipf_t")
+{
+    kvstor_bench::random_t random{ 1 };
+
+    const kvstor_bench::zipf_t zipf{ 1000, 1.0 };
+    std::vector<size_t> counts(1000);
+
+    constexpr size_t samples = 1000000;
+    for (size_t i = 0; i < samples; ++i)
+        ++counts[zipf(random)];
+
+    // with skew 1 rank r is requested (r + 1) times less often than rank 0
+    REQUIRE(counts[1] * 2 == doctest::Approx(counts[0]).epsilon(0.05));
+    REQUIRE(counts[9] * 10 == doctest::Approx(counts[0]).epsilon(0.1));
+
+    double harmonic = 0;
+    for (size_t rank = 1; rank <= 1000; ++rank)
+        harmonic += 1.0 / rank;
+
+    REQUIRE(counts[0] == doctest::Approx(samples / harmonic).epsilon(0.02));
+
+    // skew 0 is uniform
+    const kvstor_bench::zipf_t flat{ 4, 0.0 };
+    std::vector<size_t> flat_counts(4);
+    for (size_t i = 0; i < 100000; ++i)
+        ++flat_counts[flat(random)];
+
+    for (size_t count : flat_counts)
+        REQUIRE(count == doctest::Approx(25000).epsilon(0.05));
+
+    REQUIRE(kvstor_bench::zipf_t{ 1, 0.99 }(random) == 0);
+    REQUIRE_THROWS(kvstor_bench::zipf_t{ 0, 0.99 });
+    REQUIRE_THROWS(kvstor_bench::zipf_t{ 10, -1.0 });
+}
+
+
+TEST_CASE("kvstor_bench::workload_t patterns")
+{
+    kvstor_bench::workload_config_t config;
+    config.keys = 100;
+
+    SUBCASE("uniform")
+    {
+        config.pattern = kvstor_bench::pattern_t::uniform;
+        kvstor_bench::workload_t workload{ config };
+
+        for (size_t count : histogram(workload, 100000))
+            REQUIRE(count == doctest::Approx(1000).epsilon(0.2));
+    }
+
+    SUBCASE("hotspot")
+    {
+        config.pattern = kvstor_bench::pattern_t::hotspot;
+        config.hot_keys = 0.1;
+        config.hot_ops = 0.9;
+        kvstor_bench::workload_t workload{ config };
+
+        const std::vector<size_t> counts = histogram(workload, 100000);
+
+        size_t hot = 0;
+        for (size_t key = 0; key < 10; ++key)
+            hot += counts[key];
+
+        REQUIRE(hot == doctest::Approx(90000).epsilon(0.02));
+    }
+
+    SUBCASE("scan")
+    {
+        config.pattern = kvstor_bench::pattern_t::scan;
+        kvstor_bench::workload_t workload{ config };
+
+        const uint64_t first = workload.next_key();
+        for (uint64_t i = 1; i < 250; ++i)
+            REQUIRE(workload.next_key() == (first + i) % 100);
+    }
+
+    SUBCASE("latest")
+    {
+        config.pattern = kvstor_bench::pattern_t::latest;
+        config.mix = kvstor_bench::mix_t{ 50, 50, 0, 0 };
+        kvstor_bench::workload_t workload{ config };
+
+        uint64_t latest = 99;
+        size_t recent = 0;
+        size_t reads = 0;
+
+        for (size_t i = 0; i < 10000; ++i)
+        {
+            const kvstor_bench::operation_t operation = workload.next();
+            if (operation.op == kvstor_bench::op_t::write)
+            {
+                // writes insert new keys
+                REQUIRE(operation.key == latest + 1);
+                latest = operation.key;
+                continue;
+            }
+
+            REQUIRE(operation.key <= latest);
+            REQUIRE(latest - operation.key < 100);
+
+            ++reads;
+            recent += latest - operation.key < 10 ? 1 : 0;
+        }
+
+        REQUIRE(recent > reads / 2);
+    }
+
+    SUBCASE("latest streams")
+    {
+        config.pattern = kvstor_bench::pattern_t::latest;
+        config.streams = 3;
+
+        // every stream writes its own new keys, together they cover the keys after the initial ones
+        std::vector<uint64_t> written;
+        for (uint64_t stream = 0; stream < 3; ++stream)
+        {
+            kvstor_bench::workload_t workload{ config, stream };
+            for (size_t i = 0; i < 100; ++i)
+                written.push_back(workload.next_key(kvstor_bench::op_t::write));
+
+            // reads stay below the common write front
+            for (size_t i = 0; i < 100; ++i)
+                REQUIRE(workload.next_key() < 100 + 3 * 100);
+        }
+
+        std::sort(written.begin(), written.end());
+        for (size_t i = 0; i < written.size(); ++i)
+            REQUIRE(written[i] == 100 + i);
+
+        config.streams = 0;
+        REQUIRE_THROWS(kvstor_bench::workload_t{ config });
+    }
+}
+
+
+TEST_CASE("kvstor_bench::workload_t mix and value sizes")
+{
+    kvstor_bench::workload_config_t config;
+    config.mix = kvstor_bench::parse_mix("70/20/5/5");
+    config.min_value_size = 10;
+    config.max_value_size = 20;
+
+    REQUIRE(config.mix.read == 70);
+    REQUIRE(config.mix.erase == 5);
+
+    kvstor_bench::workload_t workload{ config };
+    size_t counts[4] = {};
+
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        const kvstor_bench::operation_t operation = workload.next();
+        ++counts[static_cast<size_t>(operation.op)];
+
+        REQUIRE(operation.key < config.keys);
+
+        if (operation.op == kvstor_bench::op_t::write || operation.op == kvstor_bench::op_t::cas)
+        {
+            REQUIRE(operation.value_size >= 10);
+            REQUIRE(operation.value_size <= 20);
+        }
+    }
+
+    REQUIRE(counts[0] == doctest::Approx(70000).epsilon(0.03));
+    REQUIRE(counts[1] == doctest::Approx(20000).epsilon(0.05));
+    REQUIRE(counts[2] == doctest::Approx(5000).epsilon(0.1));
+    REQUIRE(counts[3] == doctest::Approx(5000).epsilon(0.1));
+
+    // streams are reproducible and independent
+    kvstor_bench::workload_t same{ config };
+    kvstor_bench::workload_t other{ config, 1 };
+    kvstor_bench::workload_t again{ config };
+
+    size_t equal = 0;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        const uint64_t key = same.next_key();
+        REQUIRE(again.next_key() == key);
+        equal += other.next_key() == key ? 1 : 0;
+    }
+
+    REQUIRE(equal < 50);
+
+    REQUIRE(kvstor_bench::parse_pattern("hotspot") == kvstor_bench::pattern_t::hotspot);
+    REQUIRE(std::string(kvstor_bench::pattern_name(kvstor_bench::pattern_t::latest)) == "latest");
+    REQUIRE_THROWS(kvstor_bench::parse_pattern("random"));
+
+    config.mix = kvstor_bench::mix_t{ 0, 0, 0, 0 };
+    REQUIRE_THROWS(kvstor_bench::workload_t{ config });
+}
+
+
+TEST_CASE("kvstor_bench::workload_t lognormal value sizes")
+{
+    kvstor_bench::workload_config_t config;
+    config.min_value_size = 10;
+    config.max_value_size = 10000;
+    config.value_sizes = kvstor_bench::size_distribution_t::lognormal;
+
+    kvstor_bench::workload_t workload{ config };
+
+    std::vector<size_t> sizes(100000);
+    for (size_t & size : sizes)
+    {
+        size = workload.next_value_size();
+        REQUIRE(size >= 10);
+        REQUIRE(size <= 10000);
+    }
+
+    std::sort(sizes.begin(), sizes.end());
+
+    // the median is at the geometric mean of the bounds, the tail is long: p90 is e^(1.28 sigma) times the median
+    REQUIRE(static_cast<double>(sizes[50000]) == doctest::Approx(316).epsilon(0.05));
+    REQUIRE(static_cast<double>(sizes[90000]) == doctest::Approx(316 * std::exp(1.2816)).epsilon(0.05));
+
+    double mean = 0;
+    for (size_t size : sizes)
+        mean += static_cast<double>(size) / sizes.size();
+
+    REQUIRE(mean > 1.4 * sizes[50000]);
+
+    REQUIRE(kvstor_bench::parse_size_distribution("lognormal") == kvstor_bench::size_distribution_t::lognormal);
+    REQUIRE(std::string(kvstor_bench::size_distribution_name(kvstor_bench::size_distribution_t::uniform)) == "uniform");
+    REQUIRE_THROWS(kvstor_bench::parse_size_distribution("zipf"));
+
+    config.size_sigma = -1;
+    REQUIRE_THROWS(kvstor_bench::workload_t{ config });
+}
+
+
+TEST_CASE_TEMPLATE("kvstor mixed workload stress", traits_type,
+    kvstor::fast_hash_traits_t<uint64_t, std::string>, lock_free_traits_t<uint64_t, std::string>)
+{
+    using stor_t = kvstor::storage_t<uint64_t, std::string, traits_type>;
+
+    for (kvstor_bench::pattern_t pattern : { kvstor_bench::pattern_t::zipf, kvstor_bench::pattern_t::hotspot,
+        kvstor_bench::pattern_t::scan, kvstor_bench::pattern_t::latest })
+    {
+        CAPTURE(kvstor_bench::pattern_name(pattern));
+
+        kvstor_bench::workload_config_t config;
+        config.pattern = pattern;
+        config.keys = 2000;
+        config.mix = kvstor_bench::mix_t{ 70, 20, 5, 5 };
+        config.min_value_size = 8;
+        config.max_value_size = 64;
+        config.streams = 4;
+
+        stor_t stor{ 500 };
+        std::atomic<size_t> hits{ 0 };
+        std::atomic<size_t> corrupted{ 0 };
+
+        auto worker = [&stor, &config, &hits, &corrupted](uint64_t stream)
+        {
+            kvstor_bench::workload_t workload{ config, stream };
+
+            for (size_t i = 0; i < 20000; ++i)
+            {
+                const kvstor_bench::operation_t operation = workload.next();
+
+                if (operation.op == kvstor_bench::op_t::read)
+                {
+                    const auto found = stor.find(operation.key);
+                    if (found && !is_value_of(operation.key, *found))
+                        ++corrupted;
+
+                    hits += found ? 1 : 0;
+                    continue;
+                }
+
+                kvstor_bench::apply(stor, operation, make_value);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (uint64_t stream = 0; stream < 4; ++stream)
+            threads.emplace_back(worker, stream);
+
+        for (std::thread & thread : threads)
+            thread.join();
+
+        REQUIRE(corrupted == 0);
+        REQUIRE(hits > 0);
+        REQUIRE(stor.size() <= 500);
+
+        stor.for_each([&corrupted](const uint64_t & key, const std::string & value)
+        {
+            if (!is_value_of(key, value))
+                ++corrupted;
+        });
+
+        REQUIRE(corrupted == 0);
+    }
+}